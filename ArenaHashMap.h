@@ -0,0 +1,305 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#include "Bucket.h"
+#include "Memory.h"
+
+namespace thread_safe {
+
+/*
+ * A node of ArenaHashMap. The link is the 32 bit arena index of the next
+ * node of the chain.
+ */
+template <typename ValueT>
+struct ArenaNode
+{
+    explicit ArenaNode(const ValueT& value)
+        : m_next(NodeArena<ArenaNode>::NIL)
+        , m_value(value)
+    {}
+
+    std::uint32_t m_next;
+    ValueT m_value;
+};
+
+/*
+ * A HashMap variant for large maps of small pairs. Nodes live in a
+ * NodeArena owned by the map and link to each other with 32 bit indices,
+ * so a pair of two 32 bit integers takes a 12 byte node with no malloc
+ * header, against the 32 bytes a Node allocated with new occupies.
+ * A map holds at most 2^32 - 1 pairs.
+ * Every bucket has its own mutex. Lookups copy the mapped value out, as
+ * there are no iterators.
+ */
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT = std::hash<KeyT>,
+          typename KeyEqualT = std::equal_to<KeyT> >
+class ArenaHashMap
+{
+public:
+    typedef KeyT key_type;
+    typedef MappedT mapped_type;
+    typedef Pair<const KeyT, MappedT> value_type;
+    typedef std::size_t size_type;
+    typedef HashT hasher;
+    typedef KeyEqualT key_equal;
+
+    /* Constructors */
+public:
+    explicit ArenaHashMap(const hasher& hash = hasher());
+    explicit ArenaHashMap(const MemoryOptions& memory, const hasher& hash = hasher());
+    ArenaHashMap(const ArenaHashMap&) = delete;
+    ArenaHashMap& operator= (const ArenaHashMap&) = delete;
+    ~ArenaHashMap();
+
+    /* Mutators */
+public:
+    bool insert(const key_type& key, const mapped_type& value);
+    void insert_or_assign(const key_type& key, const mapped_type& value);
+    bool erase(const key_type& key);
+    void clear();
+
+    /* Selectors */
+public:
+    bool find(const key_type& key, mapped_type& value) const;
+    template <typename FnT>
+    void for_each(FnT fn) const;
+    size_type size() const;
+    bool empty() const;
+
+    /* Private members and helper functions */
+private:
+    typedef ArenaNode<value_type> node_type;
+    typedef NodeArena<node_type> arena_type;
+    typedef typename arena_type::index_type index_type;
+
+    struct ArenaBucket
+    {
+        ArenaBucket()
+            : m_head(arena_type::NIL)
+            , m_size(0)
+        {}
+
+        mutable std::mutex m_mutex;
+        index_type m_head;
+        std::uint32_t m_size;
+    };
+
+    ArenaBucket& bucket(const key_type& key) const;
+    index_type* find_link(const ArenaBucket& bucket, const key_type& key) const;
+    index_type create_node(const key_type& key, const mapped_type& value);
+    void destroy_node(index_type index);
+
+private:
+    std::unique_ptr<ArenaBucket[]> m_buckets;
+    arena_type m_arena;
+    hasher m_hasher;
+    key_equal m_key_equal;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME ArenaHashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT>
+
+TEMPLATE_DECL
+CLASS_NAME::ArenaHashMap(const hasher& hash)
+    : m_buckets(new ArenaBucket[BUCKET_COUNT])
+    , m_arena()
+    , m_hasher(hash)
+    , m_key_equal()
+{}
+
+/*
+ * Constructor with the nodes placed as the memory options say. Only huge
+ * pages apply, the arena has no NUMA placement.
+ */
+TEMPLATE_DECL
+CLASS_NAME::ArenaHashMap(const MemoryOptions& memory, const hasher& hash)
+    : m_buckets(new ArenaBucket[BUCKET_COUNT])
+    , m_arena(memory.m_huge_pages)
+    , m_hasher(hash)
+    , m_key_equal()
+{}
+
+TEMPLATE_DECL
+CLASS_NAME::~ArenaHashMap()
+{
+    clear();
+}
+
+/*
+ * Insertion
+ * Returns false if there already is a pair with the key
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::insert(const key_type& key, const mapped_type& value)
+{
+    ArenaBucket& b = bucket(key);
+    std::lock_guard<std::mutex> lck(b.m_mutex);
+    index_type* link = find_link(b, key);
+    if (*link != arena_type::NIL) {
+        return false;
+    }
+    *link = create_node(key, value);
+    ++b.m_size;
+    return true;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    ArenaBucket& b = bucket(key);
+    std::lock_guard<std::mutex> lck(b.m_mutex);
+    index_type* link = find_link(b, key);
+    if (*link != arena_type::NIL) {
+        m_arena.at(*link)->m_value.second = value;
+        return;
+    }
+    *link = create_node(key, value);
+    ++b.m_size;
+}
+
+/*
+ * Deletion
+ * Returns false if there is no pair with the key
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::erase(const key_type& key)
+{
+    ArenaBucket& b = bucket(key);
+    std::lock_guard<std::mutex> lck(b.m_mutex);
+    index_type* link = find_link(b, key);
+    const index_type index = *link;
+    if (index == arena_type::NIL) {
+        return false;
+    }
+    *link = m_arena.at(index)->m_next;
+    destroy_node(index);
+    --b.m_size;
+    return true;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::clear()
+{
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        ArenaBucket& b = m_buckets[i];
+        std::lock_guard<std::mutex> lck(b.m_mutex);
+        while (b.m_head != arena_type::NIL) {
+            const index_type index = b.m_head;
+            b.m_head = m_arena.at(index)->m_next;
+            destroy_node(index);
+        }
+        b.m_size = 0;
+    }
+}
+
+/*
+ * Copies the mapped value of the key to value.
+ * Returns false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::find(const key_type& key, mapped_type& value) const
+{
+    const ArenaBucket& b = bucket(key);
+    std::lock_guard<std::mutex> lck(b.m_mutex);
+    const index_type index = *find_link(b, key);
+    if (index == arena_type::NIL) {
+        return false;
+    }
+    value = m_arena.at(index)->m_value.second;
+    return true;
+}
+
+/*
+ * Calls fn with every pair, each bucket being locked while its pairs are
+ * visited
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::for_each(FnT fn) const
+{
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        const ArenaBucket& b = m_buckets[i];
+        std::lock_guard<std::mutex> lck(b.m_mutex);
+        for (index_type index = b.m_head; index != arena_type::NIL; index = m_arena.at(index)->m_next) {
+            fn(m_arena.at(index)->m_value);
+        }
+    }
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::size() const
+{
+    size_type s = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        std::lock_guard<std::mutex> lck(m_buckets[i].m_mutex);
+        s += m_buckets[i].m_size;
+    }
+    return s;
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return size() == 0;
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::ArenaBucket& CLASS_NAME::bucket(const key_type& key) const
+{
+    return m_buckets[m_hasher(key) % BUCKET_COUNT];
+}
+
+/*
+ * Returns the link which holds the index of the node with the key, or
+ * the NIL link at the end of the chain if there is none. The bucket must
+ * be locked.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::index_type* CLASS_NAME::find_link(const ArenaBucket& bucket, const key_type& key) const
+{
+    index_type* link = const_cast<index_type*>(&bucket.m_head);
+    while (*link != arena_type::NIL) {
+        node_type* node = m_arena.at(*link);
+        if (m_key_equal(node->m_value.first, key)) {
+            break;
+        }
+        link = &node->m_next;
+    }
+    return link;
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::index_type CLASS_NAME::create_node(const key_type& key, const mapped_type& value)
+{
+    const index_type index = m_arena.allocate();
+    new (m_arena.at(index)) node_type(value_type(key, value));
+    return index;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::destroy_node(index_type index)
+{
+    node_type* node = m_arena.at(index);
+    node->~node_type();
+    m_arena.deallocate(index);
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -1,11 +1,112 @@
 #pragma once
 
+#include <chrono>
+#include <climits>
 #include <cstddef>
+#include <cstdint>
 #include <atomic>
+#include <ctime>
+#include <memory>
 #include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <optional>
+#endif
+
+#include "Memory.h"
 
 namespace thread_safe {
 
+namespace detail {
+
+/*
+ * Tells the CPU that the calling thread is spinning
+ */
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/*
+ * The table where readers of reader biased bucket locks announce
+ * themselves. A slot holds the lock its reader has entered.
+ */
+const std::size_t VISIBLE_READERS = 4096;
+
+inline std::atomic<const void*>* visible_readers()
+{
+    static std::atomic<const void*> table[VISIBLE_READERS];
+    return table;
+}
+
+/*
+ * Returns a number which tells the calling thread from the other running
+ * threads: the address of a thread local
+ */
+inline std::uintptr_t thread_identity()
+{
+    thread_local char marker;
+    return reinterpret_cast<std::uintptr_t>(&marker);
+}
+
+/*
+ * Returns the slot of the calling thread for the lock, spread over the
+ * table by the identity of the thread and the address of the lock
+ */
+inline std::atomic<const void*>& visible_reader_slot(const void* lock)
+{
+    std::uint64_t hash = thread_identity() * 0x9e3779b97f4a7c15ull;
+    hash ^= (reinterpret_cast<std::uintptr_t>(lock) >> 6) * 0xc2b2ae3d27d4eb4full;
+    return visible_readers()[(hash >> 32) % VISIBLE_READERS];
+}
+
+inline std::int64_t steady_nanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Sleeps while the word holds the expected value, at most for the given
+ * time. May return early, so the caller checks again what it waits for.
+ */
+inline void futex_wait(const std::atomic<std::uint32_t>* word, std::uint32_t expected, std::int64_t nanoseconds)
+{
+    timespec timeout;
+    timeout.tv_sec = static_cast<std::time_t>(nanoseconds / 1000000000);
+    timeout.tv_nsec = static_cast<long>(nanoseconds % 1000000000);
+    ::syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, &timeout, nullptr, 0);
+}
+
+inline void futex_wait(const std::atomic<std::uint32_t>* word, std::uint32_t expected)
+{
+    ::syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+inline void futex_wake_one(const std::atomic<std::uint32_t>* word)
+{
+    ::syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+inline void futex_wake_all(const std::atomic<std::uint32_t>* word)
+{
+    ::syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+} // namespace detail
+
 /*
  * A structure which stores two instances of any type.
  * It's like the std::pair and even implicitly constructs from it.
@@ -63,6 +164,55 @@ Pair<T1, T2> make_pair(const T1& f, const T2& s)
     return Pair<T1, T2>(f, s);
 }
 
+/*
+ * Holds a value which is loaded and stored atomically like the value of a
+ * std::atomic<T>, with the same size and alignment. Unlike std::atomic
+ * it also lends out a const reference to the value in place, which is
+ * safe for as long as the caller keeps out all writers, e.g. while it
+ * holds the bucket of the value locked. This lets a reader pick single
+ * fields out of a large value without copying all of it.
+ * T must be trivially copyable.
+ */
+template <typename T>
+class AtomicValue
+{
+public:
+    explicit AtomicValue(const T& value)
+        : m_value(value)
+    {}
+    AtomicValue(const AtomicValue&) = delete;
+    AtomicValue& operator= (const AtomicValue&) = delete;
+
+    T load(std::memory_order order = std::memory_order_seq_cst) const
+    {
+        T result;
+        __atomic_load(const_cast<T*>(&m_value), &result, static_cast<int>(order));
+        return result;
+    }
+
+    void store(const T& value, std::memory_order order = std::memory_order_seq_cst)
+    {
+        T copy(value);
+        __atomic_store(&m_value, &copy, static_cast<int>(order));
+    }
+
+    /*
+     * The value in place, valid while no writer can run
+     */
+    const T& ref() const
+    {
+        return m_value;
+    }
+
+private:
+    // Sizes which fit in a register are aligned to their size, as
+    // std::atomic does, so they are loaded and stored without locks
+    static const std::size_t ALIGNMENT =
+        sizeof(T) <= 16 && (sizeof(T) & (sizeof(T) - 1)) == 0 && sizeof(T) > alignof(T) ? sizeof(T) : alignof(T);
+
+    alignas(ALIGNMENT) T m_value;
+};
+
 /*
  * Each Bucket object is a doubly linked list, and Node
  * is the type of nodes in that list
@@ -82,244 +232,1078 @@ struct Node
 
     Node* m_prev;
     Node* m_next;
-    std::atomic<ValueT> m_value;
+    AtomicValue<ValueT> m_value;
 };
 
 /*
- * HashMap contains an array of Buckets as storage.
- * Each Bucket is a doubly linked list.
+ * Receives every change of a Bucket while the Bucket is still locked,
+ * so the calls for one bucket come in the order the changes were made.
+ * Implementations must be quick and must not call back into the map.
  */
-template <typename KeyT,
-          typename ValueT,
-          typename KeyEqualT>
-class Bucket
+template <typename ValueT>
+class MutationListener
 {
 public:
-    Bucket();
-    Bucket(const Bucket&);
-    Bucket(Bucket&&);
-    Bucket& operator= (const Bucket&);
-    Bucket& operator= (Bucket&&);
-    ~Bucket();
+    virtual ~MutationListener()
+    {}
 
-    Pair<Node<ValueT>*, bool> insert(const ValueT& value);
-    Node<ValueT>* insert_or_assign(const ValueT& value);
-    Node<ValueT>* find(const KeyT& key);
-    const Node<ValueT>* find(const KeyT& key) const;
-    void erase(const KeyT& key);
-    void erase(Node<ValueT>* node);
-    void clear();
-    std::size_t size() const;
-    bool empty() const;
-    Node<ValueT>* begin();
-    const Node<ValueT>* begin() const;
-    Node<ValueT>* end();
-    const Node<ValueT>* end() const;
+    virtual void on_insert(const ValueT& value) = 0;
+    virtual void on_assign(const ValueT& value) = 0;
+    virtual void on_erase(const ValueT& value) = 0;
+};
+
+/*
+ * Forwards every change to several listeners in the order they are given.
+ * The list is fixed at construction; HashMap builds a new one whenever a
+ * listener is added or removed.
+ */
+template <typename ValueT>
+class MutationFanout : public MutationListener<ValueT>
+{
+public:
+    explicit MutationFanout(const std::vector<MutationListener<ValueT>*>& listeners)
+        : m_listeners(listeners)
+    {}
+
+    void on_insert(const ValueT& value) override
+    {
+        for (auto listener : m_listeners) {
+            listener->on_insert(value);
+        }
+    }
+
+    void on_assign(const ValueT& value) override
+    {
+        for (auto listener : m_listeners) {
+            listener->on_assign(value);
+        }
+    }
+
+    void on_erase(const ValueT& value) override
+    {
+        for (auto listener : m_listeners) {
+            listener->on_erase(value);
+        }
+    }
 
 private:
-    mutable std::recursive_mutex m_mutex;
-    std::size_t m_size;
-    Node<ValueT>* m_end;
-    KeyEqualT m_key_equal;
+    const std::vector<MutationListener<ValueT>*> m_listeners;
 };
 
-#define TEMPLATE_DECL template <typename KeyT, typename ValueT, typename KeyEqualT>
-#define CLASS_NAME Bucket<KeyT, ValueT, KeyEqualT>
-
 /*
- * Default constructor
+ * The recursive mutex of a Bucket. It is a futex word with the owner and
+ * the depth next to it, so it takes a fraction of a std::recursive_mutex
+ * and an unlock without sleepers is a single exchange.
+ * Besides locking it lets a caller which must not block queue a Waiter
+ * instead, which is resumed by the thread releasing the mutex, but only
+ * once that thread holds no bucket lock at all, so a waiter never runs
+ * inside another critical section of the thread. Waiters are resumed one
+ * at a time in the order they were queued, each with the mutex locked on
+ * its behalf, and must unlock it. Only one thread resumes the waiters of
+ * a mutex at a time, and every thread does so in a loop, so a waiter
+ * which unlocks a mutex or queues another waiter does not resume waiters
+ * from within its resume call. A mutex with waiters must not be
+ * destroyed.
+ * With reader bias enabled, readers of a bucket which is not being
+ * written do not touch the mutex at all: they announce themselves in a
+ * slot of the global visible readers table. A writer takes the mutex,
+ * revokes the bias and waits until the table holds no reader of the
+ * bucket. The bias is granted again by a reader only after a period
+ * proportional to the cost of the revocation, so buckets which are
+ * written often fall back to plain locking.
+ * The waiter queue and the state of the bias are allocated when the
+ * first waiter is queued or the bias is first enabled, so a mutex which
+ * uses neither stays a few words.
  */
-TEMPLATE_DECL
-CLASS_NAME::Bucket()
-    : m_size(0)
-    , m_end(nullptr)
+class BucketMutex
 {
-    m_end = new Node<ValueT>();
-    m_end->m_next = m_end;
-    m_end->m_prev = m_end;
+public:
+    struct Waiter
+    {
+        void (*m_resume)(Waiter* waiter);
+        Waiter* m_next;
+    };
+
+    /*
+     * Holds the mutex for reading
+     */
+    class SharedLock
+    {
+    public:
+        explicit SharedLock(BucketMutex& mutex)
+            : m_mutex(mutex)
+            , m_slot(mutex.lock_shared())
+        {}
+        SharedLock(const SharedLock&) = delete;
+        SharedLock& operator= (const SharedLock&) = delete;
+        ~SharedLock()
+        {
+            m_mutex.unlock_shared(m_slot);
+        }
+
+    private:
+        BucketMutex& m_mutex;
+        std::atomic<const void*>* m_slot;
+    };
+
+    static const std::int64_t INHIBIT_FACTOR = 9;
+    static const unsigned SPINS = 64;
+
+public:
+    BucketMutex();
+    BucketMutex(const BucketMutex&) = delete;
+    BucketMutex& operator= (const BucketMutex&) = delete;
+    ~BucketMutex();
+
+    void lock();
+    bool try_lock();
+    void unlock();
+    std::atomic<const void*>* lock_shared();
+    bool try_lock_shared(std::atomic<const void*>*& slot);
+    void unlock_shared(std::atomic<const void*>* slot);
+    bool try_lock_queued();
+    bool lock_or_enqueue(Waiter& waiter);
+    void set_reader_bias(bool enabled);
+
+private:
+    /*
+     * The waiter queue and the state of reader bias
+     */
+    struct Extension
+    {
+        Extension()
+            : m_waiters(nullptr)
+            , m_waiters_tail(nullptr)
+            , m_waking(false)
+            , m_read_bias(false)
+            , m_reader_bias(false)
+            , m_inhibit_until(0)
+        {
+            m_waiters_lock.clear();
+        }
+
+        std::atomic_flag m_waiters_lock;
+        std::atomic<Waiter*> m_waiters;
+        Waiter* m_waiters_tail;
+        std::atomic<bool> m_waking;
+        std::atomic<bool> m_read_bias;
+        bool m_reader_bias;
+        std::int64_t m_inhibit_until;
+    };
+
+    enum State : std::uint32_t
+    {
+        FREE,
+        LOCKED,
+        CONTENDED
+    };
+
+    /*
+     * The bucket locks held by a thread, reads without the mutex
+     * included, and whether it has waiters to resume once it holds none
+     */
+    struct HeldLocks
+    {
+        std::size_t m_count;
+        bool m_deferred;
+        bool m_resuming;
+    };
+
+    static HeldLocks& held_locks();
+    static std::vector<BucketMutex*>& deferred_wakes();
+    static void left_lock();
+    static void resume_deferred();
+    Extension& extension();
+    bool acquire();
+    bool try_acquire(bool& first);
+    void acquired(std::uintptr_t self);
+    void lock_contended();
+    std::atomic<const void*>* enter_as_visible_reader();
+    void locked_for_reading(bool first);
+    void revoke_reader_bias(Extension& extension);
+    void release();
+    void wake_waiters(Extension& extension);
+
+private:
+    std::atomic<std::uint32_t> m_state;
+    std::uint32_t m_depth;
+    std::atomic<std::uintptr_t> m_owner;
+    std::atomic<Extension*> m_extension;
+};
+
+inline BucketMutex::BucketMutex()
+    : m_state(FREE)
+    , m_depth(0)
+    , m_owner(0)
+    , m_extension(nullptr)
+{}
+
+inline BucketMutex::~BucketMutex()
+{
+    delete m_extension.load(std::memory_order_relaxed);
 }
 
-/*
- * Copy constructor
- */
-TEMPLATE_DECL
-CLASS_NAME::Bucket(const Bucket& that)
-    : m_size(that.m_size)
-    , m_end(nullptr)
+inline void BucketMutex::lock()
 {
-    m_end = new Node<ValueT>();
-    m_end->m_next = m_end;
-    m_end->m_prev = m_end;
-    
-    // Locks the source so that it won't be modified during the copy
-    std::lock_guard<std::recursive_mutex> lck(that.m_mutex);
-    Node<ValueT>* node = that.begin();
-    while (node != that.end()) {
-        Node<ValueT>* new_node = new Node<ValueT>();
-        new_node->m_value.store(node->m_value.load());
-        new_node->m_next = m_end;
-        new_node->m_prev = m_end->m_prev;
-        new_node->m_next->m_prev = new_node;
-        new_node->m_prev->m_next = new_node;
-        node = node->m_next;
+    if (!acquire()) {
+        return;
+    }
+    Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (extension != nullptr && extension->m_read_bias.load(std::memory_order_relaxed)) {
+        revoke_reader_bias(*extension);
     }
 }
 
-/*
- * Move constructor
- */
-TEMPLATE_DECL
-CLASS_NAME::Bucket(Bucket&& that)
-    : m_size(that.m_size)
-    , m_end(nullptr)
+inline bool BucketMutex::try_lock()
 {
-    std::lock_guard<std::recursive_mutex> lck(that.m_mutex);
-    m_end = that.m_end;
-    that.m_end = nullptr;
-    m_size = that.m_size;
+    bool first = false;
+    if (!try_acquire(first)) {
+        return false;
+    }
+    Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (first && extension != nullptr && extension->m_read_bias.load(std::memory_order_relaxed)) {
+        revoke_reader_bias(*extension);
+    }
+    return true;
 }
 
 /*
- * Copy assignment
+ * The last unlock of the owner puts off the queued waiters until the
+ * thread has left all its bucket locks. The exchange and the loads after
+ * it are sequentially consistent with a thread which queues a waiter and
+ * then tries the mutex.
  */
-TEMPLATE_DECL
-CLASS_NAME& CLASS_NAME::operator= (const Bucket& that)
+inline void BucketMutex::unlock()
 {
-    if (&that != this) {
-        // std::lock is to avoid deadlock in case of cross assignment,
-        // i.e. "a = b" in one thread and "b = a" in the other
-        std::unique_lock<std::recursive_mutex> lck_this(m_mutex, std::defer_lock);
-        std::unique_lock<std::recursive_mutex> lck_that(that.m_mutex, std::defer_lock);
-        std::lock(lck_this, lck_that);
-        clear();
-        const Node<ValueT>* node = that.begin();
-        while (node != that.end()) {
-            Node<ValueT>* new_node = new Node<ValueT>();
-            new_node->m_value.store(node->m_value.load());
-            new_node->m_next = m_end;
-            new_node->m_prev = m_end->m_prev;
-            new_node->m_next->m_prev = new_node;
-            new_node->m_prev->m_next = new_node;
-            node = node->m_next;
+    if (--m_depth != 0) {
+        return;
+    }
+    m_owner.store(0, std::memory_order_relaxed);
+    if (m_state.exchange(FREE) == CONTENDED) {
+        detail::futex_wake_one(&m_state);
+    }
+    Extension* extension = m_extension.load();
+    if (extension != nullptr && extension->m_waiters.load() != nullptr) {
+        std::vector<BucketMutex*>& deferred = deferred_wakes();
+        if (deferred.empty() || deferred.back() != this) {
+            deferred.push_back(this);
         }
-        m_size = that.m_size;
+        held_locks().m_deferred = true;
     }
-    return *this;
+    left_lock();
 }
 
 /*
- * Move assignment
+ * Unlocks without resuming the waiters
  */
-TEMPLATE_DECL
-CLASS_NAME& CLASS_NAME::operator= (Bucket&& that)
+inline void BucketMutex::release()
 {
-    if (&that != this) {
-        std::unique_lock<std::recursive_mutex> lck_this(m_mutex, std::defer_lock);
-        std::unique_lock<std::recursive_mutex> lck_that(that.m_mutex, std::defer_lock);
-        std::lock(lck_this, lck_that);
-        clear();
-        m_end = that.m_end;
-        that.m_end = nullptr;
-        m_size = that.m_size;
+    if (--m_depth != 0) {
+        return;
     }
-    return *this;
+    m_owner.store(0, std::memory_order_relaxed);
+    if (m_state.exchange(FREE) == CONTENDED) {
+        detail::futex_wake_one(&m_state);
+    }
+    --held_locks().m_count;
 }
 
 /*
- * Destructor
+ * The counter is constant initialized, so it costs no check on access
  */
-TEMPLATE_DECL
-CLASS_NAME::~Bucket()
+inline BucketMutex::HeldLocks& BucketMutex::held_locks()
+{
+    thread_local HeldLocks held = { 0, false, false };
+    return held;
+}
+
+inline std::vector<BucketMutex*>& BucketMutex::deferred_wakes()
 {
-    clear();
+    thread_local std::vector<BucketMutex*> deferred;
+    return deferred;
 }
 
 /*
- * Insert
- * Locks the container, inserts the given pair if there is no pair
- * with the same key, unlocks the container
+ * Called when the calling thread has left one of its bucket locks
  */
-TEMPLATE_DECL
-Pair<Node<ValueT>*, bool> CLASS_NAME::insert(const ValueT& value)
+inline void BucketMutex::left_lock()
 {
-    Node<ValueT>* result = nullptr;
-    {
-        std::lock_guard<std::recursive_mutex> lck(m_mutex);
-        result = find(value.first);
-        if (result != m_end) {
-            return thread_safe::make_pair(result, false);
-        }
-        result = new Node<ValueT>();
-        result->m_next = m_end;
-        result->m_prev = m_end->m_prev;
-        result->m_next->m_prev = result;
-        result->m_prev->m_next = result;
-        ++m_size;
+    HeldLocks& held = held_locks();
+    if (--held.m_count == 0 && held.m_deferred) {
+        resume_deferred();
     }
-    result->m_value.store(value);
-    return thread_safe::make_pair(result, true);
 }
 
 /*
- * Insert or assign
- * Locks the container, inserts the given pair if there is no pair
- * with the same key or replaces the existing with the new otherwise,
- * unlocks the container
+ * Resumes the waiters of the mutexes which the calling thread has
+ * unlocked, in the order it unlocked them. A resumed waiter which
+ * unlocks a mutex with waiters adds it to the list, which the outer call
+ * then works through.
  */
-TEMPLATE_DECL
-Node<ValueT>* CLASS_NAME::insert_or_assign(const ValueT& value)
+inline void BucketMutex::resume_deferred()
 {
-    Node<ValueT>* result = nullptr;
-    {
-        std::lock_guard<std::recursive_mutex> lck(m_mutex);
-        result = find(value.first);
-        if (result == m_end) {
-            result = new Node<ValueT>();
-            result->m_next = m_end;
-            result->m_prev = m_end->m_prev;
-            result->m_next->m_prev = result;
-            result->m_prev->m_next = result;
-            ++m_size;
-        }
+    HeldLocks& held = held_locks();
+    if (held.m_resuming) {
+        return;
     }
-    result->m_value.store(value);
-    return result;
+    held.m_resuming = true;
+    std::vector<BucketMutex*>& deferred = deferred_wakes();
+    for (std::size_t i = 0; i < deferred.size(); ++i) {
+        BucketMutex* mutex = deferred[i];
+        mutex->wake_waiters(*mutex->m_extension.load());
+    }
+    deferred.clear();
+    held.m_deferred = false;
+    held.m_resuming = false;
 }
 
 /*
- * Find
- * Returns a pointer to the node with the key provided
+ * Returns the extension of the mutex, allocating it if there is none
  */
-TEMPLATE_DECL
-Node<ValueT>* CLASS_NAME::find(const KeyT& key)
+inline BucketMutex::Extension& BucketMutex::extension()
 {
-    std::lock_guard<std::recursive_mutex> lck(m_mutex);
-    Node<ValueT>* node = begin();
-    while (node != end()) {
-        if (m_key_equal(node->m_value.load().first, key)) {
-            return node;
+    Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (extension == nullptr) {
+        std::unique_ptr<Extension> created(new Extension());
+        if (m_extension.compare_exchange_strong(extension, created.get())) {
+            extension = created.release();
         }
-        node = node->m_next;
     }
-    return node;
+    return *extension;
 }
 
 /*
- * Find
- * Returns a pointer to the node with the key provided for const objects
+ * Takes the mutex. Returns false if the calling thread held it already.
+ * A thread finds its own identity in m_owner only if it has stored it
+ * there itself, so the relaxed load is enough.
  */
-TEMPLATE_DECL
-const Node<ValueT>* CLASS_NAME::find(const KeyT& key) const
+inline bool BucketMutex::acquire()
 {
-    std::lock_guard<std::recursive_mutex> lck(m_mutex);
-    const Node<ValueT>* node = begin();
-    while (node != end()) {
-        if (m_key_equal(node->m_value.load().first, key)) {
-            return node;
-        }
+    const std::uintptr_t self = detail::thread_identity();
+    if (m_owner.load(std::memory_order_relaxed) == self) {
+        ++m_depth;
+        return false;
+    }
+    std::uint32_t expected = FREE;
+    if (!m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+        lock_contended();
+    }
+    acquired(self);
+    return true;
+}
+
+/*
+ * Takes the mutex if it is free or held by the calling thread; first
+ * tells which of them
+ */
+inline bool BucketMutex::try_acquire(bool& first)
+{
+    const std::uintptr_t self = detail::thread_identity();
+    if (m_owner.load(std::memory_order_relaxed) == self) {
+        ++m_depth;
+        first = false;
+        return true;
+    }
+    std::uint32_t expected = FREE;
+    if (!m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+        return false;
+    }
+    acquired(self);
+    first = true;
+    return true;
+}
+
+inline void BucketMutex::acquired(std::uintptr_t self)
+{
+    m_owner.store(self, std::memory_order_relaxed);
+    m_depth = 1;
+    ++held_locks().m_count;
+}
+
+/*
+ * Spins for a while and then sleeps until the mutex is free. A sleeper
+ * leaves the word CONTENDED, so the owner wakes one when it unlocks.
+ */
+inline void BucketMutex::lock_contended()
+{
+    for (unsigned spins = 0; spins < SPINS; ++spins) {
+        detail::cpu_relax();
+        std::uint32_t expected = FREE;
+        if (m_state.load(std::memory_order_relaxed) == FREE &&
+            m_state.compare_exchange_weak(expected, LOCKED, std::memory_order_acquire, std::memory_order_relaxed)) {
+            return;
+        }
+    }
+    while (m_state.exchange(CONTENDED, std::memory_order_acquire) != FREE) {
+        detail::futex_wait(&m_state, CONTENDED);
+    }
+}
+
+/*
+ * Locks the mutex for reading. Returns the visible readers slot taken by
+ * the reader, or nullptr if the reader holds the mutex itself.
+ */
+inline std::atomic<const void*>* BucketMutex::lock_shared()
+{
+    std::atomic<const void*>* slot = enter_as_visible_reader();
+    if (slot != nullptr) {
+        return slot;
+    }
+    locked_for_reading(acquire());
+    return nullptr;
+}
+
+/*
+ * Like lock_shared(), but returns false instead of waiting for a writer.
+ * On success slot is what lock_shared() would have returned.
+ */
+inline bool BucketMutex::try_lock_shared(std::atomic<const void*>*& slot)
+{
+    slot = enter_as_visible_reader();
+    if (slot != nullptr) {
+        return true;
+    }
+    bool first = false;
+    if (!try_acquire(first)) {
+        return false;
+    }
+    locked_for_reading(first);
+    return true;
+}
+
+/*
+ * Takes a visible readers slot if the mutex is reader biased.
+ * Returns nullptr if the reader has to take the mutex.
+ */
+inline std::atomic<const void*>* BucketMutex::enter_as_visible_reader()
+{
+    Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (extension != nullptr && extension->m_read_bias.load(std::memory_order_acquire)) {
+        std::atomic<const void*>& slot = detail::visible_reader_slot(this);
+        const void* expected = nullptr;
+        if (slot.compare_exchange_strong(expected, this)) {
+            // Pairs with the writer clearing the bias before it scans
+            if (extension->m_read_bias.load()) {
+                ++held_locks().m_count;
+                return &slot;
+            }
+            slot.store(nullptr, std::memory_order_release);
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * Called by a reader which has just taken the mutex
+ */
+inline void BucketMutex::locked_for_reading(bool first)
+{
+    Extension* extension = m_extension.load(std::memory_order_acquire);
+    // A nested read of a writer must not let readers in
+    if (first && extension != nullptr && extension->m_reader_bias &&
+        !extension->m_read_bias.load(std::memory_order_relaxed) &&
+        detail::steady_nanoseconds() >= extension->m_inhibit_until) {
+        extension->m_read_bias.store(true);
+    }
+}
+
+inline void BucketMutex::unlock_shared(std::atomic<const void*>* slot)
+{
+    if (slot != nullptr) {
+        slot->store(nullptr, std::memory_order_release);
+        left_lock();
+    } else {
+        unlock();
+    }
+}
+
+/*
+ * Enables or disables reader bias. Disabling waits for the readers which
+ * have entered without the mutex.
+ */
+inline void BucketMutex::set_reader_bias(bool enabled)
+{
+    std::lock_guard<BucketMutex> lck(*this);
+    if (enabled || m_extension.load(std::memory_order_relaxed) != nullptr) {
+        extension().m_reader_bias = enabled;
+    }
+}
+
+/*
+ * Called by a writer which has just taken the mutex
+ */
+inline void BucketMutex::revoke_reader_bias(Extension& extension)
+{
+    extension.m_read_bias.store(false);
+    const std::int64_t start = detail::steady_nanoseconds();
+    std::atomic<const void*>* table = detail::visible_readers();
+    for (std::size_t i = 0; i < detail::VISIBLE_READERS; ++i) {
+        while (table[i].load() == this) {
+            detail::cpu_relax();
+        }
+    }
+    const std::int64_t end = detail::steady_nanoseconds();
+    extension.m_inhibit_until = end + (end - start) * INHIBIT_FACTOR;
+}
+
+/*
+ * Locks the mutex if it is free and no waiter is queued, so that an
+ * asynchronous operation does not overtake the queued ones
+ */
+inline bool BucketMutex::try_lock_queued()
+{
+    const Extension* extension = m_extension.load(std::memory_order_acquire);
+    return (extension == nullptr || extension->m_waiters.load(std::memory_order_relaxed) == nullptr) &&
+        try_lock();
+}
+
+/*
+ * Locks the mutex and returns true if it can be locked as by
+ * try_lock_queued(). Otherwise queues the waiter and returns false; the
+ * waiter is resumed with the mutex locked after the waiters queued before
+ * it, possibly before this function returns.
+ */
+inline bool BucketMutex::lock_or_enqueue(Waiter& waiter)
+{
+    if (try_lock_queued()) {
+        return true;
+    }
+    Extension& extension = this->extension();
+    waiter.m_next = nullptr;
+    while (extension.m_waiters_lock.test_and_set(std::memory_order_acquire)) {
+        detail::cpu_relax();
+    }
+    if (extension.m_waiters_tail == nullptr) {
+        extension.m_waiters.store(&waiter, std::memory_order_relaxed);
+    } else {
+        extension.m_waiters_tail->m_next = &waiter;
+    }
+    extension.m_waiters_tail = &waiter;
+    extension.m_waiters_lock.clear(std::memory_order_release);
+
+    // The owner may have unlocked before it could see the waiter, then
+    // the waiters are resumed by this thread
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (try_lock()) {
+        unlock();
+    }
+    return false;
+}
+
+/*
+ * Resumes the queued waiters while the mutex can be locked for them. A
+ * waiter stays at the head of the queue until the mutex is free, so it
+ * keeps its place. A thread which finds the waking flag set leaves the
+ * waiters to the thread which has set it, possibly further up its own
+ * stack, which looks at the queue again after clearing the flag.
+ */
+inline void BucketMutex::wake_waiters(Extension& extension)
+{
+    for (;;) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (extension.m_waiters.load(std::memory_order_relaxed) == nullptr || extension.m_waking.exchange(true)) {
+            return;
+        }
+        bool busy = false;
+        for (;;) {
+            if (!try_lock()) {
+                busy = true;
+                break;
+            }
+            while (extension.m_waiters_lock.test_and_set(std::memory_order_acquire)) {
+                detail::cpu_relax();
+            }
+            Waiter* waiter = extension.m_waiters.load(std::memory_order_relaxed);
+            if (waiter != nullptr) {
+                extension.m_waiters.store(waiter->m_next, std::memory_order_relaxed);
+                if (waiter->m_next == nullptr) {
+                    extension.m_waiters_tail = nullptr;
+                }
+            }
+            extension.m_waiters_lock.clear(std::memory_order_release);
+            if (waiter == nullptr) {
+                release();
+                break;
+            }
+            // Unlocks the mutex; the waiter may be queued again or be
+            // destroyed
+            waiter->m_resume(waiter);
+        }
+        extension.m_waking.store(false);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // The owner which made this thread give up resumes the waiters
+        // when it unlocks, unless it did so while the flag was set
+        if (busy) {
+            if (!try_lock()) {
+                return;
+            }
+            release();
+        }
+    }
+}
+
+/*
+ * HashMap contains an array of Buckets as storage.
+ * Each Bucket is a doubly linked list.
+ */
+template <typename KeyT,
+          typename ValueT,
+          typename KeyEqualT>
+class Bucket
+{
+public:
+    /*
+     * An operation which a thread publishes to the bucket for flat
+     * combining. It lives on the stack of the publishing thread.
+     */
+    struct Operation
+    {
+        enum Type
+        {
+            INSERT,
+            INSERT_OR_ASSIGN,
+            ERASE,
+            FIND
+        };
+
+        Operation(Type type, const ValueT* value, const KeyT* key)
+            : m_type(type)
+            , m_value(value)
+            , m_key(key)
+            , m_next(nullptr)
+            , m_done(false)
+        {}
+
+        Type m_type;
+        const ValueT* m_value;
+        const KeyT* m_key;
+        Pair<Node<ValueT>*, bool> m_result;
+        Operation* m_next;
+        std::atomic<bool> m_done;
+    };
+
+#if defined(__cpp_impl_coroutine)
+    /*
+     * Runs a function with the bucket locked for a coroutine which
+     * awaits it. If the bucket is locked the coroutine is suspended and
+     * resumed on the thread which unlocks the bucket, once that thread
+     * holds no other bucket lock.
+     */
+    template <typename FnT>
+    class Awaitable : public BucketMutex::Waiter
+    {
+    public:
+        typedef decltype(std::declval<FnT&>()()) result_type;
+
+        Awaitable(Bucket* bucket, FnT fn)
+            : m_bucket(bucket)
+            , m_fn(std::move(fn))
+        {
+            m_resume = &Awaitable::resume;
+            m_next = nullptr;
+        }
+
+        bool await_ready()
+        {
+            if (!m_bucket->m_mutex.try_lock_queued()) {
+                return false;
+            }
+            run();
+            return true;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle)
+        {
+            m_handle = handle;
+            if (!m_bucket->m_mutex.lock_or_enqueue(*this)) {
+                return true;
+            }
+            run();
+            return false;
+        }
+
+        result_type await_resume()
+        {
+            return std::move(*m_result);
+        }
+
+    private:
+        static void resume(BucketMutex::Waiter* waiter)
+        {
+            // The mutex is locked for the waiter
+            Awaitable* self = static_cast<Awaitable*>(waiter);
+            self->run();
+            self->m_handle.resume();
+        }
+
+        void run()
+        {
+            std::unique_lock<BucketMutex> lck(m_bucket->m_mutex, std::adopt_lock);
+            m_result.emplace(m_fn());
+        }
+
+    private:
+        Bucket* m_bucket;
+        FnT m_fn;
+        std::coroutine_handle<> m_handle;
+        std::optional<result_type> m_result;
+    };
+#endif
+
+public:
+    Bucket();
+    Bucket(const Bucket&);
+    Bucket(Bucket&&);
+    Bucket& operator= (const Bucket&);
+    Bucket& operator= (Bucket&&);
+    ~Bucket();
+
+    Pair<Node<ValueT>*, bool> insert(const ValueT& value);
+    Node<ValueT>* insert_or_assign(const ValueT& value);
+    template <typename FactoryT>
+    Pair<Node<ValueT>*, bool> get_or_insert_with(const KeyT& key, FactoryT factory);
+    void assign(Node<ValueT>* node, const ValueT& value);
+    Node<ValueT>* find(const KeyT& key);
+    const Node<ValueT>* find(const KeyT& key) const;
+    void erase(const KeyT& key);
+    void erase(Node<ValueT>* node);
+    Pair<Node<ValueT>*, bool> insert_unlocked(const ValueT& value);
+    Node<ValueT>* insert_or_assign_unlocked(const ValueT& value);
+    void assign_unlocked(Node<ValueT>* node, const ValueT& value);
+    void append_unlocked(const ValueT& value);
+    Node<ValueT>* find_unlocked(const KeyT& key);
+    const Node<ValueT>* find_unlocked(const KeyT& key) const;
+    void erase_unlocked(const KeyT& key);
+    void erase_unlocked(Node<ValueT>* node);
+    void combine(Operation& operation);
+    template <typename FnT, typename DoneT>
+    void async_call(FnT fn, DoneT done);
+    void clear();
+    template <typename FnT>
+    void for_each(FnT fn) const;
+    template <typename FnT>
+    bool visit(const KeyT& key, FnT fn) const;
+    template <typename FnT>
+    void visit_all(FnT fn) const;
+    std::size_t size() const;
+    bool empty() const;
+    std::uint64_t version() const;
+    void wait_for_change(std::uint64_t old_version,
+                         std::int64_t deadline,
+                         const std::atomic<bool>* cancel = nullptr) const;
+    void wake_watchers() const;
+    Node<ValueT>* begin();
+    const Node<ValueT>* begin() const;
+    Node<ValueT>* end();
+    const Node<ValueT>* end() const;
+    void lock() const;
+    bool try_lock() const;
+    void unlock() const;
+    std::atomic<const void*>* lock_shared() const;
+    bool try_lock_shared(std::atomic<const void*>*& slot) const;
+    void unlock_shared(std::atomic<const void*>* slot) const;
+    void set_listener(MutationListener<ValueT>* listener);
+    void set_reader_bias(bool enabled);
+    void set_pool(NodePool<Node<ValueT> >* pool, int numa_node);
+
+private:
+    /*
+     * The state of the features a bucket may be given after it is made:
+     * the listener, the node pool, flat combining and watching. It is
+     * allocated when the first of them is used, so a plain bucket pays
+     * one pointer for all of them.
+     */
+    struct Extension
+    {
+        Extension()
+            : m_listener(nullptr)
+            , m_pool(nullptr)
+            , m_numa_node(-1)
+            , m_watched(false)
+            , m_watch(0)
+            , m_publications(nullptr)
+        {}
+
+        MutationListener<ValueT>* m_listener;
+        NodePool<Node<ValueT> >* m_pool;
+        int m_numa_node;
+        // Set under the lock of the bucket once a thread has waited for
+        // a change, from then on the writers check m_watch
+        std::atomic<bool> m_watched;
+        // The futex word of the threads waiting for a change: the lowest
+        // bit tells that there are some, the other bits count the wake ups
+        std::atomic<std::uint32_t> m_watch;
+        std::atomic<Operation*> m_publications;
+    };
+
+    /*
+     * A call of async_call() which waits for the bucket to be unlocked
+     */
+    template <typename FnT, typename DoneT>
+    struct AsyncCall : BucketMutex::Waiter
+    {
+        AsyncCall(Bucket* bucket, FnT&& fn, DoneT&& done)
+            : m_bucket(bucket)
+            , m_fn(std::move(fn))
+            , m_done(std::move(done))
+        {
+            m_resume = &AsyncCall::resume;
+            m_next = nullptr;
+        }
+
+        static void resume(BucketMutex::Waiter* waiter)
+        {
+            // The mutex is locked for the waiter
+            std::unique_ptr<AsyncCall> call(static_cast<AsyncCall*>(waiter));
+            call->m_bucket->finish_async_call(call->m_fn, call->m_done);
+        }
+
+        Bucket* m_bucket;
+        FnT m_fn;
+        DoneT m_done;
+    };
+
+    template <typename FnT, typename DoneT>
+    void finish_async_call(FnT& fn, DoneT& done);
+    Extension& extension() const;
+    MutationListener<ValueT>* listener() const;
+    void take_pool(const Bucket& that);
+    void mark_changed();
+    void execute(Operation& operation);
+    Node<ValueT>* link_unlocked(const ValueT& value);
+    Node<ValueT>* create_node();
+    void destroy_node(Node<ValueT>* node);
+
+private:
+    mutable BucketMutex m_mutex;
+    std::size_t m_size;
+    Node<ValueT>* m_end;
+    KeyEqualT m_key_equal;
+    std::atomic<std::uint64_t> m_version;
+    mutable std::atomic<Extension*> m_extension;
+};
+
+#define TEMPLATE_DECL template <typename KeyT, typename ValueT, typename KeyEqualT>
+#define CLASS_NAME Bucket<KeyT, ValueT, KeyEqualT>
+
+/*
+ * Default constructor
+ */
+TEMPLATE_DECL
+CLASS_NAME::Bucket()
+    : m_size(0)
+    , m_end(nullptr)
+    , m_version(0)
+    , m_extension(nullptr)
+{
+    m_end = create_node();
+    m_end->m_next = m_end;
+    m_end->m_prev = m_end;
+}
+
+/*
+ * Copy constructor
+ */
+TEMPLATE_DECL
+CLASS_NAME::Bucket(const Bucket& that)
+    : m_size(that.m_size)
+    , m_end(nullptr)
+    , m_version(0)
+    , m_extension(nullptr)
+{
+    m_end = create_node();
+    m_end->m_next = m_end;
+    m_end->m_prev = m_end;
+    
+    // Locks the source so that it won't be modified during the copy
+    std::lock_guard<BucketMutex> lck(that.m_mutex);
+    Node<ValueT>* node = that.begin();
+    while (node != that.end()) {
+        Node<ValueT>* new_node = create_node();
+        new_node->m_value.store(node->m_value.load());
+        new_node->m_next = m_end;
+        new_node->m_prev = m_end->m_prev;
+        new_node->m_next->m_prev = new_node;
+        new_node->m_prev->m_next = new_node;
         node = node->m_next;
     }
-    return node;
+}
+
+/*
+ * Move constructor
+ */
+TEMPLATE_DECL
+CLASS_NAME::Bucket(Bucket&& that)
+    : m_size(that.m_size)
+    , m_end(nullptr)
+    , m_version(0)
+    , m_extension(nullptr)
+{
+    std::lock_guard<BucketMutex> lck(that.m_mutex);
+    m_end = that.m_end;
+    that.m_end = nullptr;
+    m_size = that.m_size;
+    take_pool(that);
+}
+
+/*
+ * Copy assignment
+ */
+TEMPLATE_DECL
+CLASS_NAME& CLASS_NAME::operator= (const Bucket& that)
+{
+    if (&that != this) {
+        // std::lock is to avoid deadlock in case of cross assignment,
+        // i.e. "a = b" in one thread and "b = a" in the other
+        std::unique_lock<BucketMutex> lck_this(m_mutex, std::defer_lock);
+        std::unique_lock<BucketMutex> lck_that(that.m_mutex, std::defer_lock);
+        std::lock(lck_this, lck_that);
+        clear();
+        const Node<ValueT>* node = that.begin();
+        while (node != that.end()) {
+            Node<ValueT>* new_node = create_node();
+            new_node->m_value.store(node->m_value.load());
+            new_node->m_next = m_end;
+            new_node->m_prev = m_end->m_prev;
+            new_node->m_next->m_prev = new_node;
+            new_node->m_prev->m_next = new_node;
+            if (listener() != nullptr) {
+                listener()->on_insert(new_node->m_value.load());
+            }
+            node = node->m_next;
+        }
+        m_size = that.m_size;
+        mark_changed();
+    }
+    return *this;
+}
+
+/*
+ * Move assignment
+ */
+TEMPLATE_DECL
+CLASS_NAME& CLASS_NAME::operator= (Bucket&& that)
+{
+    if (&that != this) {
+        std::unique_lock<BucketMutex> lck_this(m_mutex, std::defer_lock);
+        std::unique_lock<BucketMutex> lck_that(that.m_mutex, std::defer_lock);
+        std::lock(lck_this, lck_that);
+        clear();
+        destroy_node(m_end);
+        m_end = that.m_end;
+        that.m_end = nullptr;
+        // The pairs leave the other bucket and join this one
+        for (const Node<ValueT>* node = begin(); node != end(); node = node->m_next) {
+            if (that.listener() != nullptr) {
+                that.listener()->on_erase(node->m_value.load());
+            }
+            if (listener() != nullptr) {
+                listener()->on_insert(node->m_value.load());
+            }
+        }
+        m_size = that.m_size;
+        take_pool(that);
+        mark_changed();
+    }
+    return *this;
+}
+
+/*
+ * Destructor
+ */
+TEMPLATE_DECL
+CLASS_NAME::~Bucket()
+{
+    // A moved from bucket has no nodes at all
+    if (m_end != nullptr) {
+        clear();
+        destroy_node(m_end);
+        m_end = nullptr;
+    }
+    delete m_extension.load(std::memory_order_relaxed);
+}
+
+/*
+ * Insert
+ * Locks the container, inserts the given pair if there is no pair
+ * with the same key, unlocks the container
+ */
+TEMPLATE_DECL
+Pair<Node<ValueT>*, bool> CLASS_NAME::insert(const ValueT& value)
+{
+    std::lock_guard<BucketMutex> lck(m_mutex);
+    return insert_unlocked(value);
+}
+
+/*
+ * Insert or assign
+ * Locks the container, inserts the given pair if there is no pair
+ * with the same key or replaces the existing with the new otherwise,
+ * unlocks the container
+ */
+TEMPLATE_DECL
+Node<ValueT>* CLASS_NAME::insert_or_assign(const ValueT& value)
+{
+    std::lock_guard<BucketMutex> lck(m_mutex);
+    return insert_or_assign_unlocked(value);
+}
+
+/*
+ * Get or insert with a factory
+ * Returns the node with the key if there is one. Otherwise calls
+ * factory() exactly once to make the mapped value and links a node with
+ * the complete pair, all while the bucket is locked, so no other thread
+ * ever sees the pair half made or makes it too. The factory must not
+ * call back into the bucket.
+ */
+TEMPLATE_DECL
+template <typename FactoryT>
+Pair<Node<ValueT>*, bool> CLASS_NAME::get_or_insert_with(const KeyT& key, FactoryT factory)
+{
+    Node<ValueT>* node = find(key);
+    if (node != m_end) {
+        return thread_safe::make_pair(node, false);
+    }
+    std::lock_guard<BucketMutex> lck(m_mutex);
+    node = find_unlocked(key);
+    if (node != m_end) {
+        return thread_safe::make_pair(node, false);
+    }
+    return thread_safe::make_pair(link_unlocked(ValueT(key, factory())), true);
+}
+
+/*
+ * Assign
+ * Replaces the pair of the node under the lock of the container, so that
+ * the change is ordered with the other changes of the bucket
+ */
+TEMPLATE_DECL
+void CLASS_NAME::assign(Node<ValueT>* node, const ValueT& value)
+{
+    std::lock_guard<BucketMutex> lck(m_mutex);
+    assign_unlocked(node, value);
+}
+
+/*
+ * Find
+ * Returns a pointer to the node with the key provided
+ */
+TEMPLATE_DECL
+Node<ValueT>* CLASS_NAME::find(const KeyT& key)
+{
+    BucketMutex::SharedLock lck(m_mutex);
+    return find_unlocked(key);
+}
+
+/*
+ * Find
+ * Returns a pointer to the node with the key provided for const objects
+ */
+TEMPLATE_DECL
+const Node<ValueT>* CLASS_NAME::find(const KeyT& key) const
+{
+    BucketMutex::SharedLock lck(m_mutex);
+    return find_unlocked(key);
 }
 
 /*
@@ -329,7 +1313,8 @@ const Node<ValueT>* CLASS_NAME::find(const KeyT& key) const
 TEMPLATE_DECL
 void CLASS_NAME::erase(const KeyT& key)
 {
-    erase(find(key));
+    std::lock_guard<BucketMutex> lck(m_mutex);
+    erase_unlocked(find_unlocked(key));
 }
 
 /*
@@ -342,12 +1327,226 @@ void CLASS_NAME::erase(Node<ValueT>* node)
     if (node == m_end) {
         return;
     }
-    std::lock_guard<std::recursive_mutex> lck(m_mutex);
+    std::lock_guard<BucketMutex> lck(m_mutex);
+    erase_unlocked(node);
+}
+
+/*
+ * The functions below do the same as the ones above without locking.
+ * They are for callers which already hold the lock of the bucket or
+ * which are the only thread accessing it.
+ */
+TEMPLATE_DECL
+Pair<Node<ValueT>*, bool> CLASS_NAME::insert_unlocked(const ValueT& value)
+{
+    Node<ValueT>* result = find_unlocked(value.first);
+    if (result != m_end) {
+        return thread_safe::make_pair(result, false);
+    }
+    return thread_safe::make_pair(link_unlocked(value), true);
+}
+
+TEMPLATE_DECL
+Node<ValueT>* CLASS_NAME::insert_or_assign_unlocked(const ValueT& value)
+{
+    Node<ValueT>* result = find_unlocked(value.first);
+    if (result != m_end) {
+        assign_unlocked(result, value);
+        return result;
+    }
+    return insert_unlocked(value).first;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::assign_unlocked(Node<ValueT>* node, const ValueT& value)
+{
+    node->m_value.store(value);
+    mark_changed();
+    if (listener() != nullptr) {
+        listener()->on_assign(value);
+    }
+}
+
+/*
+ * Append without locking
+ * Links a new node with the given pair to the end of the list without
+ * looking for an existing one with the same key. Only for filling a
+ * bucket which is not yet visible to other threads. The listener hears
+ * of the pair as of an insert.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::append_unlocked(const ValueT& value)
+{
+    Node<ValueT>* node = create_node();
+    node->m_value.store(value, std::memory_order_relaxed);
+    node->m_next = m_end;
+    node->m_prev = m_end->m_prev;
+    node->m_next->m_prev = node;
+    node->m_prev->m_next = node;
+    if (listener() != nullptr) {
+        listener()->on_insert(value);
+    }
+    ++m_size;
+    mark_changed();
+}
+
+TEMPLATE_DECL
+Node<ValueT>* CLASS_NAME::find_unlocked(const KeyT& key)
+{
+    Node<ValueT>* node = begin();
+    while (node != end()) {
+        if (m_key_equal(node->m_value.load().first, key)) {
+            return node;
+        }
+        node = node->m_next;
+    }
+    return node;
+}
+
+TEMPLATE_DECL
+const Node<ValueT>* CLASS_NAME::find_unlocked(const KeyT& key) const
+{
+    const Node<ValueT>* node = begin();
+    while (node != end()) {
+        if (m_key_equal(node->m_value.load().first, key)) {
+            return node;
+        }
+        node = node->m_next;
+    }
+    return node;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::erase_unlocked(const KeyT& key)
+{
+    erase_unlocked(find_unlocked(key));
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::erase_unlocked(Node<ValueT>* node)
+{
+    if (node == m_end) {
+        return;
+    }
     node->m_next->m_prev = node->m_prev;
     node->m_prev->m_next = node->m_next;
-    delete node;
+    if (listener() != nullptr) {
+        listener()->on_erase(node->m_value.load());
+    }
+    destroy_node(node);
     node = nullptr;
     --m_size;
+    mark_changed();
+}
+
+/*
+ * Flat combining
+ * Publishes the operation and returns when it is done. Whichever thread
+ * gets the lock of the bucket executes all published operations in one
+ * pass, so under contention the bucket stays in the cache of one core
+ * and the other threads spin only on their own operations.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::combine(Operation& operation)
+{
+    std::atomic<Operation*>& publications = extension().m_publications;
+    Operation* head = publications.load(std::memory_order_relaxed);
+    do {
+        operation.m_next = head;
+    } while (!publications.compare_exchange_weak(head, &operation,
+                                                   std::memory_order_release,
+                                                   std::memory_order_relaxed));
+    for (unsigned spins = 0; ; ++spins) {
+        if (operation.m_done.load(std::memory_order_acquire)) {
+            return;
+        }
+        if (m_mutex.try_lock()) {
+            Operation* list = publications.exchange(nullptr, std::memory_order_acquire);
+            // The list is in reverse order of publication
+            Operation* ordered = nullptr;
+            while (list != nullptr) {
+                Operation* next = list->m_next;
+                list->m_next = ordered;
+                ordered = list;
+                list = next;
+            }
+            while (ordered != nullptr) {
+                // The publisher may return as soon as its operation is done
+                Operation* next = ordered->m_next;
+                execute(*ordered);
+                ordered->m_done.store(true, std::memory_order_release);
+                ordered = next;
+            }
+            m_mutex.unlock();
+            continue;
+        }
+        if (spins % 64 == 63) {
+            std::this_thread::yield();
+        } else {
+            detail::cpu_relax();
+        }
+    }
+}
+
+/*
+ * Executes a published operation under the lock of the bucket
+ */
+TEMPLATE_DECL
+void CLASS_NAME::execute(Operation& operation)
+{
+    switch (operation.m_type) {
+    case Operation::INSERT:
+        operation.m_result = insert_unlocked(*operation.m_value);
+        break;
+    case Operation::INSERT_OR_ASSIGN:
+        operation.m_result = thread_safe::make_pair(insert_or_assign_unlocked(*operation.m_value), true);
+        break;
+    case Operation::ERASE:
+        erase_unlocked(*operation.m_key);
+        break;
+    case Operation::FIND:
+        operation.m_result = thread_safe::make_pair(find_unlocked(*operation.m_key), true);
+        break;
+    }
+}
+
+/*
+ * Asynchronous call
+ * Calls fn with the bucket locked and then done with the result of fn
+ * after the bucket is unlocked. If the bucket is locked by another thread
+ * the call is queued and made by the thread which unlocks the bucket,
+ * after it has left all its bucket locks, so the calling thread never
+ * blocks. A queued fn and done must not throw.
+ */
+TEMPLATE_DECL
+template <typename FnT, typename DoneT>
+void CLASS_NAME::async_call(FnT fn, DoneT done)
+{
+    if (m_mutex.try_lock_queued()) {
+        finish_async_call(fn, done);
+        return;
+    }
+    std::unique_ptr<AsyncCall<FnT, DoneT> > call(new AsyncCall<FnT, DoneT>(this, std::move(fn), std::move(done)));
+    if (m_mutex.lock_or_enqueue(*call)) {
+        finish_async_call(call->m_fn, call->m_done);
+        return;
+    }
+    // The waiter now belongs to the queue of the mutex
+    call.release();
+}
+
+/*
+ * Runs the locked part of an asynchronous call, the bucket is locked by
+ * the calling thread
+ */
+TEMPLATE_DECL
+template <typename FnT, typename DoneT>
+void CLASS_NAME::finish_async_call(FnT& fn, DoneT& done)
+{
+    std::unique_lock<BucketMutex> lck(m_mutex, std::adopt_lock);
+    auto result = fn();
+    lck.unlock();
+    done(std::move(result));
 }
 
 /*
@@ -362,6 +1561,53 @@ void CLASS_NAME::clear()
     }
 }
 
+/*
+ * Calls fn with the pair of every node while the bucket is locked
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::for_each(FnT fn) const
+{
+    BucketMutex::SharedLock lck(m_mutex);
+    const Node<ValueT>* node = begin();
+    while (node != end()) {
+        fn(node->m_value.load());
+        node = node->m_next;
+    }
+}
+
+/*
+ * Calls fn with a const reference to the pair of the key in its node,
+ * while the bucket is locked for reading. Returns false if there is no
+ * pair with the key.
+ */
+TEMPLATE_DECL
+template <typename FnT>
+bool CLASS_NAME::visit(const KeyT& key, FnT fn) const
+{
+    BucketMutex::SharedLock lck(m_mutex);
+    const Node<ValueT>* node = find_unlocked(key);
+    if (node == end()) {
+        return false;
+    }
+    fn(node->m_value.ref());
+    return true;
+}
+
+/*
+ * Calls fn with a const reference to the pair of every node, while the
+ * bucket is locked for reading
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::visit_all(FnT fn) const
+{
+    BucketMutex::SharedLock lck(m_mutex);
+    for (const Node<ValueT>* node = begin(); node != end(); node = node->m_next) {
+        fn(node->m_value.ref());
+    }
+}
+
 /*
  * Returns the number of elements
  */
@@ -377,10 +1623,65 @@ std::size_t CLASS_NAME::size() const
 TEMPLATE_DECL
 bool CLASS_NAME::empty() const
 {
-    std::lock_guard<std::recursive_mutex> lck(m_mutex);
+    BucketMutex::SharedLock lck(m_mutex);
     return begin() == end();
 }
 
+/*
+ * Returns the version of the bucket, which changes with every change of
+ * the bucket and is stable while the bucket is locked
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::version() const
+{
+    return m_version.load(std::memory_order_acquire);
+}
+
+/*
+ * Waits until the version of the bucket differs from old_version, the
+ * steady clock reaches the deadline in nanoseconds or cancel is set, if
+ * given. It sleeps at most once, so it may also return before any of
+ * them; the caller checks and calls it again.
+ * The first wait marks the bucket as watched under its lock, so every
+ * change after it wakes the watchers.
+ * The setter of cancel calls wake_watchers() after setting it.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::wait_for_change(std::uint64_t old_version,
+                                 std::int64_t deadline,
+                                 const std::atomic<bool>* cancel) const
+{
+    Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (extension == nullptr || !extension->m_watched.load(std::memory_order_relaxed)) {
+        std::lock_guard<BucketMutex> lck(m_mutex);
+        extension = &this->extension();
+        extension->m_watched.store(true, std::memory_order_relaxed);
+    }
+    const std::uint32_t word = extension->m_watch.fetch_or(1) | 1;
+    if (m_version.load() != old_version || (cancel != nullptr && cancel->load())) {
+        return;
+    }
+    const std::int64_t remaining = deadline - detail::steady_nanoseconds();
+    if (remaining > 0) {
+        detail::futex_wait(&extension->m_watch, word, remaining);
+    }
+}
+
+/*
+ * Wakes the threads waiting in wait_for_change(), if there are any.
+ * Bumping the word also clears the bit, so the writers after this one
+ * skip the system call until a thread waits again.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::wake_watchers() const
+{
+    Extension* extension = m_extension.load();
+    if (extension != nullptr && (extension->m_watch.load() & 1) != 0) {
+        extension->m_watch.fetch_add(1);
+        detail::futex_wake_all(&extension->m_watch);
+    }
+}
+
 /*
  * Returns a pointer to the first node
  */
@@ -411,6 +1712,188 @@ const Node<ValueT>* CLASS_NAME::end() const
     return m_end;
 }
 
+/*
+ * Lock the bucket for a series of the unlocked operations
+ */
+TEMPLATE_DECL
+void CLASS_NAME::lock() const
+{
+    m_mutex.lock();
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::try_lock() const
+{
+    return m_mutex.try_lock();
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::unlock() const
+{
+    m_mutex.unlock();
+}
+
+/*
+ * Lock the bucket for a series of reads. The slot returned, or set by
+ * try_lock_shared(), is passed to unlock_shared().
+ */
+TEMPLATE_DECL
+std::atomic<const void*>* CLASS_NAME::lock_shared() const
+{
+    return m_mutex.lock_shared();
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::try_lock_shared(std::atomic<const void*>*& slot) const
+{
+    return m_mutex.try_lock_shared(slot);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::unlock_shared(std::atomic<const void*>* slot) const
+{
+    m_mutex.unlock_shared(slot);
+}
+
+/*
+ * Sets the listener which is notified about every change, nullptr for none
+ */
+TEMPLATE_DECL
+void CLASS_NAME::set_listener(MutationListener<ValueT>* listener)
+{
+    std::lock_guard<BucketMutex> lck(m_mutex);
+    if (listener != nullptr || m_extension.load(std::memory_order_relaxed) != nullptr) {
+        extension().m_listener = listener;
+    }
+}
+
+/*
+ * Lets readers of the bucket bypass its mutex while it is not written,
+ * see BucketMutex
+ */
+TEMPLATE_DECL
+void CLASS_NAME::set_reader_bias(bool enabled)
+{
+    m_mutex.set_reader_bias(enabled);
+}
+
+/*
+ * Returns the extension of the bucket, allocating it if there is none
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::Extension& CLASS_NAME::extension() const
+{
+    Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (extension == nullptr) {
+        std::unique_ptr<Extension> created(new Extension());
+        if (m_extension.compare_exchange_strong(extension, created.get())) {
+            extension = created.release();
+        }
+    }
+    return *extension;
+}
+
+TEMPLATE_DECL
+MutationListener<ValueT>* CLASS_NAME::listener() const
+{
+    const Extension* extension = m_extension.load(std::memory_order_acquire);
+    return extension != nullptr ? extension->m_listener : nullptr;
+}
+
+/*
+ * Makes the bucket allocate its nodes like that, whose nodes it takes
+ */
+TEMPLATE_DECL
+void CLASS_NAME::take_pool(const Bucket& that)
+{
+    const Extension* source = that.m_extension.load(std::memory_order_acquire);
+    NodePool<Node<ValueT> >* pool = source != nullptr ? source->m_pool : nullptr;
+    if (pool != nullptr || m_extension.load(std::memory_order_relaxed) != nullptr) {
+        Extension& extension = this->extension();
+        extension.m_pool = pool;
+        extension.m_numa_node = source != nullptr ? source->m_numa_node : -1;
+    }
+}
+
+/*
+ * Bumps the version of the bucket and wakes the threads waiting for the
+ * change, if it is watched. Only the holder of the lock writes the
+ * version, so it is bumped with a plain store.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::mark_changed()
+{
+    m_version.store(m_version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    const Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (extension != nullptr && extension->m_watched.load(std::memory_order_relaxed)) {
+        // Sequentially consistent with the check of the version by a
+        // waiter which has just announced itself in m_watch
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wake_watchers();
+    }
+}
+
+/*
+ * Makes the bucket allocate its nodes from the pool, on the given NUMA
+ * node or on the node of the inserting thread if -1 is given.
+ * The bucket must be empty.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::set_pool(NodePool<Node<ValueT> >* pool, int numa_node)
+{
+    std::lock_guard<BucketMutex> lck(m_mutex);
+    destroy_node(m_end);
+    Extension& extension = this->extension();
+    extension.m_pool = pool;
+    extension.m_numa_node = numa_node;
+    m_end = create_node();
+    m_end->m_next = m_end;
+    m_end->m_prev = m_end;
+}
+
+/*
+ * Links a new node with the pair to the end of the list. The pair is
+ * stored before the node is linked, so it is never seen incomplete.
+ */
+TEMPLATE_DECL
+Node<ValueT>* CLASS_NAME::link_unlocked(const ValueT& value)
+{
+    Node<ValueT>* node = create_node();
+    node->m_value.store(value);
+    node->m_next = m_end;
+    node->m_prev = m_end->m_prev;
+    node->m_next->m_prev = node;
+    node->m_prev->m_next = node;
+    ++m_size;
+    mark_changed();
+    if (listener() != nullptr) {
+        listener()->on_insert(value);
+    }
+    return node;
+}
+
+TEMPLATE_DECL
+Node<ValueT>* CLASS_NAME::create_node()
+{
+    const Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (extension == nullptr || extension->m_pool == nullptr) {
+        return new Node<ValueT>();
+    }
+    return new (extension->m_pool->allocate(extension->m_numa_node)) Node<ValueT>();
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::destroy_node(Node<ValueT>* node)
+{
+    const Extension* extension = m_extension.load(std::memory_order_acquire);
+    if (extension == nullptr || extension->m_pool == nullptr) {
+        delete node;
+        return;
+    }
+    node->~Node();
+    extension->m_pool->deallocate(node);
+}
+
 #undef TEMPLATE_DECL
 #undef CLASS_NAME
 
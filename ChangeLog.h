@@ -0,0 +1,546 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Bucket.h"
+
+namespace thread_safe {
+
+/*
+ * A single change of a HashMap as it is stored in the log file.
+ * The sequence number orders the changes made by different threads.
+ */
+template <typename KeyT, typename MappedT>
+struct ChangeRecord
+{
+    enum Type : std::uint32_t
+    {
+        INSERT,
+        ASSIGN,
+        ERASE
+    };
+
+    std::uint64_t m_sequence;
+    std::uint32_t m_type;
+    Pair<KeyT, MappedT> m_value;
+};
+
+/*
+ * A write-ahead log of the changes of a HashMap.
+ * Attached with HashMap::set_mutation_listener(), it gets every insert,
+ * assign and erase while the bucket is locked and appends a record to a
+ * ring buffer of the calling thread, without any lock shared between
+ * threads. A writer thread drains all rings and appends the records to
+ * the file with a single write and a single fdatasync per batch, which
+ * is also how concurrent flush() calls are committed together.
+ * The ring of a thread goes back to the log when the thread exits and is
+ * reused by the next new thread. Appending never fails for want of a
+ * ring, as the change is already made when the listener is called.
+ * replay() applies a log file to another map.
+ * Keys and mapped values are stored bytewise, so both must be trivially
+ * copyable.
+ */
+template <typename KeyT, typename MappedT>
+class ChangeLog : public MutationListener<Pair<const KeyT, MappedT> >
+{
+    static_assert(std::is_trivially_copyable<KeyT>::value &&
+                  std::is_trivially_copyable<MappedT>::value,
+                  "ChangeLog stores only trivially copyable types");
+
+public:
+    typedef Pair<const KeyT, MappedT> value_type;
+    typedef ChangeRecord<KeyT, MappedT> record_type;
+
+    static const std::uint64_t MAGIC = 0x48434c4f47763031ull; // "HCLOGv01"
+
+public:
+    explicit ChangeLog(const std::string& path,
+                       std::size_t ring_capacity = 4096,
+                       std::chrono::microseconds commit_interval = std::chrono::microseconds(1000));
+    ChangeLog(const ChangeLog&) = delete;
+    ChangeLog& operator= (const ChangeLog&) = delete;
+    ~ChangeLog();
+
+    void on_insert(const value_type& value) override;
+    void on_assign(const value_type& value) override;
+    void on_erase(const value_type& value) override;
+
+    void flush();
+
+    template <typename MapT>
+    static std::size_t replay(const std::string& path, MapT& map);
+
+private:
+    /*
+     * Single producer single consumer ring of records, with the indices
+     * on cache lines of their own. Allocated with detail::aligned_new.
+     * The claim flag is set while a thread owns the ring; it is shared
+     * with the thread, which clears it on exit even if the log is gone.
+     */
+    struct Ring
+    {
+        explicit Ring(std::size_t capacity)
+            : m_records(capacity)
+            , m_claimed(std::make_shared<std::atomic<bool> >(true))
+            , m_head(0)
+            , m_tail(0)
+        {}
+
+        std::vector<record_type> m_records;
+        const std::shared_ptr<std::atomic<bool> > m_claimed;
+        alignas(64) std::atomic<std::size_t> m_head;
+        alignas(64) std::atomic<std::size_t> m_tail;
+    };
+
+    /*
+     * The ring a thread owns in a log, handed back when the thread exits
+     */
+    struct RingClaim
+    {
+        RingClaim(std::uint64_t log, Ring* ring)
+            : m_log(log)
+            , m_ring(ring)
+            , m_claimed(ring->m_claimed)
+        {}
+        RingClaim(RingClaim&&) = default;
+        RingClaim& operator= (RingClaim&&) = default;
+        ~RingClaim()
+        {
+            if (m_claimed != nullptr) {
+                m_claimed->store(false, std::memory_order_release);
+            }
+        }
+
+        std::uint64_t m_log;
+        Ring* m_ring;
+        std::shared_ptr<std::atomic<bool> > m_claimed;
+    };
+
+    static const std::size_t MAX_RINGS = 1024;
+
+    std::uint64_t resume(const std::string& path);
+    void append(std::uint32_t type, const value_type& value);
+    void push(Ring& ring, std::uint32_t type, const value_type& value);
+    Ring* local_ring();
+    void run();
+    void drain(std::vector<record_type>& batch);
+    void write_batch(const std::vector<record_type>& batch);
+
+private:
+    const std::uint64_t m_id;
+    const std::size_t m_ring_capacity;
+    const std::chrono::microseconds m_commit_interval;
+    int m_fd;
+    std::atomic<int> m_error;
+    alignas(64) std::atomic<std::uint64_t> m_sequence;
+
+    std::mutex m_rings_mutex;
+    std::vector<std::unique_ptr<Ring, detail::AlignedDelete<Ring> > > m_rings;
+    std::atomic<std::size_t> m_ring_count;
+    Ring* m_ring_table[MAX_RINGS];
+    // The first ring, shared under a mutex by threads which find no other
+    std::mutex m_shared_ring_mutex;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    std::condition_variable m_committed;
+    std::uint64_t m_batches_started;
+    std::uint64_t m_batches_done;
+    bool m_flush_requested;
+    bool m_stop;
+    std::thread m_writer;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT, typename MappedT>
+#define CLASS_NAME ChangeLog<KeyT, MappedT>
+
+TEMPLATE_DECL
+const std::size_t CLASS_NAME::MAX_RINGS;
+
+namespace detail {
+
+inline std::uint64_t next_change_log_id()
+{
+    static std::atomic<std::uint64_t> id(0);
+    return ++id;
+}
+
+} // namespace detail
+
+/*
+ * Opens the log file for appending, creating it if it does not exist.
+ * The sequence numbers go on from the largest one in the file, so the
+ * records of this session replay after those of the earlier ones, and a
+ * torn last record of a crashed writer is cut off.
+ */
+TEMPLATE_DECL
+CLASS_NAME::ChangeLog(const std::string& path,
+                      std::size_t ring_capacity,
+                      std::chrono::microseconds commit_interval)
+    : m_id(detail::next_change_log_id())
+    , m_ring_capacity(std::max<std::size_t>(ring_capacity, 2))
+    , m_commit_interval(commit_interval)
+    , m_fd(-1)
+    , m_error(0)
+    , m_sequence(0)
+    , m_ring_count(0)
+    , m_batches_started(0)
+    , m_batches_done(0)
+    , m_flush_requested(false)
+    , m_stop(false)
+{
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (m_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    try {
+        m_sequence.store(resume(path));
+        m_rings.emplace_back(detail::aligned_new<Ring>(1, m_ring_capacity));
+        m_ring_table[0] = m_rings.back().get();
+        m_ring_count.store(1);
+    } catch (...) {
+        ::close(m_fd);
+        throw;
+    }
+    m_writer = std::thread(&ChangeLog::run, this);
+}
+
+/*
+ * Destructor
+ * Commits all records appended so far. The log must already be detached
+ * from the map.
+ */
+TEMPLATE_DECL
+CLASS_NAME::~ChangeLog()
+{
+    {
+        std::lock_guard<std::mutex> lck(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_one();
+    m_writer.join();
+    ::close(m_fd);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::on_insert(const value_type& value)
+{
+    append(record_type::INSERT, value);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::on_assign(const value_type& value)
+{
+    append(record_type::ASSIGN, value);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::on_erase(const value_type& value)
+{
+    append(record_type::ERASE, value);
+}
+
+/*
+ * Blocks until every record appended before the call is on disk.
+ * Concurrent callers are served by the same batch. Throws if the writer
+ * has ever failed to write the file.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::flush()
+{
+    std::unique_lock<std::mutex> lck(m_mutex);
+    // Only a batch which starts after this point is sure to see all
+    // records appended before the call
+    const std::uint64_t target = m_batches_started + 1;
+    m_flush_requested = true;
+    m_wakeup.notify_one();
+    m_committed.wait(lck, [this, target]() { return m_batches_done >= target; });
+    const int error = m_error.load();
+    if (error != 0) {
+        throw std::system_error(error, std::generic_category(), "change log write");
+    }
+}
+
+/*
+ * Replay
+ * Applies the changes stored in the log file to the map in the order
+ * they were made and returns the number of applied changes. Inserts are
+ * applied as assignments, so a log may be replayed over a snapshot which
+ * already contains some of its changes.
+ */
+TEMPLATE_DECL
+template <typename MapT>
+std::size_t CLASS_NAME::replay(const std::string& path, MapT& map)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    std::uint64_t header[2] = { 0, 0 };
+    std::vector<record_type> records;
+    ssize_t result = ::read(fd, header, sizeof(header));
+    if (result == static_cast<ssize_t>(sizeof(header)) &&
+        header[0] == MAGIC &&
+        header[1] == sizeof(record_type)) {
+        record_type record;
+        while ((result = ::read(fd, &record, sizeof(record))) == static_cast<ssize_t>(sizeof(record))) {
+            records.push_back(record);
+        }
+    } else {
+        result = -1;
+    }
+    ::close(fd);
+    // A torn last record of a crashed writer is ignored
+    if (result < 0) {
+        throw std::runtime_error("Not a change log of this map type: " + path);
+    }
+
+    std::stable_sort(records.begin(), records.end(),
+                     [](const record_type& a, const record_type& b) {
+                         return a.m_sequence < b.m_sequence;
+                     });
+    for (const auto& record : records) {
+        if (record.m_type == record_type::ERASE) {
+            map.erase(record.m_value.first);
+        } else {
+            map.insert_or_assign(record.m_value.first, record.m_value.second);
+        }
+    }
+    return records.size();
+}
+
+/*
+ * Writes the header to a new file, or checks the header of an existing
+ * one and cuts off a torn last record. Returns the sequence number which
+ * follows the largest one in the file.
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::resume(const std::string& path)
+{
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0) {
+        throw std::system_error(errno, std::generic_category(), "stat " + path);
+    }
+    std::uint64_t header[2] = { MAGIC, sizeof(record_type) };
+    const off_t header_size = static_cast<off_t>(sizeof(header));
+    if (st.st_size == 0) {
+        if (::write(m_fd, header, sizeof(header)) != static_cast<ssize_t>(sizeof(header))) {
+            throw std::system_error(errno, std::generic_category(), "write " + path);
+        }
+        return 0;
+    }
+    if (::pread(m_fd, header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+        header[0] != MAGIC ||
+        header[1] != sizeof(record_type)) {
+        throw std::runtime_error("Not a change log of this map type: " + path);
+    }
+    const off_t end = header_size + (st.st_size - header_size) / sizeof(record_type) * sizeof(record_type);
+    if (end != st.st_size && ::ftruncate(m_fd, end) != 0) {
+        throw std::system_error(errno, std::generic_category(), "truncate " + path);
+    }
+    // Batches are written in the order the rings are drained, so the
+    // largest sequence number may be anywhere in the file
+    std::uint64_t next = 0;
+    std::vector<record_type> records(4096);
+    for (off_t offset = header_size; offset < end; ) {
+        const ssize_t result = ::pread(m_fd, records.data(), records.size() * sizeof(record_type), offset);
+        if (result <= 0) {
+            throw std::system_error(result < 0 ? errno : EIO, std::generic_category(), "read " + path);
+        }
+        const std::size_t count = std::min<std::size_t>(static_cast<std::size_t>(result),
+                                                        static_cast<std::size_t>(end - offset)) / sizeof(record_type);
+        if (count == 0) {
+            throw std::system_error(EIO, std::generic_category(), "read " + path);
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+            next = std::max(next, records[i].m_sequence + 1);
+        }
+        offset += static_cast<off_t>(count * sizeof(record_type));
+    }
+    return next;
+}
+
+/*
+ * Called under the lock of the changed bucket, so the sequence number
+ * follows the order of the changes of that bucket. A full ring asks the
+ * writer for a batch right away rather than at the end of the commit
+ * interval, since the bucket stays locked until there is room.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::append(std::uint32_t type, const value_type& value)
+{
+    Ring* ring = local_ring();
+    if (ring != nullptr) {
+        push(*ring, type, value);
+        return;
+    }
+    std::lock_guard<std::mutex> lck(m_shared_ring_mutex);
+    push(*m_ring_table[0], type, value);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::push(Ring& ring, std::uint32_t type, const value_type& value)
+{
+    const std::size_t tail = ring.m_tail.load(std::memory_order_relaxed);
+    if (tail - ring.m_head.load(std::memory_order_acquire) == m_ring_capacity) {
+        {
+            std::lock_guard<std::mutex> lck(m_mutex);
+            m_flush_requested = true;
+        }
+        m_wakeup.notify_one();
+        while (tail - ring.m_head.load(std::memory_order_acquire) == m_ring_capacity) {
+            std::this_thread::yield();
+        }
+    }
+    record_type& record = ring.m_records[tail % m_ring_capacity];
+    record.m_sequence = m_sequence.fetch_add(1, std::memory_order_relaxed);
+    record.m_type = type;
+    record.m_value = Pair<KeyT, MappedT>(value.first, value.second);
+    ring.m_tail.store(tail + 1, std::memory_order_release);
+}
+
+/*
+ * Returns the ring of the calling thread. On the first call the thread
+ * claims the ring of a thread which has exited, or a new one, and the
+ * ring goes back to the log when the thread exits. Returns nullptr if
+ * MAX_RINGS threads hold rings at once; the thread then appends to the
+ * shared ring, as the change is already made and must not be lost.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::Ring* CLASS_NAME::local_ring()
+{
+    // Logs are told apart by id, as another log may reuse the address
+    static thread_local std::vector<RingClaim> claims;
+    for (const auto& claim : claims) {
+        if (claim.m_log == m_id) {
+            return claim.m_ring;
+        }
+    }
+    // Drop the claims of logs which are gone
+    claims.erase(std::remove_if(claims.begin(), claims.end(), [](const RingClaim& claim) {
+        return claim.m_claimed.use_count() == 1;
+    }), claims.end());
+
+    std::lock_guard<std::mutex> lck(m_rings_mutex);
+    Ring* ring = nullptr;
+    const std::size_t count = m_ring_count.load(std::memory_order_relaxed);
+    for (std::size_t i = 1; i < count && ring == nullptr; ++i) {
+        // Pairs with the release of the exited owner, whose records
+        // are then seen by this one
+        if (!m_ring_table[i]->m_claimed->load(std::memory_order_acquire)) {
+            m_ring_table[i]->m_claimed->store(true, std::memory_order_relaxed);
+            ring = m_ring_table[i];
+        }
+    }
+    if (ring == nullptr) {
+        if (count == MAX_RINGS) {
+            return nullptr;
+        }
+        m_rings.emplace_back(detail::aligned_new<Ring>(1, m_ring_capacity));
+        ring = m_rings.back().get();
+        m_ring_table[count] = ring;
+        m_ring_count.store(count + 1, std::memory_order_release);
+    }
+    claims.push_back(RingClaim(m_id, ring));
+    return ring;
+}
+
+/*
+ * The writer thread: commits a batch every commit interval, or right away
+ * when flush() asks for it
+ */
+TEMPLATE_DECL
+void CLASS_NAME::run()
+{
+    std::vector<record_type> batch;
+    std::unique_lock<std::mutex> lck(m_mutex);
+    for (;;) {
+        m_wakeup.wait_for(lck, m_commit_interval, [this]() { return m_flush_requested || m_stop; });
+        const bool stop = m_stop;
+        const std::uint64_t batch_number = ++m_batches_started;
+        m_flush_requested = false;
+        lck.unlock();
+
+        batch.clear();
+        drain(batch);
+        if (!batch.empty()) {
+            write_batch(batch);
+        }
+
+        lck.lock();
+        m_batches_done = batch_number;
+        m_committed.notify_all();
+        if (stop) {
+            break;
+        }
+    }
+}
+
+/*
+ * Moves the records of all rings to the batch
+ */
+TEMPLATE_DECL
+void CLASS_NAME::drain(std::vector<record_type>& batch)
+{
+    const std::size_t ring_count = m_ring_count.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < ring_count; ++i) {
+        Ring& ring = *m_ring_table[i];
+        const std::size_t head = ring.m_head.load(std::memory_order_relaxed);
+        const std::size_t tail = ring.m_tail.load(std::memory_order_acquire);
+        for (std::size_t j = head; j != tail; ++j) {
+            batch.push_back(ring.m_records[j % m_ring_capacity]);
+        }
+        ring.m_head.store(tail, std::memory_order_release);
+    }
+}
+
+/*
+ * Group commit: one write and one fdatasync for the whole batch
+ */
+TEMPLATE_DECL
+void CLASS_NAME::write_batch(const std::vector<record_type>& batch)
+{
+    const char* bytes = reinterpret_cast<const char*>(batch.data());
+    std::size_t size = batch.size() * sizeof(record_type);
+    while (size > 0) {
+        const ssize_t written = ::write(m_fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            m_error.store(errno);
+            return;
+        }
+        bytes += written;
+        size -= static_cast<std::size_t>(written);
+    }
+    if (::fdatasync(m_fd) != 0) {
+        m_error.store(errno);
+    }
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+
+#include "FileIO.h"
+#include "HashMap.h"
+#include "Snapshot.h"
+
+namespace thread_safe {
+
+/*
+ * The header of a checkpoint file. It is followed by the section table
+ * and then by the sections, each being the packed pairs of one bucket.
+ * A full checkpoint has a section for every bucket, a delta has one for
+ * every bucket changed since the previous checkpoint. A section always
+ * holds the whole bucket, so erased pairs are simply absent from it.
+ */
+struct CheckpointHeader
+{
+    enum Kind : std::uint64_t
+    {
+        FULL,
+        DELTA
+    };
+
+    std::uint64_t m_magic;
+    std::uint64_t m_kind;
+    std::uint64_t m_bucket_count;
+    std::uint64_t m_record_size;
+    std::uint64_t m_section_count;
+};
+
+struct CheckpointSection
+{
+    std::uint64_t m_bucket;
+    std::uint64_t m_offset;
+    std::uint64_t m_count;
+};
+
+/*
+ * Incremental checkpoints of a HashMap.
+ * The map keeps the version every bucket had at the latest checkpoint.
+ * write_delta() writes only the buckets whose versions have moved since,
+ * so a chain of a full checkpoint followed by deltas describes the
+ * latest state. load() restores a map from a chain
+ * the way Snapshot::load() does, and compact() merges a chain into a
+ * single full checkpoint.
+ * Keys and mapped values are stored bytewise, so both must be trivially
+ * copyable.
+ */
+template <typename MapT>
+class Checkpoint;
+
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT,
+          typename KeyEqualT>
+class Checkpoint<HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> >
+{
+    static_assert(std::is_trivially_copyable<KeyT>::value &&
+                  std::is_trivially_copyable<MappedT>::value,
+                  "Checkpoint stores only trivially copyable types");
+
+public:
+    typedef HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> map_type;
+    typedef Pair<KeyT, MappedT> record_type;
+
+    static const std::uint64_t MAGIC = 0x4843484b50763031ull; // "HCHKPv01"
+
+public:
+    static std::size_t write_full(const map_type& map, const std::string& path);
+    static std::size_t write_delta(const map_type& map, const std::string& path);
+    static void load(map_type& map,
+                     const std::vector<std::string>& chain,
+                     std::size_t thread_count = std::thread::hardware_concurrency());
+    static void compact(const std::vector<std::string>& chain, const std::string& path);
+
+private:
+    /*
+     * Where the latest contents of a bucket are found in a chain
+     */
+    struct Source
+    {
+        const char* m_records;
+        std::uint64_t m_count;
+    };
+
+    typedef std::vector<std::unique_ptr<detail::MappedFile> > file_list;
+
+    static std::size_t write(const map_type& map, const std::string& path, std::uint64_t kind);
+    static std::vector<Source> resolve(const std::vector<std::string>& chain, file_list& files);
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME Checkpoint<HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> >
+
+/*
+ * Writes all buckets and starts a new chain.
+ * Returns the number of written buckets.
+ */
+TEMPLATE_DECL
+std::size_t CLASS_NAME::write_full(const map_type& map, const std::string& path)
+{
+    return write(map, path, CheckpointHeader::FULL);
+}
+
+/*
+ * Writes the buckets changed since the previous checkpoint.
+ * Returns the number of written buckets.
+ */
+TEMPLATE_DECL
+std::size_t CLASS_NAME::write_delta(const map_type& map, const std::string& path)
+{
+    return write(map, path, CheckpointHeader::DELTA);
+}
+
+/*
+ * Load
+ * Replaces the contents of the map with the state described by the
+ * chain, which is a full checkpoint followed by its deltas in the order
+ * they were written. The map must not be used by other threads until
+ * the load returns. Afterwards the map counts as checkpointed, so the
+ * next delta may continue the chain.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::load(map_type& map, const std::vector<std::string>& chain, std::size_t thread_count)
+{
+    file_list files;
+    const std::vector<Source> sources = resolve(chain, files);
+    std::vector<std::uint64_t> counts(BUCKET_COUNT);
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        counts[i] = sources[i].m_count;
+    }
+
+    map.clear();
+    detail::for_each_range(counts, thread_count, [&](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; ++i) {
+            detail::for_each_record<record_type>(sources[i].m_records, sources[i].m_count,
+                [&map, i](const record_type& value) {
+                    map.m_buckets[i].append_unlocked(typename map_type::value_type(value.first, value.second));
+                });
+        }
+    });
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        map.m_checkpoint_versions[i].store(map.m_buckets[i].version());
+    }
+}
+
+/*
+ * Compact
+ * Merges the chain into a single full checkpoint at path, which must
+ * not be one of the files of the chain. The new file is synced before
+ * the return, and the files of the chain may be removed only after it.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::compact(const std::vector<std::string>& chain, const std::string& path)
+{
+    file_list files;
+    const std::vector<Source> sources = resolve(chain, files);
+
+    const detail::OutputFile file(path);
+    std::vector<CheckpointSection> sections(BUCKET_COUNT);
+    off_t offset = sizeof(CheckpointHeader) + BUCKET_COUNT * sizeof(CheckpointSection);
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        sections[i].m_bucket = i;
+        sections[i].m_offset = offset;
+        sections[i].m_count = sources[i].m_count;
+        detail::write_section<record_type>(file.fd(), sources[i].m_records, sources[i].m_count, offset);
+    }
+    CheckpointHeader header;
+    header.m_magic = MAGIC;
+    header.m_kind = CheckpointHeader::FULL;
+    header.m_bucket_count = BUCKET_COUNT;
+    header.m_record_size = sizeof(record_type);
+    header.m_section_count = BUCKET_COUNT;
+    detail::write_table(file.fd(), header, sections);
+    file.sync();
+}
+
+/*
+ * Reads the version of a bucket before the bucket, so a change made
+ * while the checkpoint is written also gets into the next delta. The
+ * versions are recorded only once the file is complete, so the buckets
+ * of a failed checkpoint get into the next one.
+ */
+TEMPLATE_DECL
+std::size_t CLASS_NAME::write(const map_type& map, const std::string& path, std::uint64_t kind)
+{
+    std::vector<std::size_t> buckets;
+    std::vector<std::uint64_t> versions;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        const std::uint64_t version = map.m_buckets[i].version();
+        if (kind == CheckpointHeader::FULL || version != map.m_checkpoint_versions[i].load()) {
+            buckets.push_back(i);
+            versions.push_back(version);
+        }
+    }
+
+    const detail::OutputFile file(path);
+    std::vector<CheckpointSection> sections(buckets.size());
+    std::vector<record_type> buffer;
+    off_t offset = sizeof(CheckpointHeader) + buckets.size() * sizeof(CheckpointSection);
+    for (std::size_t i = 0; i < buckets.size(); ++i) {
+        detail::bucket_records(map.m_buckets[buckets[i]], buffer);
+        sections[i].m_bucket = buckets[i];
+        sections[i].m_offset = offset;
+        sections[i].m_count = buffer.size();
+        detail::write_section<record_type>(file.fd(), buffer.data(), buffer.size(), offset);
+    }
+    CheckpointHeader header;
+    header.m_magic = MAGIC;
+    header.m_kind = kind;
+    header.m_bucket_count = BUCKET_COUNT;
+    header.m_record_size = sizeof(record_type);
+    header.m_section_count = buckets.size();
+    detail::write_table(file.fd(), header, sections);
+    file.sync();
+    for (std::size_t i = 0; i < buckets.size(); ++i) {
+        map.m_checkpoint_versions[buckets[i]].store(versions[i]);
+    }
+    return buckets.size();
+}
+
+/*
+ * Maps the files of the chain and finds the latest section of every
+ * bucket
+ */
+TEMPLATE_DECL
+std::vector<typename CLASS_NAME::Source> CLASS_NAME::resolve(const std::vector<std::string>& chain,
+                                                             file_list& files)
+{
+    std::vector<Source> sources(BUCKET_COUNT, Source{ nullptr, 0 });
+    for (std::size_t f = 0; f < chain.size(); ++f) {
+        files.emplace_back(new detail::MappedFile(chain[f]));
+        const char* data = files.back()->data();
+        const std::size_t length = files.back()->size();
+        const CheckpointHeader* header = reinterpret_cast<const CheckpointHeader*>(data);
+        if (length < sizeof(CheckpointHeader) ||
+            header->m_magic != MAGIC ||
+            header->m_bucket_count != BUCKET_COUNT ||
+            header->m_record_size != sizeof(record_type) ||
+            header->m_kind != (f == 0 ? CheckpointHeader::FULL : CheckpointHeader::DELTA) ||
+            !detail::fits(length, sizeof(CheckpointHeader), header->m_section_count, sizeof(CheckpointSection))) {
+            throw std::runtime_error("Not a checkpoint chain of this map type: " + chain[f]);
+        }
+        const CheckpointSection* sections = reinterpret_cast<const CheckpointSection*>(data + sizeof(CheckpointHeader));
+        for (std::size_t i = 0; i < header->m_section_count; ++i) {
+            if (sections[i].m_bucket >= BUCKET_COUNT ||
+                !detail::fits(length, sections[i].m_offset, sections[i].m_count, sizeof(record_type))) {
+                throw std::runtime_error("Truncated checkpoint: " + chain[f]);
+            }
+            sources[sections[i].m_bucket] = Source{ data + sections[i].m_offset, sections[i].m_count };
+        }
+    }
+    if (chain.empty()) {
+        throw std::invalid_argument("Empty checkpoint chain");
+    }
+    return sources;
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
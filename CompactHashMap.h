@@ -0,0 +1,317 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#include "Bucket.h"
+#include "Memory.h"
+
+namespace thread_safe {
+
+/*
+ * A node of CompactHashMap. Chains are singly linked since a node is
+ * always unlinked during the search for its key.
+ */
+template <typename ValueT>
+struct CompactNode
+{
+    explicit CompactNode(const ValueT& value)
+        : m_next(nullptr)
+        , m_value(value)
+    {}
+
+    CompactNode* m_next;
+    ValueT m_value;
+};
+
+/*
+ * A HashMap variant which spends as little memory per pair as possible.
+ * Nodes have no back link and are allocated from a NodePool, which packs
+ * them without the header and the size rounding of malloc, so a pair of
+ * two 32 bit integers costs 16 bytes instead of the 24 of a Node (and
+ * the 32 of a Node allocated with new).
+ * Every bucket has its own mutex. Lookups copy the mapped value out, as
+ * there are no iterators.
+ * An erased node goes to the free list of its bucket and is reused by
+ * the next insert into that bucket under the lock the insert holds
+ * anyway, so only a bucket growing beyond its largest size so far takes
+ * a node from the pool and the lock of the pool.
+ */
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT = std::hash<KeyT>,
+          typename KeyEqualT = std::equal_to<KeyT> >
+class CompactHashMap
+{
+public:
+    typedef KeyT key_type;
+    typedef MappedT mapped_type;
+    typedef Pair<const KeyT, MappedT> value_type;
+    typedef std::size_t size_type;
+    typedef HashT hasher;
+    typedef KeyEqualT key_equal;
+
+    /* Constructors */
+public:
+    explicit CompactHashMap(const hasher& hash = hasher());
+    CompactHashMap(const CompactHashMap&) = delete;
+    CompactHashMap& operator= (const CompactHashMap&) = delete;
+    ~CompactHashMap();
+
+    /* Mutators */
+public:
+    bool insert(const key_type& key, const mapped_type& value);
+    void insert_or_assign(const key_type& key, const mapped_type& value);
+    bool erase(const key_type& key);
+    void clear();
+
+    /* Selectors */
+public:
+    bool find(const key_type& key, mapped_type& value) const;
+    template <typename FnT>
+    void for_each(FnT fn) const;
+    size_type size() const;
+    bool empty() const;
+
+    /* Private members and helper functions */
+private:
+    typedef CompactNode<value_type> node_type;
+
+    struct FreeNode
+    {
+        FreeNode* m_next;
+    };
+
+    struct CompactBucket
+    {
+        CompactBucket()
+            : m_head(nullptr)
+            , m_free(nullptr)
+            , m_size(0)
+        {}
+
+        mutable std::mutex m_mutex;
+        node_type* m_head;
+        FreeNode* m_free;
+        size_type m_size;
+    };
+
+    CompactBucket& bucket(const key_type& key) const;
+    node_type** find_link(const CompactBucket& bucket, const key_type& key) const;
+    node_type* create_node(CompactBucket& bucket, const key_type& key, const mapped_type& value);
+    void destroy_node(CompactBucket& bucket, node_type* node);
+
+private:
+    std::unique_ptr<CompactBucket[]> m_buckets;
+    NodePool<node_type> m_pool;
+    hasher m_hasher;
+    key_equal m_key_equal;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME CompactHashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT>
+
+TEMPLATE_DECL
+CLASS_NAME::CompactHashMap(const hasher& hash)
+    : m_buckets(new CompactBucket[BUCKET_COUNT])
+    , m_pool()
+    , m_hasher(hash)
+    , m_key_equal()
+{}
+
+TEMPLATE_DECL
+CLASS_NAME::~CompactHashMap()
+{
+    clear();
+}
+
+/*
+ * Insertion
+ * Returns false if there already is a pair with the key
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::insert(const key_type& key, const mapped_type& value)
+{
+    CompactBucket& b = bucket(key);
+    std::lock_guard<std::mutex> lck(b.m_mutex);
+    node_type** link = find_link(b, key);
+    if (*link != nullptr) {
+        return false;
+    }
+    *link = create_node(b, key, value);
+    ++b.m_size;
+    return true;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    CompactBucket& b = bucket(key);
+    std::lock_guard<std::mutex> lck(b.m_mutex);
+    node_type** link = find_link(b, key);
+    if (*link != nullptr) {
+        (*link)->m_value.second = value;
+        return;
+    }
+    *link = create_node(b, key, value);
+    ++b.m_size;
+}
+
+/*
+ * Deletion
+ * The node is unlinked through the link found by the search, so no back
+ * link is needed. Returns false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::erase(const key_type& key)
+{
+    CompactBucket& b = bucket(key);
+    std::lock_guard<std::mutex> lck(b.m_mutex);
+    node_type** link = find_link(b, key);
+    node_type* node = *link;
+    if (node == nullptr) {
+        return false;
+    }
+    *link = node->m_next;
+    destroy_node(b, node);
+    --b.m_size;
+    return true;
+}
+
+/*
+ * Returns the nodes of the pairs and the free lists to the pool, so the
+ * memory may go to any bucket afterwards
+ */
+TEMPLATE_DECL
+void CLASS_NAME::clear()
+{
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        CompactBucket& b = m_buckets[i];
+        std::lock_guard<std::mutex> lck(b.m_mutex);
+        while (b.m_head != nullptr) {
+            node_type* node = b.m_head;
+            b.m_head = node->m_next;
+            destroy_node(b, node);
+        }
+        while (b.m_free != nullptr) {
+            FreeNode* node = b.m_free;
+            b.m_free = node->m_next;
+            m_pool.deallocate(node);
+        }
+        b.m_size = 0;
+    }
+}
+
+/*
+ * Copies the mapped value of the key to value.
+ * Returns false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::find(const key_type& key, mapped_type& value) const
+{
+    const CompactBucket& b = bucket(key);
+    std::lock_guard<std::mutex> lck(b.m_mutex);
+    const node_type* node = *find_link(b, key);
+    if (node == nullptr) {
+        return false;
+    }
+    value = node->m_value.second;
+    return true;
+}
+
+/*
+ * Calls fn with every pair, each bucket being locked while its pairs are
+ * visited
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::for_each(FnT fn) const
+{
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        const CompactBucket& b = m_buckets[i];
+        std::lock_guard<std::mutex> lck(b.m_mutex);
+        for (const node_type* node = b.m_head; node != nullptr; node = node->m_next) {
+            fn(node->m_value);
+        }
+    }
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::size() const
+{
+    size_type s = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        std::lock_guard<std::mutex> lck(m_buckets[i].m_mutex);
+        s += m_buckets[i].m_size;
+    }
+    return s;
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return size() == 0;
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::CompactBucket& CLASS_NAME::bucket(const key_type& key) const
+{
+    return m_buckets[m_hasher(key) % BUCKET_COUNT];
+}
+
+/*
+ * Returns the link which points to the node with the key, or the null
+ * link at the end of the chain if there is none. The bucket must be
+ * locked.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::node_type** CLASS_NAME::find_link(const CompactBucket& bucket, const key_type& key) const
+{
+    node_type** link = const_cast<node_type**>(&bucket.m_head);
+    while (*link != nullptr && !m_key_equal((*link)->m_value.first, key)) {
+        link = &(*link)->m_next;
+    }
+    return link;
+}
+
+/*
+ * Takes a node from the free list of the bucket, or else from the arena
+ * of the first NUMA node: the pool is used for its packing here, not for
+ * placement. The bucket must be locked.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::node_type* CLASS_NAME::create_node(CompactBucket& bucket, const key_type& key, const mapped_type& value)
+{
+    void* memory = bucket.m_free;
+    if (memory != nullptr) {
+        bucket.m_free = bucket.m_free->m_next;
+    } else {
+        memory = m_pool.allocate(0);
+    }
+    return new (memory) node_type(value_type(key, value));
+}
+
+/*
+ * Puts the node on the free list of the bucket, which must be locked
+ */
+TEMPLATE_DECL
+void CLASS_NAME::destroy_node(CompactBucket& bucket, node_type* node)
+{
+    node->~node_type();
+    bucket.m_free = new (node) FreeNode{bucket.m_free};
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace thread_safe {
+namespace detail {
+
+/*
+ * Writes the whole buffer at the given offset of the file
+ */
+inline void write_all(int fd, const void* data, std::size_t size, off_t offset)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        const ssize_t written = ::pwrite(fd, bytes, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "pwrite");
+        }
+        bytes += written;
+        size -= static_cast<std::size_t>(written);
+        offset += written;
+    }
+}
+
+/*
+ * A file created or truncated for writing, closed when the object goes
+ * away
+ */
+class OutputFile
+{
+public:
+    explicit OutputFile(const std::string& path)
+        : m_path(path)
+        , m_fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644))
+    {
+        if (m_fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+    }
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator= (const OutputFile&) = delete;
+    ~OutputFile()
+    {
+        ::close(m_fd);
+    }
+
+    int fd() const
+    {
+        return m_fd;
+    }
+
+    void sync() const
+    {
+        if (::fdatasync(m_fd) != 0) {
+            throw std::system_error(errno, std::generic_category(), "fdatasync " + m_path);
+        }
+    }
+
+private:
+    const std::string m_path;
+    const int m_fd;
+};
+
+/*
+ * The files of Snapshot and Checkpoint are a header, a table of sections
+ * and the sections, each being the packed records of one bucket.
+ */
+
+/*
+ * Copies the pairs of a bucket to the buffer as records
+ */
+template <typename RecordT, typename BucketT>
+void bucket_records(const BucketT& bucket, std::vector<RecordT>& buffer)
+{
+    buffer.clear();
+    bucket.for_each([&buffer](const auto& value) {
+        buffer.push_back(RecordT(value.first, value.second));
+    });
+}
+
+/*
+ * Writes a section of count records at offset and moves offset past it
+ */
+template <typename RecordT>
+void write_section(int fd, const void* records, std::uint64_t count, off_t& offset)
+{
+    write_all(fd, records, count * sizeof(RecordT), offset);
+    offset += static_cast<off_t>(count * sizeof(RecordT));
+}
+
+/*
+ * Writes the section table behind the header and then the header. The
+ * header goes last, so a file whose writing failed has no valid magic.
+ */
+template <typename HeaderT, typename SectionT>
+void write_table(int fd, const HeaderT& header, const std::vector<SectionT>& sections)
+{
+    write_all(fd, sections.data(), sections.size() * sizeof(SectionT), sizeof(HeaderT));
+    write_all(fd, &header, sizeof(header), 0);
+}
+
+/*
+ * Tells whether count entries of entry_size bytes starting at offset lie
+ * within a file of the given length, without overflowing
+ */
+inline bool fits(std::size_t length, std::uint64_t offset, std::uint64_t count, std::size_t entry_size)
+{
+    return offset <= length && count <= (length - offset) / entry_size;
+}
+
+/*
+ * Calls fn(const RecordT&) with each of the count records of a mapped
+ * section, which are copied out as they need not be aligned
+ */
+template <typename RecordT, typename FnT>
+void for_each_record(const char* records, std::uint64_t count, FnT fn)
+{
+    for (std::uint64_t i = 0; i < count; ++i, records += sizeof(RecordT)) {
+        RecordT record;
+        std::memcpy(&record, records, sizeof(RecordT));
+        fn(record);
+    }
+}
+
+/*
+ * A file mapped read-only for the lifetime of the object.
+ * The pages are read ahead in the background, since the files which are
+ * mapped this way are read from the beginning to the end.
+ */
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path)
+        : m_data(nullptr)
+        , m_size(0)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "fstat " + path);
+        }
+        m_size = static_cast<std::size_t>(st.st_size);
+        if (m_size != 0) {
+            void* data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                const int error = errno;
+                ::close(fd);
+                throw std::system_error(error, std::generic_category(), "mmap " + path);
+            }
+            m_data = static_cast<const char*>(data);
+            ::madvise(data, m_size, MADV_SEQUENTIAL);
+            ::madvise(data, m_size, MADV_WILLNEED);
+        }
+        ::close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator= (const MappedFile&) = delete;
+    ~MappedFile()
+    {
+        if (m_data != nullptr) {
+            ::munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+
+    const char* data() const
+    {
+        return m_data;
+    }
+
+    std::size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    const char* m_data;
+    std::size_t m_size;
+};
+
+} // namespace detail
+} // namespace thread_safe
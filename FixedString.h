@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <string>
+
+namespace thread_safe {
+
+/*
+ * A string of at most N bytes stored inline, for string keys of the maps
+ * whose pairs must be trivially copyable. The bytes past the end are
+ * zero, so two equal strings are equal bytewise as well.
+ */
+template <std::size_t N>
+class FixedString
+{
+    static_assert(N > 0 && N < 256, "FixedString holds 1 to 255 bytes");
+
+public:
+    FixedString();
+    explicit FixedString(const char* str);
+    FixedString(const char* data, std::size_t size);
+    explicit FixedString(const std::string& str);
+
+    const char* data() const;
+    std::size_t size() const;
+    bool empty() const;
+    std::string str() const;
+
+    bool operator== (const FixedString& that) const;
+    bool operator!= (const FixedString& that) const;
+    bool operator< (const FixedString& that) const;
+
+private:
+    void assign(const char* data, std::size_t size);
+
+private:
+    std::uint8_t m_size;
+    char m_data[N];
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <std::size_t N>
+#define CLASS_NAME FixedString<N>
+
+TEMPLATE_DECL
+CLASS_NAME::FixedString()
+{
+    assign(nullptr, 0);
+}
+
+TEMPLATE_DECL
+CLASS_NAME::FixedString(const char* str)
+{
+    assign(str, std::strlen(str));
+}
+
+TEMPLATE_DECL
+CLASS_NAME::FixedString(const char* data, std::size_t size)
+{
+    assign(data, size);
+}
+
+TEMPLATE_DECL
+CLASS_NAME::FixedString(const std::string& str)
+{
+    assign(str.data(), str.size());
+}
+
+TEMPLATE_DECL
+const char* CLASS_NAME::data() const
+{
+    return m_data;
+}
+
+TEMPLATE_DECL
+std::size_t CLASS_NAME::size() const
+{
+    return m_size;
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return m_size == 0;
+}
+
+TEMPLATE_DECL
+std::string CLASS_NAME::str() const
+{
+    return std::string(m_data, m_size);
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::operator== (const FixedString& that) const
+{
+    return m_size == that.m_size && std::memcmp(m_data, that.m_data, m_size) == 0;
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::operator!= (const FixedString& that) const
+{
+    return !(*this == that);
+}
+
+/*
+ * Bytewise lexicographic order, the bytes taken as unsigned
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::operator< (const FixedString& that) const
+{
+    const int result = std::memcmp(m_data, that.m_data, m_size < that.m_size ? m_size : that.m_size);
+    return result < 0 || (result == 0 && m_size < that.m_size);
+}
+
+/*
+ * Throws std::length_error if the string is longer than N bytes
+ */
+TEMPLATE_DECL
+void CLASS_NAME::assign(const char* data, std::size_t size)
+{
+    if (size > N) {
+        throw std::length_error("FixedString: the string is too long");
+    }
+    std::memset(m_data, 0, N);
+    if (size > 0) {
+        std::memcpy(m_data, data, size);
+    }
+    m_size = static_cast<std::uint8_t>(size);
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
+
+namespace std {
+
+/*
+ * FNV-1a over the bytes of the string
+ */
+template <std::size_t N>
+struct hash<thread_safe::FixedString<N> >
+{
+    std::size_t operator() (const thread_safe::FixedString<N>& str) const
+    {
+        std::uint64_t h = 0xcbf29ce484222325ull;
+        for (std::size_t i = 0; i < str.size(); ++i) {
+            h ^= static_cast<unsigned char>(str.data()[i]);
+            h *= 0x100000001b3ull;
+        }
+        return static_cast<std::size_t>(h);
+    }
+};
+
+} // namespace std
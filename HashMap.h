@@ -1,12 +1,55 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <vector>
 
 #include "IteratorHelper.h"
+#include "Partitions.h"
 
 namespace thread_safe {
+
+namespace detail {
+
+/*
+ * Compares two values with operator== if their type has one, and
+ * bytewise otherwise, which also compares any padding bytes
+ */
+template <typename T>
+auto values_equal(const T& a, const T& b, int) -> decltype(static_cast<bool>(a == b))
+{
+    return static_cast<bool>(a == b);
+}
+
+template <typename T>
+bool values_equal(const T& a, const T& b, long)
+{
+    return std::memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+template <typename T>
+bool values_equal(const T& a, const T& b)
+{
+    return values_equal(a, b, 0);
+}
+
+} // namespace detail
+
+template <typename MapT>
+class Snapshot;
+
+template <typename MapT>
+class Checkpoint;
+
+template <typename MapT>
+class Transaction;
     
 /*
 * An associative thread safe container which provides interface for
@@ -32,7 +75,7 @@ public:
     typedef std::ptrdiff_t difference_type;
     typedef HashT hasher;
     typedef KeyEqualT key_equal;
-    typedef Reference<value_type> reference;
+    typedef Reference<value_type, Bucket<key_type, value_type, KeyEqualT> > reference;
     typedef const reference const_reference;
     typedef reference* pointer;
     typedef const_reference* const_pointer;
@@ -54,6 +97,7 @@ public:
     /* Constructors */
 public:
     explicit HashMap(const hasher& hash = hasher());
+    explicit HashMap(const MemoryOptions& memory, const hasher& hash = hasher());
     template <typename InputIt>
     HashMap(InputIt first,
             InputIt last,
@@ -76,12 +120,62 @@ public:
     void erase(const key_type& key);
     iterator erase(iterator position);
     iterator find(const key_type& key);
+    template <typename FactoryT>
+    Pair<iterator, bool> get_or_insert_with(const key_type& key, FactoryT factory);
+    template <typename UpdateT>
+    bool update_if(const key_type& key, UpdateT update);
     reference operator[] (const key_type& key);
     void clear();
+    void set_mutation_listener(MutationListener<value_type>* listener);
+    void add_mutation_listener(MutationListener<value_type>* listener);
+    void remove_mutation_listener(MutationListener<value_type>* listener);
+    void set_flat_combining(bool enabled);
+    void set_reader_bias(bool enabled);
+
+    /* Partitioned mode */
+public:
+    void start_partitions(std::size_t owner_count);
+    void stop_partitions();
+    bool delegate_insert(const key_type& key, const mapped_type& value);
+    void delegate_insert_or_assign(const key_type& key, const mapped_type& value);
+    bool delegate_erase(const key_type& key);
+    bool delegate_find(const key_type& key, mapped_type& value);
+    void post_insert(const key_type& key, const mapped_type& value);
+    void post_insert_or_assign(const key_type& key, const mapped_type& value);
+    void post_erase(const key_type& key);
+    void drain_partitions();
+
+    /* Asynchronous access */
+public:
+    template <typename CallbackT>
+    void async_find(const key_type& key, CallbackT callback);
+    template <typename CallbackT>
+    void async_insert(const key_type& key, const mapped_type& value, CallbackT callback);
+    template <typename UpdateT, typename CallbackT>
+    void async_update(const key_type& key, UpdateT update, CallbackT callback);
+#if defined(__cpp_impl_coroutine)
+    auto async_find(const key_type& key);
+    auto async_insert(const key_type& key, const mapped_type& value);
+    template <typename UpdateT>
+    auto async_update(const key_type& key, UpdateT update);
+#endif
 
     /* Selectors */
 public:
     const_iterator find(const key_type& key) const;
+    size_type find_batch(const key_type* keys,
+                         size_type count,
+                         mapped_type* values,
+                         bool* found) const;
+    bool cached_find(const key_type& key, mapped_type& value) const;
+    size_type multi_get(const key_type* keys,
+                        size_type count,
+                        mapped_type* values,
+                        bool* found) const;
+    template <typename FnT>
+    bool visit(const key_type& key, FnT fn) const;
+    template <typename FnT>
+    void visit_all(FnT fn) const;
     size_type size() const;
     bool empty() const;
 
@@ -92,6 +186,18 @@ public:
     iterator end();
     const_iterator end() const;
     
+    /* Watching */
+public:
+    class Watch;
+
+    std::uint64_t change_version(const key_type& key) const;
+    template <typename RepT, typename PeriodT>
+    bool wait_for_change(const key_type& key,
+                         std::uint64_t old_version,
+                         const std::chrono::duration<RepT, PeriodT>& timeout) const;
+    template <typename CallbackT>
+    Watch watch(const key_type& key, CallbackT callback) const;
+
     /* Hasher */
 public:
     hasher& get_hasher();
@@ -99,9 +205,75 @@ public:
 
     /* Private members and helper functions */
 private:
+    template <typename MapT>
+    friend class Snapshot;
+    template <typename MapT>
+    friend class Checkpoint;
+    template <typename MapT>
+    friend class Transaction;
+
+    typedef Bucket<key_type, value_type, KeyEqualT> bucket_type;
+    typedef typename bucket_type::Operation operation_type;
+
+    static const std::size_t BATCH_WIDTH = 16;
+    static const std::size_t READ_CACHE_SIZE = 256;
+    static const unsigned MULTI_GET_ATTEMPTS = 4;
+
+    /*
+     * The state of one lookup of find_batch()
+     */
+    struct BatchLookup
+    {
+        enum Stage
+        {
+            IDLE,
+            LOCK,
+            FIRST,
+            COMPARE
+        };
+
+        Stage m_stage;
+        size_type m_index;
+        const bucket_type* m_bucket;
+        std::atomic<const void*>* m_slot;
+        const Node<value_type>* m_node;
+    };
+
+    /*
+     * An entry of the read cache of a thread, valid while the bucket of
+     * the key has the same version
+     */
+    struct ReadCacheEntry
+    {
+        std::uint64_t m_map;
+        std::uint64_t m_version;
+        bool m_found;
+        key_type m_key;
+        mapped_type m_value;
+    };
+
+    static std::uint64_t next_map_id();
+    static ReadCacheEntry* read_cache();
+
+    void init_buckets();
+    void free_buckets();
+    std::size_t partition_of(std::size_t bucket_index) const;
+    PartitionExecutor& partitions() const;
+    void apply_listeners();
+    void report_pairs(bool inserted) const;
+
+    MemoryOptions m_memory;
+    NodePool<Node<value_type> >* m_pool;
     Bucket<key_type, value_type, KeyEqualT>* m_buckets;
+    // The version of every bucket at the latest checkpoint
+    std::atomic<std::uint64_t>* m_checkpoint_versions;
     hasher m_hasher;
     mutable std::recursive_mutex m_mutex;
+    std::atomic<bool> m_flat_combining;
+    PartitionExecutor* m_partitions;
+    std::uint64_t m_id;
+    std::vector<MutationListener<value_type>*> m_listeners;
+    std::unique_ptr<MutationFanout<value_type> > m_fanout;
 };
 
 
@@ -113,14 +285,78 @@ private:
                                 typename KeyEqualT>
 #define CLASS_NAME HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT>
 
+/*
+ * The handle of a watch() which stops its thread when it goes away.
+ * It must go away before the map does.
+ */
+TEMPLATE_DECL
+class CLASS_NAME::Watch
+{
+public:
+    Watch();
+    Watch(Watch&& that);
+    Watch& operator= (Watch&& that);
+    ~Watch();
+
+    void stop();
+
+private:
+    friend class HashMap;
+
+    struct State
+    {
+        explicit State(const bucket_type* bucket)
+            : m_bucket(bucket)
+            , m_stop(false)
+        {}
+
+        const bucket_type* m_bucket;
+        std::atomic<bool> m_stop;
+        std::thread m_thread;
+    };
+
+private:
+    std::unique_ptr<State> m_state;
+};
+
 /*
  * Default constructor with empty buckets
  */
 TEMPLATE_DECL
 CLASS_NAME::HashMap(const hasher& hash)
-    : m_buckets(new Bucket<key_type, value_type, KeyEqualT>[BUCKET_COUNT])
+    : m_memory()
+    , m_pool(nullptr)
+    , m_buckets(nullptr)
+    , m_checkpoint_versions(new std::atomic<std::uint64_t>[BUCKET_COUNT]())
     , m_hasher(hash)
-{}
+    , m_flat_combining(false)
+    , m_partitions(nullptr)
+    , m_id(next_map_id())
+    , m_listeners()
+    , m_fanout()
+{
+    init_buckets();
+}
+
+/*
+ * Constructor with empty buckets placed in memory as described by the
+ * memory options
+ */
+TEMPLATE_DECL
+CLASS_NAME::HashMap(const MemoryOptions& memory, const hasher& hash)
+    : m_memory(memory)
+    , m_pool(nullptr)
+    , m_buckets(nullptr)
+    , m_checkpoint_versions(new std::atomic<std::uint64_t>[BUCKET_COUNT]())
+    , m_hasher(hash)
+    , m_flat_combining(false)
+    , m_partitions(nullptr)
+    , m_id(next_map_id())
+    , m_listeners()
+    , m_fanout()
+{
+    init_buckets();
+}
 
 /*
  * Iterator based constructor
@@ -130,9 +366,18 @@ template <typename InputIt>
 CLASS_NAME::HashMap(InputIt first,
                     InputIt last,
                     const hasher& hash)
-    : m_buckets(new Bucket<key_type, value_type, KeyEqualT>[BUCKET_COUNT])
+    : m_memory()
+    , m_pool(nullptr)
+    , m_buckets(nullptr)
+    , m_checkpoint_versions(new std::atomic<std::uint64_t>[BUCKET_COUNT]())
     , m_hasher(hash)
+    , m_flat_combining(false)
+    , m_partitions(nullptr)
+    , m_id(next_map_id())
+    , m_listeners()
+    , m_fanout()
 {
+    init_buckets();
     for (auto it = first; it != last; ++it) {
         insert(thread_safe::make_pair(it->first, it->second));
     }
@@ -143,9 +388,18 @@ CLASS_NAME::HashMap(InputIt first,
  */
 TEMPLATE_DECL
 CLASS_NAME::HashMap(const HashMap& that)
-    : m_buckets(new Bucket<key_type, value_type, KeyEqualT>[BUCKET_COUNT])
+    : m_memory(that.m_memory)
+    , m_pool(nullptr)
+    , m_buckets(nullptr)
+    , m_checkpoint_versions(new std::atomic<std::uint64_t>[BUCKET_COUNT]())
     , m_hasher(that.m_hasher)
+    , m_flat_combining(false)
+    , m_partitions(nullptr)
+    , m_id(next_map_id())
+    , m_listeners()
+    , m_fanout()
 {
+    init_buckets();
     // This lock is to ensure that the source container won't be
     // affected during the copy
     std::lock_guard<std::recursive_mutex> lck(that.m_mutex);
@@ -157,14 +411,31 @@ CLASS_NAME::HashMap(const HashMap& that)
  */
 TEMPLATE_DECL
 CLASS_NAME::HashMap(HashMap&& that)
-    : m_buckets(nullptr)
+    : m_memory(that.m_memory)
+    , m_pool(nullptr)
+    , m_buckets(nullptr)
+    , m_checkpoint_versions(nullptr)
     , m_hasher(that.m_hasher)
+    , m_flat_combining(false)
+    , m_partitions(nullptr)
+    , m_id(next_map_id())
+    , m_listeners()
+    , m_fanout()
 {
+    // The owner threads of the source work on the source itself
+    that.stop_partitions();
     // This lock is to ensure that the source container won't be
     // affected during the move
     std::lock_guard<std::recursive_mutex> lck(that.m_mutex);
+    m_pool = that.m_pool;
+    that.m_pool = nullptr;
+    // The listeners stay with the source, which loses all its pairs
+    that.report_pairs(false);
     m_buckets = that.m_buckets;
     that.m_buckets = nullptr;
+    m_checkpoint_versions = that.m_checkpoint_versions;
+    that.m_checkpoint_versions = nullptr;
+    apply_listeners();
 }
 
 /*
@@ -173,9 +444,18 @@ CLASS_NAME::HashMap(HashMap&& that)
 TEMPLATE_DECL
 CLASS_NAME::HashMap(const std::initializer_list<value_type>& il,
                     const hasher& hash)
-    : m_buckets(new Bucket<key_type, value_type, KeyEqualT>[BUCKET_COUNT])
+    : m_memory()
+    , m_pool(nullptr)
+    , m_buckets(nullptr)
+    , m_checkpoint_versions(new std::atomic<std::uint64_t>[BUCKET_COUNT]())
     , m_hasher(hash)
+    , m_flat_combining(false)
+    , m_partitions(nullptr)
+    , m_id(next_map_id())
+    , m_listeners()
+    , m_fanout()
 {
+    init_buckets();
     for (const auto& value : il) {
         insert(thread_safe::make_pair(value.first, value.second));
     }
@@ -208,6 +488,8 @@ TEMPLATE_DECL
 CLASS_NAME& CLASS_NAME::operator= (HashMap&& that)
 {
     if (&that != this) {
+        stop_partitions();
+        that.stop_partitions();
         // std::lock is to avoid deadlock in case of cross assignment,
         // i.e. "a = b" in one thread and "b = a" in the other
         std::unique_lock<std::recursive_mutex> lck_this(m_mutex, std::defer_lock);
@@ -215,9 +497,23 @@ CLASS_NAME& CLASS_NAME::operator= (HashMap&& that)
         std::lock(lck_this, lck_that);
 
         clear();
+        free_buckets();
+        delete[] m_checkpoint_versions;
         m_hasher = that.m_hasher;
+        m_memory = that.m_memory;
+        m_pool = that.m_pool;
+        that.m_pool = nullptr;
+        // The listeners stay with the maps, not with the buckets, so the
+        // pairs leave those of the source and join those of this map
+        that.report_pairs(false);
         m_buckets = that.m_buckets;
         that.m_buckets = nullptr;
+        m_checkpoint_versions = that.m_checkpoint_versions;
+        that.m_checkpoint_versions = nullptr;
+        apply_listeners();
+        report_pairs(true);
+        // The read caches may hold versions of the old buckets
+        m_id = next_map_id();
     }
     return *this;
 }
@@ -232,6 +528,7 @@ CLASS_NAME& CLASS_NAME::operator= (const std::initializer_list<value_type>& il)
     for (const auto& value : il) {
         insert(value);
     }
+    return *this;
 }
 
 /*
@@ -240,9 +537,11 @@ CLASS_NAME& CLASS_NAME::operator= (const std::initializer_list<value_type>& il)
 TEMPLATE_DECL
 CLASS_NAME::~HashMap()
 {
+    stop_partitions();
     clear();
-    delete[] m_buckets;
-    m_buckets = nullptr;
+    free_buckets();
+    delete[] m_checkpoint_versions;
+    m_checkpoint_versions = nullptr;
 }
 
 /*
@@ -261,6 +560,12 @@ TEMPLATE_DECL
 Pair<typename CLASS_NAME::iterator, bool> CLASS_NAME::insert(const value_type& value)
 {
     const auto bucket_index = m_hasher(value.first) % BUCKET_COUNT;
+    if (m_flat_combining.load(std::memory_order_relaxed)) {
+        operation_type operation(operation_type::INSERT, &value, &value.first);
+        m_buckets[bucket_index].combine(operation);
+        return thread_safe::make_pair(iterator(m_buckets, bucket_index, operation.m_result.first),
+                                      operation.m_result.second);
+    }
     auto result = m_buckets[bucket_index].insert(value);
     return thread_safe::make_pair(iterator(m_buckets, bucket_index, result.first), result.second);
 }
@@ -275,6 +580,11 @@ TEMPLATE_DECL
 typename CLASS_NAME::iterator CLASS_NAME::insert_or_assign(const value_type& value)
 {
     const auto bucket_index = m_hasher(value.first) % BUCKET_COUNT;
+    if (m_flat_combining.load(std::memory_order_relaxed)) {
+        operation_type operation(operation_type::INSERT_OR_ASSIGN, &value, &value.first);
+        m_buckets[bucket_index].combine(operation);
+        return iterator(m_buckets, bucket_index, operation.m_result.first);
+    }
     auto result = m_buckets[bucket_index].insert_or_assign(value);
     return iterator(m_buckets, bucket_index, result);
 }
@@ -289,6 +599,11 @@ TEMPLATE_DECL
 void CLASS_NAME::erase(const key_type& key)
 {
     const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    if (m_flat_combining.load(std::memory_order_relaxed)) {
+        operation_type operation(operation_type::ERASE, nullptr, &key);
+        m_buckets[bucket_index].combine(operation);
+        return;
+    }
     m_buckets[bucket_index].erase(key);
 }
 
@@ -309,14 +624,62 @@ TEMPLATE_DECL
 typename CLASS_NAME::iterator CLASS_NAME::find(const key_type& key)
 {
     const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    if (m_flat_combining.load(std::memory_order_relaxed)) {
+        operation_type operation(operation_type::FIND, nullptr, &key);
+        m_buckets[bucket_index].combine(operation);
+        return iterator(m_buckets, bucket_index, operation.m_result.first);
+    }
     auto result = m_buckets[bucket_index].find(key);
     return iterator(m_buckets, bucket_index, result);
 }
 
+/*
+ * Get or insert with a factory
+ * Returns an iterator to the pair with the key and false if there is
+ * one. Otherwise inserts the pair of the key and factory(), returning an
+ * iterator to it and true. The factory is called only on a miss and at
+ * most once, with the bucket locked, and the pair becomes visible to
+ * other threads complete. The factory must not call back into the map.
+ */
+TEMPLATE_DECL
+template <typename FactoryT>
+Pair<typename CLASS_NAME::iterator, bool> CLASS_NAME::get_or_insert_with(const key_type& key, FactoryT factory)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    auto result = m_buckets[bucket_index].get_or_insert_with(key, factory);
+    return thread_safe::make_pair(iterator(m_buckets, bucket_index, result.first), result.second);
+}
+
+/*
+ * Conditional update
+ * Calls update(mapped_type&) with a copy of the mapped value of the key
+ * while the bucket is locked, and stores the changed copy if update
+ * returns true. Returns whether it was stored, false if there is no
+ * pair with the key. The update must not call back into the map.
+ */
+TEMPLATE_DECL
+template <typename UpdateT>
+bool CLASS_NAME::update_if(const key_type& key, UpdateT update)
+{
+    bucket_type& bucket = m_buckets[m_hasher(key) % BUCKET_COUNT];
+    std::lock_guard<bucket_type> lck(bucket);
+    Node<value_type>* node = bucket.find_unlocked(key);
+    if (node == bucket.end()) {
+        return false;
+    }
+    mapped_type value = node->m_value.load().second;
+    if (!update(value)) {
+        return false;
+    }
+    bucket.assign_unlocked(node, value_type(key, value));
+    return true;
+}
+
 /*
  * operator[]
  * Returns a reference object to an existing pair if one with the provided
- * key exists, or to a new pair if not
+ * key exists, or to a new pair with a default constructed mapped value
+ * if not
  * To get the pair from reference object it provides get_pair() function
  * To get the mapped value from reference object it provides get() function
  * To modify itself it provides set_pair() and set() functions respectively
@@ -324,12 +687,9 @@ typename CLASS_NAME::iterator CLASS_NAME::find(const key_type& key)
 TEMPLATE_DECL
 typename CLASS_NAME::reference CLASS_NAME::operator[] (const key_type& key)
 {
-    std::lock_guard<std::recursive_mutex> lck(m_mutex);
-    auto iter = find(key);
-    if (iter == end()) {
-        iter = insert(key, mapped_type()).first;
-    }
-    return *iter;
+    return *get_or_insert_with(key, []() {
+        return mapped_type();
+    }).first;
 }
 
 /*
@@ -346,6 +706,322 @@ void CLASS_NAME::clear()
     }
 }
 
+/*
+ * Makes all buckets report their changes to the listener only, replacing
+ * all listeners added before, or to none if nullptr is given
+ */
+TEMPLATE_DECL
+void CLASS_NAME::set_mutation_listener(MutationListener<value_type>* listener)
+{
+    std::lock_guard<std::recursive_mutex> lck(m_mutex);
+    m_listeners.clear();
+    if (listener != nullptr) {
+        m_listeners.push_back(listener);
+    }
+    apply_listeners();
+}
+
+/*
+ * Makes all buckets report their changes to the listener as well as to
+ * the listeners added before, e.g. to a ChangeLog and an index at once.
+ * Throws std::invalid_argument if the listener is added already.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::add_mutation_listener(MutationListener<value_type>* listener)
+{
+    std::lock_guard<std::recursive_mutex> lck(m_mutex);
+    if (std::find(m_listeners.begin(), m_listeners.end(), listener) != m_listeners.end()) {
+        throw std::invalid_argument("HashMap: the mutation listener is added already");
+    }
+    m_listeners.push_back(listener);
+    apply_listeners();
+}
+
+/*
+ * Stops reporting changes to the listener; the other listeners go on
+ */
+TEMPLATE_DECL
+void CLASS_NAME::remove_mutation_listener(MutationListener<value_type>* listener)
+{
+    std::lock_guard<std::recursive_mutex> lck(m_mutex);
+    m_listeners.erase(std::remove(m_listeners.begin(), m_listeners.end(), listener), m_listeners.end());
+    apply_listeners();
+}
+
+/*
+ * Makes insert, insert_or_assign, erase and find go through flat
+ * combining, which pays off when many threads hit a few hot buckets
+ */
+TEMPLATE_DECL
+void CLASS_NAME::set_flat_combining(bool enabled)
+{
+    m_flat_combining.store(enabled);
+}
+
+/*
+ * Makes the readers of every bucket announce themselves in a global table
+ * instead of locking while the bucket is not written, so that find() on
+ * popular buckets scales with the number of cores
+ */
+TEMPLATE_DECL
+void CLASS_NAME::set_reader_bias(bool enabled)
+{
+    std::lock_guard<std::recursive_mutex> lck(m_mutex);
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        m_buckets[i].set_reader_bias(enabled);
+    }
+}
+
+/*
+ * Partitioned mode
+ * Splits the buckets into owner_count contiguous ranges and starts an
+ * owner thread for each. The delegate_ and post_ functions hand every
+ * operation to the owner of its bucket, which runs it without locking.
+ * delegate_ functions wait for the result, post_ functions return at
+ * once and drain_partitions() waits until the posted ones are done.
+ * A posted operation carries its pair in the queue of the owner, so
+ * post_insert() and post_insert_or_assign() need a pair which fits in
+ * a queue cell next to a pointer (detail::InlineTask::CAPACITY bytes).
+ * While the owners run, the map must be used only through these
+ * functions, since the owners do not take the locks of the buckets.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::start_partitions(std::size_t owner_count)
+{
+    std::lock_guard<std::recursive_mutex> lck(m_mutex);
+    if (m_partitions != nullptr) {
+        throw std::logic_error("HashMap partitions are already started");
+    }
+    owner_count = std::max<std::size_t>(1, std::min<std::size_t>(owner_count, BUCKET_COUNT));
+    m_partitions = new PartitionExecutor(owner_count);
+}
+
+/*
+ * Runs the queued operations and stops the owner threads. Exceptions of
+ * posted operations which were not reported by drain_partitions() are
+ * dropped.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::stop_partitions()
+{
+    std::lock_guard<std::recursive_mutex> lck(m_mutex);
+    delete m_partitions;
+    m_partitions = nullptr;
+}
+
+/*
+ * Inserts the pair if there is no pair with the same key.
+ * Returns true if the pair was inserted.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::delegate_insert(const key_type& key, const mapped_type& value)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    bucket_type* bucket = &m_buckets[bucket_index];
+    bool inserted = false;
+    partitions().execute(partition_of(bucket_index), [bucket, &key, &value, &inserted]() {
+        inserted = bucket->insert_unlocked(thread_safe::make_pair(key, value)).second;
+    });
+    return inserted;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::delegate_insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    bucket_type* bucket = &m_buckets[bucket_index];
+    partitions().execute(partition_of(bucket_index), [bucket, &key, &value]() {
+        bucket->insert_or_assign_unlocked(thread_safe::make_pair(key, value));
+    });
+}
+
+/*
+ * Returns true if there was a pair with the key
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::delegate_erase(const key_type& key)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    bucket_type* bucket = &m_buckets[bucket_index];
+    bool erased = false;
+    partitions().execute(partition_of(bucket_index), [bucket, &key, &erased]() {
+        auto node = bucket->find_unlocked(key);
+        erased = node != bucket->end();
+        bucket->erase_unlocked(node);
+    });
+    return erased;
+}
+
+/*
+ * Copies the mapped value of the key to value.
+ * Returns false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::delegate_find(const key_type& key, mapped_type& value)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    bucket_type* bucket = &m_buckets[bucket_index];
+    bool found = false;
+    partitions().execute(partition_of(bucket_index), [bucket, &key, &value, &found]() {
+        auto node = bucket->find_unlocked(key);
+        found = node != bucket->end();
+        if (found) {
+            value = node->m_value.load().second;
+        }
+    });
+    return found;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::post_insert(const key_type& key, const mapped_type& value)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    bucket_type* bucket = &m_buckets[bucket_index];
+    const value_type pair(key, value);
+    partitions().post(partition_of(bucket_index), [bucket, pair]() {
+        bucket->insert_unlocked(pair);
+    });
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::post_insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    bucket_type* bucket = &m_buckets[bucket_index];
+    const value_type pair(key, value);
+    partitions().post(partition_of(bucket_index), [bucket, pair]() {
+        bucket->insert_or_assign_unlocked(pair);
+    });
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::post_erase(const key_type& key)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    bucket_type* bucket = &m_buckets[bucket_index];
+    partitions().post(partition_of(bucket_index), [bucket, key]() {
+        bucket->erase_unlocked(key);
+    });
+}
+
+/*
+ * Returns when all operations posted before the call are done.
+ * Rethrows the first exception a posted operation has thrown.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::drain_partitions()
+{
+    partitions().drain();
+}
+
+/*
+ * Asynchronous find
+ * Calls callback with a pair of a flag telling whether the key was found
+ * and the mapped value. Like all asynchronous functions it does not block
+ * if the bucket of the key is locked: the operation is queued to the
+ * bucket and run, callback included, by the thread which unlocks it as
+ * soon as that thread holds no other bucket lock.
+ */
+TEMPLATE_DECL
+template <typename CallbackT>
+void CLASS_NAME::async_find(const key_type& key, CallbackT callback)
+{
+    bucket_type* bucket = &m_buckets[m_hasher(key) % BUCKET_COUNT];
+    bucket->async_call([bucket, key]() {
+        const auto node = bucket->find_unlocked(key);
+        return node == bucket->end() ? Pair<bool, mapped_type>(false, mapped_type())
+                                     : Pair<bool, mapped_type>(true, node->m_value.load().second);
+    }, std::move(callback));
+}
+
+/*
+ * Asynchronous insertion
+ * Calls callback with true if the pair was inserted, false if there
+ * already is a pair with the key
+ */
+TEMPLATE_DECL
+template <typename CallbackT>
+void CLASS_NAME::async_insert(const key_type& key, const mapped_type& value, CallbackT callback)
+{
+    bucket_type* bucket = &m_buckets[m_hasher(key) % BUCKET_COUNT];
+    const value_type pair(key, value);
+    bucket->async_call([bucket, pair]() {
+        return bucket->insert_unlocked(pair).second;
+    }, std::move(callback));
+}
+
+/*
+ * Asynchronous update
+ * Calls update with a reference to a copy of the mapped value of the key
+ * while the bucket is locked and stores the result. Calls callback with
+ * false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+template <typename UpdateT, typename CallbackT>
+void CLASS_NAME::async_update(const key_type& key, UpdateT update, CallbackT callback)
+{
+    bucket_type* bucket = &m_buckets[m_hasher(key) % BUCKET_COUNT];
+    bucket->async_call([bucket, key, update]() mutable {
+        const auto node = bucket->find_unlocked(key);
+        if (node == bucket->end()) {
+            return false;
+        }
+        mapped_type value = node->m_value.load().second;
+        update(value);
+        bucket->assign_unlocked(node, value_type(key, value));
+        return true;
+    }, std::move(callback));
+}
+
+#if defined(__cpp_impl_coroutine)
+/*
+ * Awaitable variants of the asynchronous functions. The awaiting
+ * coroutine is suspended while the bucket is locked and resumed on the
+ * thread which unlocks it, once that thread holds no other bucket lock.
+ * co_await gives what the callback would get.
+ */
+TEMPLATE_DECL
+auto CLASS_NAME::async_find(const key_type& key)
+{
+    bucket_type* bucket = &m_buckets[m_hasher(key) % BUCKET_COUNT];
+    auto fn = [bucket, key]() {
+        const auto node = bucket->find_unlocked(key);
+        return node == bucket->end() ? Pair<bool, mapped_type>(false, mapped_type())
+                                     : Pair<bool, mapped_type>(true, node->m_value.load().second);
+    };
+    return typename bucket_type::template Awaitable<decltype(fn)>(bucket, std::move(fn));
+}
+
+TEMPLATE_DECL
+auto CLASS_NAME::async_insert(const key_type& key, const mapped_type& value)
+{
+    bucket_type* bucket = &m_buckets[m_hasher(key) % BUCKET_COUNT];
+    const value_type pair(key, value);
+    auto fn = [bucket, pair]() {
+        return bucket->insert_unlocked(pair).second;
+    };
+    return typename bucket_type::template Awaitable<decltype(fn)>(bucket, std::move(fn));
+}
+
+TEMPLATE_DECL
+template <typename UpdateT>
+auto CLASS_NAME::async_update(const key_type& key, UpdateT update)
+{
+    bucket_type* bucket = &m_buckets[m_hasher(key) % BUCKET_COUNT];
+    auto fn = [bucket, key, update]() mutable {
+        const auto node = bucket->find_unlocked(key);
+        if (node == bucket->end()) {
+            return false;
+        }
+        mapped_type value = node->m_value.load().second;
+        update(value);
+        bucket->assign_unlocked(node, value_type(key, value));
+        return true;
+    };
+    return typename bucket_type::template Awaitable<decltype(fn)>(bucket, std::move(fn));
+}
+#endif
+
 /*
  * Find for const objects
  */
@@ -357,6 +1033,358 @@ typename CLASS_NAME::const_iterator CLASS_NAME::find(const key_type& key) const
     return const_iterator(m_buckets, bucket_index, result);
 }
 
+/*
+ * Batch find
+ * Looks up count keys and for each key i sets found[i] and, if it is
+ * found, values[i]. Returns the number of found keys.
+ * Up to BATCH_WIDTH lookups are interleaved: each step of a lookup
+ * prefetches the memory its next step reads and then another lookup
+ * makes its step, so the cache misses of different keys overlap instead
+ * of being waited for one by one. Buckets are locked for reading, like
+ * find() does, so reader biased buckets are not written to. While holding
+ * bucket locks the lookups only try to lock further buckets, and a lookup
+ * blocks on a lock only when no other one holds a lock, so batches cannot
+ * deadlock.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::find_batch(const key_type* keys,
+                                                      size_type count,
+                                                      mapped_type* values,
+                                                      bool* found) const
+{
+    BatchLookup lookups[BATCH_WIDTH];
+    size_type next = 0;
+    size_type active = 0;
+    size_type locked = 0;
+    size_type found_count = 0;
+    for (std::size_t i = 0; i < BATCH_WIDTH; ++i) {
+        lookups[i].m_stage = BatchLookup::IDLE;
+    }
+    while (next < count || active != 0) {
+        bool progress = false;
+        for (std::size_t i = 0; i < BATCH_WIDTH; ++i) {
+            BatchLookup& lookup = lookups[i];
+            switch (lookup.m_stage) {
+            case BatchLookup::IDLE:
+                if (next == count) {
+                    break;
+                }
+                lookup.m_index = next++;
+                lookup.m_bucket = &m_buckets[m_hasher(keys[lookup.m_index]) % BUCKET_COUNT];
+                __builtin_prefetch(lookup.m_bucket);
+                lookup.m_stage = BatchLookup::LOCK;
+                ++active;
+                progress = true;
+                break;
+            case BatchLookup::LOCK:
+                if (!lookup.m_bucket->try_lock_shared(lookup.m_slot)) {
+                    break;
+                }
+                ++locked;
+                lookup.m_node = lookup.m_bucket->end();
+                __builtin_prefetch(lookup.m_node);
+                lookup.m_stage = BatchLookup::FIRST;
+                progress = true;
+                break;
+            case BatchLookup::FIRST:
+                lookup.m_node = lookup.m_node->m_next;
+                __builtin_prefetch(lookup.m_node);
+                lookup.m_stage = BatchLookup::COMPARE;
+                progress = true;
+                break;
+            case BatchLookup::COMPARE:
+                progress = true;
+                if (lookup.m_node != lookup.m_bucket->end()) {
+                    const value_type value = lookup.m_node->m_value.load();
+                    if (!key_equal()(value.first, keys[lookup.m_index])) {
+                        lookup.m_node = lookup.m_node->m_next;
+                        __builtin_prefetch(lookup.m_node);
+                        break;
+                    }
+                    values[lookup.m_index] = value.second;
+                }
+                found[lookup.m_index] = lookup.m_node != lookup.m_bucket->end();
+                found_count += found[lookup.m_index];
+                lookup.m_bucket->unlock_shared(lookup.m_slot);
+                --locked;
+                --active;
+                lookup.m_stage = BatchLookup::IDLE;
+                break;
+            }
+        }
+        if (!progress && locked == 0) {
+            // All lookups wait for buckets locked by other threads
+            for (std::size_t i = 0; i < BATCH_WIDTH; ++i) {
+                if (lookups[i].m_stage == BatchLookup::LOCK) {
+                    lookups[i].m_slot = lookups[i].m_bucket->lock_shared();
+                    ++locked;
+                    lookups[i].m_node = lookups[i].m_bucket->end();
+                    lookups[i].m_stage = BatchLookup::FIRST;
+                    break;
+                }
+            }
+        }
+    }
+    return found_count;
+}
+
+/*
+ * Cached find
+ * Copies the mapped value of the key to value, returns false if there is
+ * no pair with the key. Every thread keeps the latest results in a small
+ * direct mapped cache, and a result stays valid until the bucket of its
+ * key changes, so repeated reads of an unchanged key neither lock the
+ * bucket nor write to any shared memory.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::cached_find(const key_type& key, mapped_type& value) const
+{
+    const std::size_t hash = m_hasher(key);
+    const bucket_type& bucket = m_buckets[hash % BUCKET_COUNT];
+    ReadCacheEntry& entry = read_cache()[(hash ^ (hash >> 16)) % READ_CACHE_SIZE];
+    if (entry.m_map == m_id &&
+        entry.m_version == bucket.version() &&
+        key_equal()(entry.m_key, key)) {
+        if (entry.m_found) {
+            value = entry.m_value;
+        }
+        return entry.m_found;
+    }
+    std::lock_guard<const bucket_type> lck(bucket);
+    const Node<value_type>* node = bucket.find_unlocked(key);
+    entry.m_map = m_id;
+    entry.m_version = bucket.version();
+    entry.m_found = node != bucket.end();
+    entry.m_key = key;
+    if (entry.m_found) {
+        entry.m_value = node->m_value.load().second;
+        value = entry.m_value;
+    }
+    return entry.m_found;
+}
+
+/*
+ * Consistent multi get
+ * Looks up count keys and for each key i sets found[i] and, if it is
+ * found, values[i], all as they were at one instant. Returns the number
+ * of found keys.
+ * Every key is first read with its bucket locked only for that read,
+ * noting the version of the bucket. If afterwards no bucket has a new
+ * version, nothing has changed between the reads and the values are
+ * consistent with each other. After MULTI_GET_ATTEMPTS failed attempts
+ * the buckets of all keys are locked together, in the order of their
+ * indices like transactions do, and the keys are read once more.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::multi_get(const key_type* keys,
+                                                     size_type count,
+                                                     mapped_type* values,
+                                                     bool* found) const
+{
+    std::vector<std::size_t> indices(count);
+    std::vector<std::uint64_t> versions(count);
+    for (size_type i = 0; i < count; ++i) {
+        indices[i] = m_hasher(keys[i]) % BUCKET_COUNT;
+    }
+    const auto read = [this, keys, values, found, &indices](size_type i) {
+        const Node<value_type>* node = m_buckets[indices[i]].find_unlocked(keys[i]);
+        found[i] = node != m_buckets[indices[i]].end();
+        if (found[i]) {
+            values[i] = node->m_value.load().second;
+        }
+        return found[i];
+    };
+    for (unsigned attempt = 0; attempt < MULTI_GET_ATTEMPTS; ++attempt) {
+        size_type found_count = 0;
+        for (size_type i = 0; i < count; ++i) {
+            std::lock_guard<const bucket_type> lck(m_buckets[indices[i]]);
+            versions[i] = m_buckets[indices[i]].version();
+            found_count += read(i);
+        }
+        bool consistent = true;
+        for (size_type i = 0; i < count && consistent; ++i) {
+            consistent = m_buckets[indices[i]].version() == versions[i];
+        }
+        if (consistent) {
+            return found_count;
+        }
+    }
+    std::vector<std::size_t> order(indices);
+    std::sort(order.begin(), order.end());
+    order.erase(std::unique(order.begin(), order.end()), order.end());
+    for (const std::size_t index : order) {
+        m_buckets[index].lock();
+    }
+    size_type found_count = 0;
+    for (size_type i = 0; i < count; ++i) {
+        found_count += read(i);
+    }
+    for (auto index = order.rbegin(); index != order.rend(); ++index) {
+        m_buckets[*index].unlock();
+    }
+    return found_count;
+}
+
+/*
+ * Returns the version of the bucket of the key, which changes whenever a
+ * pair of the bucket changes. It is the old_version to give to
+ * wait_for_change().
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::change_version(const key_type& key) const
+{
+    return m_buckets[m_hasher(key) % BUCKET_COUNT].version();
+}
+
+/*
+ * Wait for a change
+ * Blocks until the version of the bucket of the key differs from
+ * old_version or the timeout expires, and returns false in the latter
+ * case. The thread sleeps on a futex, which writers of the bucket only
+ * wake if somebody waits. The change may be one of another key of the
+ * same bucket, so the caller reads the key again and may wait once more
+ * with the new change_version().
+ */
+TEMPLATE_DECL
+template <typename RepT, typename PeriodT>
+bool CLASS_NAME::wait_for_change(const key_type& key,
+                                 std::uint64_t old_version,
+                                 const std::chrono::duration<RepT, PeriodT>& timeout) const
+{
+    const bucket_type& bucket = m_buckets[m_hasher(key) % BUCKET_COUNT];
+    const std::int64_t deadline = detail::steady_nanoseconds() +
+        std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count();
+    while (bucket.version() == old_version) {
+        if (detail::steady_nanoseconds() >= deadline) {
+            return false;
+        }
+        bucket.wait_for_change(old_version, deadline);
+    }
+    return true;
+}
+
+/*
+ * Watch
+ * Starts a thread which calls callback(const Pair<bool, mapped_type>&)
+ * with the presence and the mapped value of the key each time they
+ * differ from what they were at the previous call, or at the start for
+ * the first call. Mapped values are compared with operator==, or
+ * bytewise if mapped_type has none, in which case a type with padding
+ * may report a value equal to the previous one. The thread sleeps in
+ * wait_for_change() between the changes of the bucket.
+ * Every watch has a thread of its own, so watch() suits a few long lived
+ * watches; many keys are better waited for with wait_for_change() from
+ * the threads of the caller.
+ * The returned handle stops the thread; the callback must not stop its
+ * own watch.
+ */
+TEMPLATE_DECL
+template <typename CallbackT>
+typename CLASS_NAME::Watch CLASS_NAME::watch(const key_type& key, CallbackT callback) const
+{
+    const bucket_type* bucket = &m_buckets[m_hasher(key) % BUCKET_COUNT];
+    const auto read = [bucket, key](std::uint64_t& version) {
+        std::lock_guard<const bucket_type> lck(*bucket);
+        version = bucket->version();
+        const Node<value_type>* node = bucket->find_unlocked(key);
+        return node == bucket->end() ? Pair<bool, mapped_type>(false, mapped_type())
+                                     : Pair<bool, mapped_type>(true, node->m_value.load().second);
+    };
+    std::uint64_t version = 0;
+    const Pair<bool, mapped_type> initial = read(version);
+    Watch watch;
+    watch.m_state.reset(new typename Watch::State(bucket));
+    typename Watch::State* state = watch.m_state.get();
+    state->m_thread = std::thread([state, read, callback, version, initial]() mutable {
+        Pair<bool, mapped_type> last = initial;
+        while (!state->m_stop.load()) {
+            state->m_bucket->wait_for_change(version, INT64_MAX, &state->m_stop);
+            if (state->m_bucket->version() == version) {
+                continue;
+            }
+            const Pair<bool, mapped_type> current = read(version);
+            if (current.first != last.first ||
+                (current.first && !detail::values_equal(current.second, last.second))) {
+                last = current;
+                callback(current);
+            }
+        }
+    });
+    return watch;
+}
+
+TEMPLATE_DECL
+CLASS_NAME::Watch::Watch()
+    : m_state(nullptr)
+{}
+
+TEMPLATE_DECL
+CLASS_NAME::Watch::Watch(Watch&& that)
+    : m_state(std::move(that.m_state))
+{}
+
+TEMPLATE_DECL
+typename CLASS_NAME::Watch& CLASS_NAME::Watch::operator= (Watch&& that)
+{
+    if (&that != this) {
+        stop();
+        m_state = std::move(that.m_state);
+    }
+    return *this;
+}
+
+TEMPLATE_DECL
+CLASS_NAME::Watch::~Watch()
+{
+    stop();
+}
+
+/*
+ * Stops the thread of the watch and waits for it; no callback runs
+ * after the return
+ */
+TEMPLATE_DECL
+void CLASS_NAME::Watch::stop()
+{
+    if (m_state == nullptr) {
+        return;
+    }
+    m_state->m_stop.store(true);
+    m_state->m_bucket->wake_watchers();
+    m_state->m_thread.join();
+    m_state.reset();
+}
+
+/*
+ * Visit
+ * Calls fn(const value_type&) with the pair of the key where it is
+ * stored, without copying it, so a reader of a large pair can take just
+ * the fields it needs. The bucket is locked for reading during the call,
+ * so fn must be quick and must not call back into the map, and the
+ * reference must not be kept after fn returns.
+ * Returns false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+template <typename FnT>
+bool CLASS_NAME::visit(const key_type& key, FnT fn) const
+{
+    return m_buckets[m_hasher(key) % BUCKET_COUNT].visit(key, std::ref(fn));
+}
+
+/*
+ * Calls fn(const value_type&) with every pair where it is stored, each
+ * bucket being locked for reading while its pairs are visited. Pairs
+ * changed in other buckets during the walk may or may not be seen.
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::visit_all(FnT fn) const
+{
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        m_buckets[i].visit_all(std::ref(fn));
+    }
+}
+
 /*
  * Returns the number of objects in container
  */
@@ -438,6 +1466,170 @@ typename CLASS_NAME::const_iterator CLASS_NAME::end() const
     return const_iterator(m_buckets, BUCKET_COUNT, nullptr);
 }
 
+/*
+ * Allocates the buckets as the memory options say
+ */
+TEMPLATE_DECL
+void CLASS_NAME::init_buckets()
+{
+    if (m_memory.m_numa == MemoryOptions::NUMA_NONE && !m_memory.m_huge_pages) {
+        m_buckets = new bucket_type[BUCKET_COUNT];
+    } else {
+        // The policy is set before the buckets are constructed, as pages
+        // are placed when they are touched for the first time
+        const std::size_t page = detail::page_size();
+        std::size_t length = (BUCKET_COUNT * sizeof(bucket_type) + page - 1) / page * page;
+        char* memory = nullptr;
+        if (m_memory.m_huge_pages) {
+            length = detail::huge_page_length(length);
+            memory = static_cast<char*>(detail::allocate_huge_pages(length));
+        } else {
+            memory = static_cast<char*>(detail::allocate_pages(length, page));
+        }
+        const int node_count = detail::numa_node_count();
+        if (m_memory.m_numa == MemoryOptions::NUMA_INTERLEAVE) {
+            detail::bind_pages(memory, length, detail::MPOL_INTERLEAVE_POLICY, ~std::uint64_t(0) >> (64 - node_count));
+        } else if (m_memory.m_numa == MemoryOptions::NUMA_PARTITION) {
+            for (int node = 0; node < node_count; ++node) {
+                const std::size_t first = (BUCKET_COUNT * node + node_count - 1) / node_count;
+                const std::size_t last = (BUCKET_COUNT * (node + 1) + node_count - 1) / node_count;
+                const std::size_t begin = first * sizeof(bucket_type) / page * page;
+                const std::size_t end = node + 1 == node_count ? length : last * sizeof(bucket_type) / page * page;
+                if (begin < end) {
+                    detail::bind_pages(memory + begin, end - begin, detail::MPOL_PREFERRED_POLICY, std::uint64_t(1) << node);
+                }
+            }
+        }
+        m_buckets = reinterpret_cast<bucket_type*>(memory);
+        m_pool = new NodePool<Node<value_type> >(m_memory.m_huge_pages);
+        for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+            new (&m_buckets[i]) bucket_type();
+            const int numa_node = m_memory.m_numa == MemoryOptions::NUMA_PARTITION ?
+                static_cast<int>(i * node_count / BUCKET_COUNT) : -1;
+            m_buckets[i].set_pool(m_pool, numa_node);
+        }
+    }
+}
+
+/*
+ * Destroys the buckets and releases their memory
+ */
+TEMPLATE_DECL
+void CLASS_NAME::free_buckets()
+{
+    if (m_buckets != nullptr) {
+        if (m_pool == nullptr) {
+            delete[] m_buckets;
+        } else {
+            for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+                m_buckets[i].~bucket_type();
+            }
+            const std::size_t page = detail::page_size();
+            const std::size_t length = (BUCKET_COUNT * sizeof(bucket_type) + page - 1) / page * page;
+            if (m_memory.m_huge_pages) {
+                detail::free_huge_pages(m_buckets, length);
+            } else {
+                detail::free_pages(m_buckets, length);
+            }
+        }
+    }
+    m_buckets = nullptr;
+    delete m_pool;
+    m_pool = nullptr;
+}
+
+/*
+ * Returns an id which no other map of this type has had, so the read
+ * caches never take an entry of a destroyed map for one of a new map
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::next_map_id()
+{
+    static std::atomic<std::uint64_t> last_id(0);
+    return ++last_id;
+}
+
+/*
+ * Returns the read cache of the calling thread, shared by all maps of
+ * this type
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::ReadCacheEntry* CLASS_NAME::read_cache()
+{
+    thread_local ReadCacheEntry cache[READ_CACHE_SIZE] = {};
+    return cache;
+}
+
+/*
+ * Points every bucket to the listeners: to none, to the only one, or to a
+ * fanout of them all. The old fanout is freed once every bucket has been
+ * switched, as buckets call their listener only while they are locked.
+ * m_mutex must be held.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::apply_listeners()
+{
+    std::unique_ptr<MutationFanout<value_type> > fanout;
+    MutationListener<value_type>* listener = nullptr;
+    if (m_listeners.size() == 1) {
+        listener = m_listeners.front();
+    } else if (m_listeners.size() > 1) {
+        fanout.reset(new MutationFanout<value_type>(m_listeners));
+        listener = fanout.get();
+    }
+    if (m_buckets != nullptr) {
+        for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+            m_buckets[i].set_listener(listener);
+        }
+    }
+    m_fanout = std::move(fanout);
+}
+
+/*
+ * Reports every pair to the listeners as inserted or as erased, for the
+ * pairs which join or leave the map by a move. m_mutex must be held.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::report_pairs(bool inserted) const
+{
+    if (m_buckets == nullptr || m_listeners.empty()) {
+        return;
+    }
+    MutationListener<value_type>* listener =
+        m_fanout != nullptr ? m_fanout.get() : m_listeners.front();
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        m_buckets[i].for_each([listener, inserted](const value_type& value) {
+            if (inserted) {
+                listener->on_insert(value);
+            } else {
+                listener->on_erase(value);
+            }
+        });
+    }
+}
+
+/*
+ * Returns the owner of the bucket in partitioned mode
+ */
+TEMPLATE_DECL
+std::size_t CLASS_NAME::partition_of(std::size_t bucket_index) const
+{
+    return bucket_index * partitions().partition_count() / BUCKET_COUNT;
+}
+
+/*
+ * Returns the executor of partitioned mode.
+ * Throws std::logic_error if the partitions are not started.
+ */
+TEMPLATE_DECL
+PartitionExecutor& CLASS_NAME::partitions() const
+{
+    if (m_partitions == nullptr) {
+        throw std::logic_error("HashMap partitions are not started");
+    }
+    return *m_partitions;
+}
+
 #undef TEMPLATE_DECL
 #undef CLASS_NAME
 
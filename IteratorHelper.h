@@ -28,9 +28,9 @@ public:
                             Node<ValueT>* node)
         : m_buckets(buckets)
         , m_index(index)
-        , m_ref(node)
+        , m_ref(index < BUCKET_COUNT ? &buckets[index] : nullptr, node)
     {
-        if (m_buckets[m_index].end() == node) {
+        if (m_index < BUCKET_COUNT && m_buckets[m_index].end() == node) {
             m_index = BUCKET_COUNT;
         }
     }
@@ -67,13 +67,13 @@ public:
 
     IteratorHelper& operator++ ()
     {
-        m_ref = ReferenceT(m_ref.m_node->m_next);
+        m_ref = ReferenceT(m_ref.m_bucket, m_ref.m_node->m_next);
         if (m_ref.m_node == m_buckets[m_index].end()) {
             do {
                 ++m_index;
             } while (m_index != BUCKET_COUNT && m_buckets[m_index].empty());
             if (m_index != BUCKET_COUNT) {
-                m_ref = ReferenceT(m_buckets[m_index].begin());
+                m_ref = ReferenceT(&m_buckets[m_index], m_buckets[m_index].begin());
             }
         }
         return *this;
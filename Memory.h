@@ -0,0 +1,594 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace thread_safe {
+
+/*
+ * Describes where a HashMap places its bucket array and its nodes.
+ * NUMA_INTERLEAVE spreads the pages of the bucket array over all NUMA
+ * nodes and allocates every node on the NUMA node of the inserting
+ * thread. NUMA_PARTITION gives every NUMA node a contiguous range of
+ * buckets and allocates the nodes of a bucket on the NUMA node of its
+ * range, which pays off when threads working on a range are pinned to
+ * its socket.
+ * With huge pages the bucket array and the node chunks are backed by
+ * 2 MB pages, so a large map needs far fewer TLB entries. Reserved huge
+ * pages are used if there are any, transparent huge pages otherwise.
+ */
+struct MemoryOptions
+{
+    enum Numa
+    {
+        NUMA_NONE,
+        NUMA_INTERLEAVE,
+        NUMA_PARTITION
+    };
+
+    MemoryOptions(Numa numa = NUMA_NONE, bool huge_pages = false)
+        : m_numa(numa)
+        , m_huge_pages(huge_pages)
+    {}
+
+    Numa m_numa;
+    bool m_huge_pages;
+};
+
+namespace detail {
+
+// From <linux/mempolicy.h>, which is not needed for anything else
+const int MPOL_PREFERRED_POLICY = 1;
+const int MPOL_INTERLEAVE_POLICY = 3;
+
+/*
+ * Parses a list like "0-3,8,10-11" as found in /sys/devices/system
+ */
+inline std::vector<int> parse_id_list(const std::string& list)
+{
+    std::vector<int> ids;
+    std::stringstream stream(list);
+    std::string range;
+    while (std::getline(stream, range, ',')) {
+        if (range.empty() || range == "\n") {
+            continue;
+        }
+        const std::size_t dash = range.find('-');
+        const int first = std::stoi(range.substr(0, dash));
+        const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int id = first; id <= last; ++id) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+inline std::vector<int> read_id_list(const std::string& path)
+{
+    std::ifstream file(path);
+    std::string list;
+    if (!std::getline(file, list)) {
+        return std::vector<int>();
+    }
+    return parse_id_list(list);
+}
+
+/*
+ * Returns the number of NUMA nodes of the machine, 1 if it is not a
+ * NUMA machine or the information is not available
+ */
+inline int numa_node_count()
+{
+    static const int count = []() {
+        const std::vector<int> nodes = read_id_list("/sys/devices/system/node/online");
+        int max = 0;
+        for (const int node : nodes) {
+            max = node > max ? node : max;
+        }
+        return max + 1;
+    }();
+    return count;
+}
+
+/*
+ * Returns the CPUs of a NUMA node
+ */
+inline std::vector<int> numa_node_cpus(int node)
+{
+    return read_id_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+}
+
+/*
+ * Returns the NUMA node of the CPU the calling thread runs on. It is
+ * called on every allocation, so it does not enter the kernel: with one
+ * node there is nothing to ask, otherwise the CPU comes from
+ * sched_getcpu(), which the vDSO answers, and its node from a table
+ * read once from sysfs.
+ */
+inline int current_numa_node()
+{
+    if (numa_node_count() == 1) {
+        return 0;
+    }
+    static const std::vector<int> cpu_nodes = []() {
+        std::vector<int> table;
+        for (int node = 0; node < numa_node_count(); ++node) {
+            for (const int cpu : numa_node_cpus(node)) {
+                if (static_cast<std::size_t>(cpu) >= table.size()) {
+                    table.resize(cpu + 1, 0);
+                }
+                table[cpu] = node;
+            }
+        }
+        return table;
+    }();
+    const int cpu = ::sched_getcpu();
+    return cpu >= 0 && static_cast<std::size_t>(cpu) < cpu_nodes.size() ? cpu_nodes[cpu] : 0;
+}
+
+/*
+ * Sets the NUMA policy of a page aligned range. It is only a hint: on
+ * kernels or in containers which do not allow it the pages are placed
+ * as usual.
+ */
+inline void bind_pages(void* address, std::size_t length, int policy, std::uint64_t node_mask)
+{
+    if (numa_node_count() > 1) {
+        ::syscall(SYS_mbind, address, length, policy, &node_mask, 64, 0);
+    }
+}
+
+inline std::size_t page_size()
+{
+    static const std::size_t size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+/*
+ * Maps anonymous memory aligned to the given power of two.
+ * Throws std::bad_alloc on failure.
+ */
+inline void* allocate_pages(std::size_t length, std::size_t alignment)
+{
+    const std::size_t mapped = length + alignment;
+    void* memory = ::mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(memory);
+    const std::uintptr_t aligned = (begin + alignment - 1) & ~(alignment - 1);
+    if (aligned != begin) {
+        ::munmap(memory, aligned - begin);
+    }
+    const std::uintptr_t tail = begin + mapped - (aligned + length);
+    if (tail != 0) {
+        ::munmap(reinterpret_cast<void*>(aligned + length), tail);
+    }
+    return reinterpret_cast<void*>(aligned);
+}
+
+inline void free_pages(void* memory, std::size_t length)
+{
+    ::munmap(memory, length);
+}
+
+const std::size_t HUGE_PAGE_SIZE = std::size_t(2) << 20;
+
+/*
+ * Rounds a length up to a whole number of huge pages
+ */
+inline std::size_t huge_page_length(std::size_t length)
+{
+    return (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+/*
+ * Maps anonymous memory backed by huge pages and aligned to a huge page.
+ * Reserved huge pages are taken if the pool has enough of them;
+ * otherwise the range is mapped with normal pages and the kernel is
+ * asked to back it with transparent huge pages, which it does if they
+ * are enabled and it finds contiguous memory. Release it with
+ * free_huge_pages. Throws std::bad_alloc on failure.
+ */
+inline void* allocate_huge_pages(std::size_t length)
+{
+    length = huge_page_length(length);
+    void* memory = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+        return memory;
+    }
+    memory = allocate_pages(length, HUGE_PAGE_SIZE);
+    ::madvise(memory, length, MADV_HUGEPAGE);
+    return memory;
+}
+
+inline void free_huge_pages(void* memory, std::size_t length)
+{
+    ::munmap(memory, huge_page_length(length));
+}
+
+/*
+ * Constructs count objects from the arguments in memory aligned to
+ * alignof(T), which operator new of C++14 does not honour beyond the
+ * alignment of std::max_align_t. Release them with AlignedDelete.
+ */
+template <typename T, typename... ArgsT>
+T* aligned_new(std::size_t count, const ArgsT&... args)
+{
+    const std::size_t alignment = alignof(T) < sizeof(void*) ? sizeof(void*) : alignof(T);
+    void* memory = nullptr;
+    if (::posix_memalign(&memory, alignment, sizeof(T) * count) != 0) {
+        throw std::bad_alloc();
+    }
+    T* objects = static_cast<T*>(memory);
+    std::size_t constructed = 0;
+    try {
+        for (; constructed < count; ++constructed) {
+            new (objects + constructed) T(args...);
+        }
+    } catch (...) {
+        while (constructed > 0) {
+            objects[--constructed].~T();
+        }
+        std::free(memory);
+        throw;
+    }
+    return objects;
+}
+
+/*
+ * The deleter of std::unique_ptr for the objects of aligned_new
+ */
+template <typename T>
+class AlignedDelete
+{
+public:
+    explicit AlignedDelete(std::size_t count = 1)
+        : m_count(count)
+    {}
+
+    void operator() (T* objects) const
+    {
+        for (std::size_t i = 0; i < m_count; ++i) {
+            objects[i].~T();
+        }
+        std::free(objects);
+    }
+
+private:
+    std::size_t m_count;
+};
+
+} // namespace detail
+
+/*
+ * Allocates objects of type T from chunks placed on a given NUMA node.
+ * Every chunk is aligned to its size and starts with the NUMA node it
+ * belongs to, so a freed object goes back to the free list of its node.
+ */
+template <typename T>
+class NodePool
+{
+public:
+    static const std::size_t CHUNK_SIZE = std::size_t(2) << 20;
+
+public:
+    explicit NodePool(bool huge_pages = false);
+    NodePool(const NodePool&) = delete;
+    NodePool& operator= (const NodePool&) = delete;
+    ~NodePool();
+
+    void* allocate(int numa_node = -1);
+    void deallocate(void* object);
+
+private:
+    struct ChunkHeader
+    {
+        int m_numa_node;
+    };
+
+    struct FreeObject
+    {
+        FreeObject* m_next;
+    };
+
+    /*
+     * A cache line of its own, the arenas are allocated with aligned_new
+     */
+    struct alignas(64) Arena
+    {
+        Arena()
+            : m_free(nullptr)
+            , m_top(nullptr)
+            , m_end(nullptr)
+        {}
+
+        std::mutex m_mutex;
+        FreeObject* m_free;
+        char* m_top;
+        char* m_end;
+        std::vector<void*> m_chunks;
+    };
+
+    static std::size_t stride();
+
+private:
+    std::size_t m_arena_count;
+    std::unique_ptr<Arena[], detail::AlignedDelete<Arena> > m_arenas;
+    bool m_huge_pages;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename T>
+#define CLASS_NAME NodePool<T>
+
+/*
+ * Constructor
+ * With huge pages every chunk is a single 2 MB page
+ */
+TEMPLATE_DECL
+CLASS_NAME::NodePool(bool huge_pages)
+    : m_arena_count(detail::numa_node_count())
+    , m_arenas(detail::aligned_new<Arena>(m_arena_count), detail::AlignedDelete<Arena>(m_arena_count))
+    , m_huge_pages(huge_pages)
+{}
+
+/*
+ * Destructor
+ * Releases all chunks; the objects must already be destroyed
+ */
+TEMPLATE_DECL
+CLASS_NAME::~NodePool()
+{
+    for (std::size_t i = 0; i < m_arena_count; ++i) {
+        for (void* chunk : m_arenas[i].m_chunks) {
+            if (m_huge_pages) {
+                detail::free_huge_pages(chunk, CHUNK_SIZE);
+            } else {
+                detail::free_pages(chunk, CHUNK_SIZE);
+            }
+        }
+    }
+}
+
+/*
+ * Returns memory for an object on the given NUMA node, or on the node
+ * of the calling thread if -1 is given
+ */
+TEMPLATE_DECL
+void* CLASS_NAME::allocate(int numa_node)
+{
+    if (numa_node < 0) {
+        numa_node = detail::current_numa_node();
+    }
+    numa_node %= static_cast<int>(m_arena_count);
+    Arena& arena = m_arenas[numa_node];
+    std::lock_guard<std::mutex> lck(arena.m_mutex);
+    if (arena.m_free != nullptr) {
+        FreeObject* object = arena.m_free;
+        arena.m_free = object->m_next;
+        return object;
+    }
+    if (arena.m_top == arena.m_end) {
+        char* chunk = static_cast<char*>(m_huge_pages ? detail::allocate_huge_pages(CHUNK_SIZE)
+                                                      : detail::allocate_pages(CHUNK_SIZE, CHUNK_SIZE));
+        detail::bind_pages(chunk, CHUNK_SIZE, detail::MPOL_PREFERRED_POLICY, std::uint64_t(1) << numa_node);
+        arena.m_chunks.push_back(chunk);
+        reinterpret_cast<ChunkHeader*>(chunk)->m_numa_node = numa_node;
+        arena.m_top = chunk + stride();
+        arena.m_end = chunk + CHUNK_SIZE / stride() * stride();
+    }
+    void* object = arena.m_top;
+    arena.m_top += stride();
+    return object;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::deallocate(void* object)
+{
+    const std::uintptr_t chunk = reinterpret_cast<std::uintptr_t>(object) & ~(CHUNK_SIZE - 1);
+    Arena& arena = m_arenas[reinterpret_cast<ChunkHeader*>(chunk)->m_numa_node];
+    std::lock_guard<std::mutex> lck(arena.m_mutex);
+    FreeObject* free_object = static_cast<FreeObject*>(object);
+    free_object->m_next = arena.m_free;
+    arena.m_free = free_object;
+}
+
+/*
+ * Distance between two neighbouring objects of a chunk, which is also
+ * the space reserved for the chunk header
+ */
+TEMPLATE_DECL
+std::size_t CLASS_NAME::stride()
+{
+    std::size_t size = sizeof(T) > sizeof(ChunkHeader) ? sizeof(T) : sizeof(ChunkHeader);
+    size = size > sizeof(FreeObject) ? size : sizeof(FreeObject);
+    const std::size_t align = alignof(T) > alignof(FreeObject) ? alignof(T) : alignof(FreeObject);
+    return (size + align - 1) / align * align;
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+/*
+ * Objects of type T addressed by 32 bit indices instead of pointers.
+ * The objects live in chunks of CHUNK_SIZE objects which are mapped when
+ * the first of their objects is allocated and never move, so an index
+ * stays valid until it is freed. Objects are packed without any header;
+ * a free object holds the index of the next free one.
+ * The free objects form a lock-free stack whose head is an index tagged
+ * with a counter bumped by every push, so a pop which read a head that
+ * was popped and pushed again meanwhile fails instead of installing a
+ * stale link. Chunks stay mapped, so reading the link of an object just
+ * taken by another thread is harmless.
+ */
+template <typename T>
+class NodeArena
+{
+    static_assert(sizeof(T) >= sizeof(std::uint32_t) && alignof(T) >= alignof(std::atomic<std::uint32_t>),
+                  "NodeArena objects hold the free list links");
+
+public:
+    typedef std::uint32_t index_type;
+
+    static const index_type NIL = 0xffffffffu;
+    static const std::size_t CHUNK_BITS = 20;
+    static const std::size_t CHUNK_SIZE = std::size_t(1) << CHUNK_BITS;
+    static const std::size_t MAX_CHUNKS = (std::size_t(1) << 32) >> CHUNK_BITS;
+
+public:
+    explicit NodeArena(bool huge_pages = false);
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator= (const NodeArena&) = delete;
+    ~NodeArena();
+
+    index_type allocate();
+    void deallocate(index_type index);
+    T* at(index_type index) const;
+
+private:
+    T* allocate_chunk() const;
+    void free_chunk(T* chunk) const;
+    std::atomic<index_type>* link(index_type index) const;
+    static std::size_t chunk_bytes();
+
+private:
+    std::unique_ptr<std::atomic<T*>[]> m_chunks;
+    std::atomic<std::uint64_t> m_top;
+    // The tag in the upper half, the index of the first free object in the lower
+    std::atomic<std::uint64_t> m_free;
+    bool m_huge_pages;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename T>
+#define CLASS_NAME NodeArena<T>
+
+TEMPLATE_DECL
+CLASS_NAME::NodeArena(bool huge_pages)
+    : m_chunks(new std::atomic<T*>[MAX_CHUNKS]())
+    , m_top(0)
+    , m_free(NIL)
+    , m_huge_pages(huge_pages)
+{}
+
+/*
+ * Destructor
+ * Releases all chunks; the objects must already be destroyed
+ */
+TEMPLATE_DECL
+CLASS_NAME::~NodeArena()
+{
+    for (std::size_t i = 0; i < MAX_CHUNKS; ++i) {
+        T* chunk = m_chunks[i].load();
+        if (chunk != nullptr) {
+            free_chunk(chunk);
+        }
+    }
+}
+
+/*
+ * Returns the index of memory for a new object.
+ * Throws std::length_error when all indices are used.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::index_type CLASS_NAME::allocate()
+{
+    std::uint64_t head = m_free.load(std::memory_order_acquire);
+    while (static_cast<index_type>(head) != NIL) {
+        const index_type index = static_cast<index_type>(head);
+        const std::uint64_t next = (head & ~std::uint64_t(NIL)) | link(index)->load(std::memory_order_relaxed);
+        if (m_free.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+            return index;
+        }
+    }
+    const std::uint64_t top = m_top.fetch_add(1, std::memory_order_relaxed);
+    if (top >= NIL) {
+        throw std::length_error("NodeArena is full");
+    }
+    std::atomic<T*>& chunk = m_chunks[top >> CHUNK_BITS];
+    if (chunk.load(std::memory_order_acquire) == nullptr) {
+        T* created = allocate_chunk();
+        T* expected = nullptr;
+        if (!chunk.compare_exchange_strong(expected, created, std::memory_order_acq_rel)) {
+            free_chunk(created);
+        }
+    }
+    return static_cast<index_type>(top);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::deallocate(index_type index)
+{
+    std::atomic<index_type>* next = link(index);
+    std::uint64_t head = m_free.load(std::memory_order_relaxed);
+    std::uint64_t pushed = 0;
+    do {
+        next->store(static_cast<index_type>(head), std::memory_order_relaxed);
+        pushed = ((head >> 32) + 1) << 32 | index;
+    } while (!m_free.compare_exchange_weak(head, pushed, std::memory_order_release, std::memory_order_relaxed));
+}
+
+TEMPLATE_DECL
+T* CLASS_NAME::at(index_type index) const
+{
+    return m_chunks[index >> CHUNK_BITS].load(std::memory_order_acquire) + (index & (CHUNK_SIZE - 1));
+}
+
+TEMPLATE_DECL
+T* CLASS_NAME::allocate_chunk() const
+{
+    if (m_huge_pages) {
+        return static_cast<T*>(detail::allocate_huge_pages(chunk_bytes()));
+    }
+    return static_cast<T*>(detail::allocate_pages(chunk_bytes(), detail::page_size()));
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::free_chunk(T* chunk) const
+{
+    if (m_huge_pages) {
+        detail::free_huge_pages(chunk, chunk_bytes());
+    } else {
+        detail::free_pages(chunk, chunk_bytes());
+    }
+}
+
+/*
+ * The link to the next free object, kept in the first bytes of a free one
+ */
+TEMPLATE_DECL
+std::atomic<typename CLASS_NAME::index_type>* CLASS_NAME::link(index_type index) const
+{
+    return reinterpret_cast<std::atomic<index_type>*>(at(index));
+}
+
+TEMPLATE_DECL
+std::size_t CLASS_NAME::chunk_bytes()
+{
+    const std::size_t page = detail::page_size();
+    return (CHUNK_SIZE * sizeof(T) + page - 1) / page * page;
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -0,0 +1,450 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "Bucket.h"
+
+namespace thread_safe {
+
+/*
+ * An ordered index of the keys of a HashMap, for range scans, lower_bound
+ * and ordered iteration, while point lookups still go through the hash.
+ * The index is a skip list of keys kept up to date as the MutationListener
+ * of the map, so it sees every insert and erase while the bucket of the
+ * key is locked; two changes of one key therefore never race in the
+ * index. Keys are copied into the index rather than referring to the
+ * nodes of the map, which may go away at any time; the mapped values are
+ * read from the map.
+ * Inserts link a new skip list node with compare and swap, and readers
+ * walk the list without any lock. An erase only marks the node of the key
+ * as absent, and a later insert of the same key reuses it. purge()
+ * unlinks the absent nodes and frees them once the readers which may be
+ * on them are gone. It may run at any time: the listener callbacks share
+ * a lock which purge() takes exclusively while it unlinks, and readers
+ * announce themselves in one of two counters, which purge() swaps and
+ * then waits to drain.
+ * Like every listener the index must outlive the map, or be detached from
+ * it first.
+ */
+template <typename KeyT, typename MappedT, typename CompareT = std::less<KeyT> >
+class OrderedIndex : public MutationListener<Pair<const KeyT, MappedT> >
+{
+public:
+    typedef KeyT key_type;
+    typedef Pair<const KeyT, MappedT> value_type;
+    typedef std::size_t size_type;
+    typedef CompareT key_compare;
+
+    static const int MAX_LEVEL = 16;
+
+public:
+    explicit OrderedIndex(const key_compare& compare = key_compare());
+    OrderedIndex(const OrderedIndex&) = delete;
+    OrderedIndex& operator= (const OrderedIndex&) = delete;
+    ~OrderedIndex();
+
+    template <typename MapT>
+    void attach(MapT& map);
+    template <typename MapT>
+    void detach(MapT& map);
+
+    void on_insert(const value_type& value) override;
+    void on_assign(const value_type& value) override;
+    void on_erase(const value_type& value) override;
+
+    template <typename FnT>
+    void range(const key_type& from, const key_type& to, FnT fn) const;
+    template <typename FnT>
+    void for_each(FnT fn) const;
+    bool lower_bound(const key_type& key, key_type& result) const;
+    size_type size() const;
+    bool empty() const;
+
+    void purge();
+
+private:
+    struct SkipNode
+    {
+        SkipNode(const key_type& key, int level)
+            : m_key(key)
+            , m_present(true)
+            , m_level(level)
+            , m_next(new std::atomic<SkipNode*>[level])
+        {
+            for (int i = 0; i < level; ++i) {
+                m_next[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~SkipNode()
+        {
+            delete[] m_next;
+        }
+
+        const key_type m_key;
+        std::atomic<bool> m_present;
+        const int m_level;
+        std::atomic<SkipNode*>* m_next;
+    };
+
+    typedef std::atomic<SkipNode*> link_type;
+
+    /*
+     * Counts a reader of the index in the counter of the current epoch
+     * while it walks the index
+     */
+    class ReadGuard
+    {
+    public:
+        explicit ReadGuard(const OrderedIndex& index);
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator= (const ReadGuard&) = delete;
+        ~ReadGuard();
+
+    private:
+        const OrderedIndex& m_index;
+        std::size_t m_counter;
+    };
+
+    void insert(const key_type& key);
+    void find_links(const key_type& key, link_type** links, SkipNode** successors) const;
+    const SkipNode* first_not_less(const key_type& key) const;
+    static int random_level();
+
+private:
+    link_type m_head[MAX_LEVEL];
+    std::atomic<size_type> m_size;
+    key_compare m_less;
+    // Shared by the listener callbacks, exclusive while purge() unlinks
+    std::shared_timed_mutex m_writers_mutex;
+    std::mutex m_purge_mutex;
+    mutable std::atomic<std::uint64_t> m_epoch;
+    mutable std::atomic<std::size_t> m_readers[2];
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT, typename MappedT, typename CompareT>
+#define CLASS_NAME OrderedIndex<KeyT, MappedT, CompareT>
+
+TEMPLATE_DECL
+const int CLASS_NAME::MAX_LEVEL;
+
+TEMPLATE_DECL
+CLASS_NAME::OrderedIndex(const key_compare& compare)
+    : m_size(0)
+    , m_less(compare)
+    , m_epoch(0)
+{
+    for (int i = 0; i < MAX_LEVEL; ++i) {
+        m_head[i].store(nullptr, std::memory_order_relaxed);
+    }
+    m_readers[0].store(0, std::memory_order_relaxed);
+    m_readers[1].store(0, std::memory_order_relaxed);
+}
+
+TEMPLATE_DECL
+CLASS_NAME::~OrderedIndex()
+{
+    SkipNode* node = m_head[0].load(std::memory_order_relaxed);
+    while (node != nullptr) {
+        SkipNode* next = node->m_next[0].load(std::memory_order_relaxed);
+        delete node;
+        node = next;
+    }
+}
+
+/*
+ * Adds the index to the mutation listeners of the map, next to any others
+ * such as a ChangeLog, and adds the keys the map already holds. The
+ * listener is added first, so a pair inserted or erased meanwhile is
+ * reported either way and no key is missed.
+ */
+TEMPLATE_DECL
+template <typename MapT>
+void CLASS_NAME::attach(MapT& map)
+{
+    map.add_mutation_listener(this);
+    map.visit_all([this](const value_type& value) {
+        insert(value.first);
+    });
+}
+
+/*
+ * Stops the map reporting its changes to the index, after which the index
+ * no longer follows the map. The other listeners of the map go on.
+ */
+TEMPLATE_DECL
+template <typename MapT>
+void CLASS_NAME::detach(MapT& map)
+{
+    map.remove_mutation_listener(this);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::on_insert(const value_type& value)
+{
+    insert(value.first);
+}
+
+/*
+ * An assignment does not change the key
+ */
+TEMPLATE_DECL
+void CLASS_NAME::on_assign(const value_type&)
+{}
+
+/*
+ * Marks the node of the key as absent. It stays linked for the readers
+ * which may be on it.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::on_erase(const value_type& value)
+{
+    std::shared_lock<std::shared_timed_mutex> lck(m_writers_mutex);
+    const SkipNode* node = first_not_less(value.first);
+    if (node != nullptr && !m_less(value.first, node->m_key) &&
+        const_cast<SkipNode*>(node)->m_present.exchange(false)) {
+        m_size.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+/*
+ * Calls fn(const key_type&) with every key in [from, to) in ascending
+ * order. Keys inserted or erased during the scan may or may not be seen,
+ * every other key is seen exactly once.
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::range(const key_type& from, const key_type& to, FnT fn) const
+{
+    const ReadGuard guard(*this);
+    for (const SkipNode* node = first_not_less(from);
+         node != nullptr && m_less(node->m_key, to);
+         node = node->m_next[0].load(std::memory_order_acquire)) {
+        if (node->m_present.load(std::memory_order_acquire)) {
+            fn(node->m_key);
+        }
+    }
+}
+
+/*
+ * Calls fn(const key_type&) with every key in ascending order
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::for_each(FnT fn) const
+{
+    const ReadGuard guard(*this);
+    for (const SkipNode* node = m_head[0].load(std::memory_order_acquire);
+         node != nullptr;
+         node = node->m_next[0].load(std::memory_order_acquire)) {
+        if (node->m_present.load(std::memory_order_acquire)) {
+            fn(node->m_key);
+        }
+    }
+}
+
+/*
+ * Copies the first key which is not less than key to result.
+ * Returns false if there is none.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::lower_bound(const key_type& key, key_type& result) const
+{
+    const ReadGuard guard(*this);
+    for (const SkipNode* node = first_not_less(key);
+         node != nullptr;
+         node = node->m_next[0].load(std::memory_order_acquire)) {
+        if (node->m_present.load(std::memory_order_acquire)) {
+            result = node->m_key;
+            return true;
+        }
+    }
+    return false;
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::size() const
+{
+    return m_size.load(std::memory_order_relaxed);
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return size() == 0;
+}
+
+/*
+ * Unlinks and frees the nodes of erased keys while the index is in use.
+ * Changes of the map wait while the nodes are unlinked; the readers do
+ * not, and the nodes are freed after the readers which started before
+ * are done. Must not be called from a function given to a reader.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::purge()
+{
+    std::lock_guard<std::mutex> purge_lck(m_purge_mutex);
+    std::vector<SkipNode*> unlinked;
+    {
+        std::lock_guard<std::shared_timed_mutex> lck(m_writers_mutex);
+        for (int level = MAX_LEVEL - 1; level >= 0; --level) {
+            link_type* link = &m_head[level];
+            SkipNode* node = nullptr;
+            while ((node = link->load(std::memory_order_relaxed)) != nullptr) {
+                if (node->m_present.load(std::memory_order_relaxed)) {
+                    link = &node->m_next[level];
+                    continue;
+                }
+                // A reader on the node still finds its way on from it
+                link->store(node->m_next[level].load(std::memory_order_relaxed), std::memory_order_release);
+                if (level == 0) {
+                    unlinked.push_back(node);
+                }
+            }
+        }
+    }
+    // Readers counted after the swap start from the links as they are now
+    const std::uint64_t epoch = m_epoch.fetch_add(1);
+    while (m_readers[epoch % 2].load() != 0) {
+        std::this_thread::yield();
+    }
+    for (SkipNode* node : unlinked) {
+        delete node;
+    }
+}
+
+/*
+ * Links a node with the key, or marks the node already there as present.
+ * The node is linked at the bottom level first, which makes it part of
+ * the index, and then at the levels above, which only speed up searches.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::insert(const key_type& key)
+{
+    std::shared_lock<std::shared_timed_mutex> lck(m_writers_mutex);
+    link_type* links[MAX_LEVEL];
+    SkipNode* successors[MAX_LEVEL];
+    SkipNode* node = nullptr;
+    for (;;) {
+        find_links(key, links, successors);
+        if (successors[0] != nullptr && !m_less(key, successors[0]->m_key)) {
+            delete node;
+            if (!successors[0]->m_present.exchange(true)) {
+                m_size.fetch_add(1, std::memory_order_relaxed);
+            }
+            return;
+        }
+        if (node == nullptr) {
+            node = new SkipNode(key, random_level());
+        }
+        for (int level = 0; level < node->m_level; ++level) {
+            node->m_next[level].store(successors[level], std::memory_order_relaxed);
+        }
+        if (links[0]->compare_exchange_strong(successors[0], node, std::memory_order_release)) {
+            break;
+        }
+    }
+    m_size.fetch_add(1, std::memory_order_relaxed);
+    for (int level = 1; level < node->m_level; ++level) {
+        while (!links[level]->compare_exchange_strong(successors[level], node, std::memory_order_release)) {
+            // Another key was linked next to this one meanwhile
+            find_links(key, links, successors);
+            node->m_next[level].store(successors[level], std::memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Fills links with the link at every level which points to the first node
+ * not less than the key, and successors with that node
+ */
+TEMPLATE_DECL
+void CLASS_NAME::find_links(const key_type& key, link_type** links, SkipNode** successors) const
+{
+    // The last node less than the key, nullptr standing for the head
+    SkipNode* predecessor = nullptr;
+    for (int level = MAX_LEVEL - 1; level >= 0; --level) {
+        link_type* link = predecessor == nullptr ? const_cast<link_type*>(&m_head[level])
+                                                 : &predecessor->m_next[level];
+        SkipNode* node = nullptr;
+        while ((node = link->load(std::memory_order_acquire)) != nullptr && m_less(node->m_key, key)) {
+            predecessor = node;
+            link = &node->m_next[level];
+        }
+        links[level] = link;
+        successors[level] = node;
+    }
+}
+
+/*
+ * Returns the first node, present or not, which is not less than the key
+ */
+TEMPLATE_DECL
+const typename CLASS_NAME::SkipNode* CLASS_NAME::first_not_less(const key_type& key) const
+{
+    link_type* links[MAX_LEVEL];
+    SkipNode* successors[MAX_LEVEL];
+    find_links(key, links, successors);
+    return successors[0];
+}
+
+/*
+ * Counts the reader for the epoch it has read. If purge() has swapped
+ * the counters meanwhile, the reader counts itself again, so purge()
+ * does not miss it.
+ */
+TEMPLATE_DECL
+CLASS_NAME::ReadGuard::ReadGuard(const OrderedIndex& index)
+    : m_index(index)
+    , m_counter(0)
+{
+    for (;;) {
+        const std::uint64_t epoch = m_index.m_epoch.load();
+        m_counter = epoch % 2;
+        m_index.m_readers[m_counter].fetch_add(1);
+        if (m_index.m_epoch.load() == epoch) {
+            return;
+        }
+        m_index.m_readers[m_counter].fetch_sub(1);
+    }
+}
+
+TEMPLATE_DECL
+CLASS_NAME::ReadGuard::~ReadGuard()
+{
+    m_index.m_readers[m_counter].fetch_sub(1);
+}
+
+/*
+ * Returns the level of a new node, which is l with probability 4^-l
+ */
+TEMPLATE_DECL
+int CLASS_NAME::random_level()
+{
+    static thread_local std::uint64_t state = 0x9e3779b97f4a7c15ull ^
+        reinterpret_cast<std::uintptr_t>(&state);
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    int level = 1;
+    std::uint64_t bits = state;
+    while (level < MAX_LEVEL && (bits & 3) == 0) {
+        ++level;
+        bits >>= 2;
+    }
+    return level;
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -0,0 +1,474 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Bucket.h"
+
+namespace thread_safe {
+
+namespace detail {
+
+/*
+ * A bounded queue which any number of threads may push to and pop from
+ * without locks. Every cell carries a sequence number telling whether it
+ * is free for the push or the pop of the current lap.
+ * The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class MpmcQueue
+{
+public:
+    explicit MpmcQueue(std::size_t capacity);
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator= (const MpmcQueue&) = delete;
+
+    bool try_push(T& value);
+    bool try_pop(T& value);
+    bool empty() const;
+
+private:
+    struct Cell
+    {
+        std::atomic<std::size_t> m_sequence;
+        T m_value;
+    };
+
+private:
+    std::unique_ptr<Cell[]> m_cells;
+    std::size_t m_mask;
+    alignas(64) std::atomic<std::size_t> m_push;
+    alignas(64) std::atomic<std::size_t> m_pop;
+};
+
+template <typename T>
+MpmcQueue<T>::MpmcQueue(std::size_t capacity)
+    : m_cells(nullptr)
+    , m_mask(0)
+    , m_push(0)
+    , m_pop(0)
+{
+    std::size_t size = 2;
+    while (size < capacity) {
+        size *= 2;
+    }
+    m_cells.reset(new Cell[size]);
+    m_mask = size - 1;
+    for (std::size_t i = 0; i < size; ++i) {
+        m_cells[i].m_sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+/*
+ * Moves the value into the queue, returns false if the queue is full
+ */
+template <typename T>
+bool MpmcQueue<T>::try_push(T& value)
+{
+    std::size_t position = m_push.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = m_cells[position & m_mask];
+        const std::size_t sequence = cell.m_sequence.load(std::memory_order_acquire);
+        const std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(sequence - position);
+        if (difference == 0) {
+            if (m_push.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                cell.m_value = std::move(value);
+                cell.m_sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = m_push.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Moves the oldest value out of the queue, returns false if it is empty
+ */
+template <typename T>
+bool MpmcQueue<T>::try_pop(T& value)
+{
+    std::size_t position = m_pop.load(std::memory_order_relaxed);
+    for (;;) {
+        Cell& cell = m_cells[position & m_mask];
+        const std::size_t sequence = cell.m_sequence.load(std::memory_order_acquire);
+        const std::ptrdiff_t difference = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+        if (difference == 0) {
+            if (m_pop.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                value = std::move(cell.m_value);
+                cell.m_sequence.store(position + m_mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = m_pop.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+template <typename T>
+bool MpmcQueue<T>::empty() const
+{
+    const std::size_t position = m_pop.load(std::memory_order_relaxed);
+    return m_cells[position & m_mask].m_sequence.load(std::memory_order_acquire) != position + 1;
+}
+
+/*
+ * A task stored inline in a queue cell: a function pointer and a block
+ * holding the callable, so queuing a task allocates nothing. The callable
+ * must be trivially copyable and fit in CAPACITY bytes, which lambdas
+ * capturing pointers, references and small pairs do. With the sequence
+ * number a queue cell then fills one cache line.
+ */
+class InlineTask
+{
+public:
+    static const std::size_t CAPACITY = 48;
+
+public:
+    InlineTask();
+    template <typename FnT>
+    explicit InlineTask(FnT fn);
+
+    void operator() ();
+
+private:
+    template <typename FnT>
+    static void invoke(void* storage);
+
+private:
+    void (*m_invoke)(void*);
+    alignas(void*) unsigned char m_storage[CAPACITY];
+};
+
+inline InlineTask::InlineTask()
+    : m_invoke(nullptr)
+{}
+
+template <typename FnT>
+InlineTask::InlineTask(FnT fn)
+    : m_invoke(&InlineTask::invoke<FnT>)
+{
+    static_assert(std::is_trivially_copyable<FnT>::value, "InlineTask: the callable must be trivially copyable");
+    static_assert(sizeof(FnT) <= CAPACITY, "InlineTask: the callable does not fit in a queue cell");
+    static_assert(alignof(FnT) <= alignof(void*), "InlineTask: the callable is overaligned");
+    new (m_storage) FnT(fn);
+}
+
+inline void InlineTask::operator() ()
+{
+    m_invoke(m_storage);
+}
+
+template <typename FnT>
+void InlineTask::invoke(void* storage)
+{
+    (*static_cast<FnT*>(storage))();
+}
+
+} // namespace detail
+
+/*
+ * A fixed set of owner threads, each running the tasks of its own
+ * partition one after another in the order they were queued.
+ * Whatever belongs to a partition is touched only by its owner, so it
+ * needs no locks and stays in the cache of the owner's core.
+ * An idle owner spins for a while and then sleeps until a task comes.
+ */
+class PartitionExecutor
+{
+public:
+    typedef detail::InlineTask task_type;
+
+    static const std::size_t QUEUE_CAPACITY = 4096;
+
+public:
+    explicit PartitionExecutor(std::size_t partition_count, std::size_t queue_capacity = QUEUE_CAPACITY);
+    PartitionExecutor(const PartitionExecutor&) = delete;
+    PartitionExecutor& operator= (const PartitionExecutor&) = delete;
+    ~PartitionExecutor();
+
+    std::size_t partition_count() const;
+    template <typename FnT>
+    void post(std::size_t partition, FnT fn);
+    template <typename FnT>
+    void execute(std::size_t partition, FnT fn);
+    void drain();
+
+private:
+    /*
+     * The queue keeps its indices on cache lines of their own, so a
+     * partition is allocated with detail::aligned_new
+     */
+    struct Partition
+    {
+        explicit Partition(std::size_t queue_capacity)
+            : m_queue(queue_capacity)
+            , m_sleeping(false)
+        {}
+
+        detail::MpmcQueue<task_type> m_queue;
+        std::mutex m_mutex;
+        std::condition_variable m_wakeup;
+        std::atomic<bool> m_sleeping;
+        std::thread m_thread;
+    };
+
+    static const unsigned IDLE_SPINS = 256;
+
+    void run(std::size_t partition);
+    bool run_one(std::size_t partition);
+    bool is_owner(std::size_t partition) const;
+    void wait_for(const std::atomic<bool>& done);
+    void fail(std::exception_ptr error);
+
+    static const PartitionExecutor*& current_executor();
+    static std::size_t& current_partition();
+
+private:
+    std::vector<std::unique_ptr<Partition, detail::AlignedDelete<Partition> > > m_partitions;
+    std::atomic<bool> m_stop;
+    std::mutex m_error_mutex;
+    std::exception_ptr m_error;
+};
+
+/*
+ * Starts an owner thread for every partition
+ */
+inline PartitionExecutor::PartitionExecutor(std::size_t partition_count, std::size_t queue_capacity)
+    : m_stop(false)
+{
+    if (partition_count == 0) {
+        throw std::invalid_argument("PartitionExecutor needs at least one partition");
+    }
+    for (std::size_t i = 0; i < partition_count; ++i) {
+        m_partitions.emplace_back(detail::aligned_new<Partition>(1, queue_capacity));
+    }
+    try {
+        for (std::size_t i = 0; i < partition_count; ++i) {
+            m_partitions[i]->m_thread = std::thread(&PartitionExecutor::run, this, i);
+        }
+    } catch (...) {
+        m_stop.store(true);
+        for (auto& partition : m_partitions) {
+            if (partition->m_thread.joinable()) {
+                {
+                    std::lock_guard<std::mutex> lck(partition->m_mutex);
+                }
+                partition->m_wakeup.notify_one();
+                partition->m_thread.join();
+            }
+        }
+        throw;
+    }
+}
+
+/*
+ * Destructor
+ * Runs the tasks which are still queued and stops the owner threads
+ */
+inline PartitionExecutor::~PartitionExecutor()
+{
+    m_stop.store(true);
+    for (auto& partition : m_partitions) {
+        {
+            std::lock_guard<std::mutex> lck(partition->m_mutex);
+        }
+        partition->m_wakeup.notify_one();
+        partition->m_thread.join();
+    }
+}
+
+inline std::size_t PartitionExecutor::partition_count() const
+{
+    return m_partitions.size();
+}
+
+/*
+ * Queues the task to the owner of the partition and returns without
+ * waiting for it. If the queue is full the caller waits for a free cell,
+ * and an owner thread runs its own tasks meanwhile, so two owners
+ * posting to each other do not block forever.
+ * The task is stored in the queue cell, see InlineTask for what fits.
+ * An exception thrown by the task is reported by the next drain().
+ */
+template <typename FnT>
+void PartitionExecutor::post(std::size_t partition, FnT fn)
+{
+    task_type task(fn);
+    Partition& target = *m_partitions[partition];
+    for (unsigned spins = 0; !target.m_queue.try_push(task); ++spins) {
+        if (current_executor() == this && run_one(current_partition())) {
+            continue;
+        }
+        if (spins % 64 == 63) {
+            std::this_thread::yield();
+        } else {
+            detail::cpu_relax();
+        }
+    }
+    // Pairs with the fence of the owner going to sleep: either the owner
+    // sees the task, or this thread sees that the owner sleeps
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (target.m_sleeping.load(std::memory_order_relaxed)) {
+        {
+            std::lock_guard<std::mutex> lck(target.m_mutex);
+        }
+        target.m_wakeup.notify_one();
+    }
+}
+
+/*
+ * Runs fn on the owner of the partition and returns when it is done,
+ * rethrowing what fn throws. The owner itself runs fn in place.
+ */
+template <typename FnT>
+void PartitionExecutor::execute(std::size_t partition, FnT fn)
+{
+    if (is_owner(partition)) {
+        fn();
+        return;
+    }
+    std::atomic<bool> done(false);
+    std::exception_ptr error;
+    post(partition, [&fn, &done, &error]() {
+        try {
+            fn();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        done.store(true, std::memory_order_release);
+    });
+    wait_for(done);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+ * Returns when all tasks posted before the call are done. Rethrows the
+ * first exception a posted task has thrown since the previous drain().
+ */
+inline void PartitionExecutor::drain()
+{
+    for (std::size_t i = 0; i < m_partitions.size(); ++i) {
+        execute(i, []() {});
+    }
+    std::exception_ptr error;
+    {
+        std::lock_guard<std::mutex> lck(m_error_mutex);
+        std::swap(error, m_error);
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+ * The loop of an owner thread
+ */
+inline void PartitionExecutor::run(std::size_t partition)
+{
+    current_executor() = this;
+    current_partition() = partition;
+    Partition& self = *m_partitions[partition];
+    for (;;) {
+        unsigned idle = 0;
+        while (idle < IDLE_SPINS) {
+            if (run_one(partition)) {
+                idle = 0;
+            } else {
+                ++idle;
+                detail::cpu_relax();
+            }
+        }
+        std::unique_lock<std::mutex> lck(self.m_mutex);
+        self.m_sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (self.m_queue.empty() && !m_stop.load()) {
+            self.m_wakeup.wait(lck);
+        }
+        self.m_sleeping.store(false, std::memory_order_relaxed);
+        if (self.m_queue.empty() && m_stop.load()) {
+            break;
+        }
+    }
+    current_executor() = nullptr;
+}
+
+/*
+ * Runs the oldest task of the partition, returns false if there is none
+ */
+inline bool PartitionExecutor::run_one(std::size_t partition)
+{
+    task_type task;
+    if (!m_partitions[partition]->m_queue.try_pop(task)) {
+        return false;
+    }
+    try {
+        task();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    return true;
+}
+
+inline bool PartitionExecutor::is_owner(std::size_t partition) const
+{
+    return current_executor() == this && current_partition() == partition;
+}
+
+/*
+ * Waits for a task run by another owner. An owner thread keeps running
+ * its own tasks meanwhile, since the awaited task may be queued behind
+ * a task waiting for this owner.
+ */
+inline void PartitionExecutor::wait_for(const std::atomic<bool>& done)
+{
+    const bool owner = current_executor() == this;
+    for (unsigned spins = 0; !done.load(std::memory_order_acquire); ++spins) {
+        if (owner && run_one(current_partition())) {
+            continue;
+        }
+        if (spins % 64 == 63) {
+            std::this_thread::yield();
+        } else {
+            detail::cpu_relax();
+        }
+    }
+}
+
+inline void PartitionExecutor::fail(std::exception_ptr error)
+{
+    std::lock_guard<std::mutex> lck(m_error_mutex);
+    if (!m_error) {
+        m_error = error;
+    }
+}
+
+inline const PartitionExecutor*& PartitionExecutor::current_executor()
+{
+    thread_local const PartitionExecutor* executor = nullptr;
+    return executor;
+}
+
+inline std::size_t& PartitionExecutor::current_partition()
+{
+    thread_local std::size_t partition = 0;
+    return partition;
+}
+
+} // namespace thread_safe
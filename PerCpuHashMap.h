@@ -0,0 +1,279 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include <sched.h>
+#include <unistd.h>
+
+#include "HashMap.h"
+
+namespace thread_safe {
+
+/*
+ * A map for write heavy aggregation which is read only once in a while.
+ * Every CPU has its own shard with its own buckets, and a thread updates
+ * the shard of the CPU it runs on, so the shards are never shared between
+ * cores in the steady state. collect() merges the shards into a HashMap.
+ * A shard is guarded by a spin lock which is only contended when a thread
+ * is preempted or migrated in the middle of an operation, so taking it is
+ * a single uncontended atomic exchange on a local cache line.
+ * The same key may live in several shards until they are merged, so
+ * there is no erase; clear() empties all shards.
+ */
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT = std::hash<KeyT>,
+          typename KeyEqualT = std::equal_to<KeyT> >
+class PerCpuHashMap
+{
+public:
+    typedef KeyT key_type;
+    typedef MappedT mapped_type;
+    typedef Pair<const KeyT, MappedT> value_type;
+    typedef HashT hasher;
+    typedef HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> map_type;
+
+public:
+    explicit PerCpuHashMap(const hasher& hash = hasher());
+    PerCpuHashMap(const PerCpuHashMap&) = delete;
+    PerCpuHashMap& operator= (const PerCpuHashMap&) = delete;
+    ~PerCpuHashMap();
+
+    void insert_or_assign(const key_type& key, const mapped_type& value);
+    template <typename UpdateT>
+    void update(const key_type& key, const mapped_type& initial, UpdateT update);
+    template <typename MergeT>
+    map_type collect(MergeT merge) const;
+    void clear();
+    std::size_t shard_count() const;
+
+private:
+    typedef Bucket<key_type, value_type, KeyEqualT> bucket_type;
+
+    /*
+     * A cache line of its own, the shards are allocated with
+     * detail::aligned_new
+     */
+    struct alignas(64) Shard
+    {
+        Shard()
+            : m_buckets(nullptr)
+        {
+            m_lock.clear();
+        }
+
+        std::atomic_flag m_lock;
+        std::atomic<bucket_type*> m_buckets;
+    };
+
+    /*
+     * Holds the lock of a shard
+     */
+    class ShardLock
+    {
+    public:
+        explicit ShardLock(Shard& shard);
+        ShardLock(const ShardLock&) = delete;
+        ShardLock& operator= (const ShardLock&) = delete;
+        ~ShardLock();
+
+    private:
+        Shard& m_shard;
+    };
+
+    Shard& current_shard();
+    bucket_type* buckets(Shard& shard);
+
+private:
+    std::unique_ptr<Shard[], detail::AlignedDelete<Shard> > m_shards;
+    std::size_t m_shard_count;
+    hasher m_hasher;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME PerCpuHashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT>
+
+/*
+ * Constructor
+ * The buckets of a shard are allocated when its CPU first uses it
+ */
+TEMPLATE_DECL
+CLASS_NAME::PerCpuHashMap(const hasher& hash)
+    : m_shards(nullptr)
+    , m_shard_count(0)
+    , m_hasher(hash)
+{
+    const long cpus = ::sysconf(_SC_NPROCESSORS_CONF);
+    m_shard_count = cpus > 0 ? static_cast<std::size_t>(cpus) : 1;
+    m_shards = std::unique_ptr<Shard[], detail::AlignedDelete<Shard> >(
+        detail::aligned_new<Shard>(m_shard_count), detail::AlignedDelete<Shard>(m_shard_count));
+}
+
+TEMPLATE_DECL
+CLASS_NAME::~PerCpuHashMap()
+{
+    for (std::size_t i = 0; i < m_shard_count; ++i) {
+        delete[] m_shards[i].m_buckets.load();
+    }
+}
+
+/*
+ * Inserts the pair into the shard of the current CPU or replaces the
+ * pair with the same key there
+ */
+TEMPLATE_DECL
+void CLASS_NAME::insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    Shard& shard = current_shard();
+    bucket_type& bucket = buckets(shard)[m_hasher(key) % BUCKET_COUNT];
+    ShardLock lck(shard);
+    bucket.insert_or_assign_unlocked(value_type(key, value));
+}
+
+/*
+ * Calls update with a reference to the mapped value of the key in the
+ * shard of the current CPU, which is set to initial first if the shard
+ * has no pair with the key yet
+ */
+TEMPLATE_DECL
+template <typename UpdateT>
+void CLASS_NAME::update(const key_type& key, const mapped_type& initial, UpdateT update)
+{
+    Shard& shard = current_shard();
+    bucket_type& bucket = buckets(shard)[m_hasher(key) % BUCKET_COUNT];
+    ShardLock lck(shard);
+    Node<value_type>* node = bucket.find_unlocked(key);
+    mapped_type value = node == bucket.end() ? initial : node->m_value.load(std::memory_order_relaxed).second;
+    update(value);
+    if (node == bucket.end()) {
+        bucket.insert_unlocked(value_type(key, value));
+    } else {
+        bucket.assign_unlocked(node, value_type(key, value));
+    }
+}
+
+/*
+ * Collect
+ * Merges all shards into a new HashMap. The values of a key found in
+ * several shards are combined with merge(const mapped_type&, const
+ * mapped_type&). Every shard is locked while it is merged, so each shard
+ * is seen in a consistent state, but the shards are not seen at the same
+ * instant.
+ */
+TEMPLATE_DECL
+template <typename MergeT>
+typename CLASS_NAME::map_type CLASS_NAME::collect(MergeT merge) const
+{
+    map_type result(m_hasher);
+    for (std::size_t i = 0; i < m_shard_count; ++i) {
+        Shard& shard = m_shards[i];
+        const bucket_type* shard_buckets = shard.m_buckets.load(std::memory_order_acquire);
+        if (shard_buckets == nullptr) {
+            continue;
+        }
+        ShardLock lck(shard);
+        for (std::size_t b = 0; b < BUCKET_COUNT; ++b) {
+            const Node<value_type>* node = shard_buckets[b].begin();
+            for (; node != shard_buckets[b].end(); node = node->m_next) {
+                const value_type value = node->m_value.load(std::memory_order_relaxed);
+                auto it = result.find(value.first);
+                if (it == result.end()) {
+                    result.insert(value);
+                } else {
+                    it->set(merge(it->get(), value.second));
+                }
+            }
+        }
+    }
+    return result;
+}
+
+/*
+ * Empties all shards
+ */
+TEMPLATE_DECL
+void CLASS_NAME::clear()
+{
+    for (std::size_t i = 0; i < m_shard_count; ++i) {
+        bucket_type* shard_buckets = m_shards[i].m_buckets.load(std::memory_order_acquire);
+        if (shard_buckets == nullptr) {
+            continue;
+        }
+        ShardLock lck(m_shards[i]);
+        for (std::size_t b = 0; b < BUCKET_COUNT; ++b) {
+            while (shard_buckets[b].begin() != shard_buckets[b].end()) {
+                shard_buckets[b].erase_unlocked(shard_buckets[b].begin());
+            }
+        }
+    }
+}
+
+TEMPLATE_DECL
+std::size_t CLASS_NAME::shard_count() const
+{
+    return m_shard_count;
+}
+
+TEMPLATE_DECL
+CLASS_NAME::ShardLock::ShardLock(Shard& shard)
+    : m_shard(shard)
+{
+    for (unsigned spins = 0; m_shard.m_lock.test_and_set(std::memory_order_acquire); ++spins) {
+        // The holder has been preempted or moved to another CPU
+        if (spins % 64 == 63) {
+            std::this_thread::yield();
+        } else {
+            detail::cpu_relax();
+        }
+    }
+}
+
+TEMPLATE_DECL
+CLASS_NAME::ShardLock::~ShardLock()
+{
+    m_shard.m_lock.clear(std::memory_order_release);
+}
+
+/*
+ * Returns the shard of the CPU the calling thread runs on. The thread
+ * may be moved to another CPU right after, which only costs locality.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::Shard& CLASS_NAME::current_shard()
+{
+    const int cpu = ::sched_getcpu();
+    return m_shards[cpu < 0 ? 0 : static_cast<std::size_t>(cpu) % m_shard_count];
+}
+
+/*
+ * Returns the buckets of the shard, allocating them on first use
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::bucket_type* CLASS_NAME::buckets(Shard& shard)
+{
+    bucket_type* result = shard.m_buckets.load(std::memory_order_acquire);
+    if (result != nullptr) {
+        return result;
+    }
+    std::unique_ptr<bucket_type[]> created(new bucket_type[BUCKET_COUNT]);
+    if (shard.m_buckets.compare_exchange_strong(result, created.get(), std::memory_order_acq_rel)) {
+        return created.release();
+    }
+    return result;
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
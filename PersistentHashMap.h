@@ -0,0 +1,523 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Bucket.h"
+
+namespace thread_safe {
+
+/*
+ * The header at offset 0 of a PersistentHashMap file.
+ * Every link in the file is an offset from the beginning of the mapping
+ * instead of a raw pointer, so the file may be mapped at any address by
+ * the next process. Offset 0 is the header itself and thus means "none".
+ */
+struct PersistentHeader
+{
+    std::uint64_t m_magic;
+    std::uint64_t m_bucket_count;
+    std::uint64_t m_node_size;
+    std::uint64_t m_capacity;
+    std::uint64_t m_nodes_offset;
+    std::uint64_t m_clean;
+    std::atomic<std::uint64_t> m_top;
+    std::atomic<std::uint64_t> m_free;
+    std::atomic<std::uint64_t> m_size;
+};
+
+/*
+ * A node of PersistentHashMap. Chains are singly linked since a node is
+ * always unlinked during the search for its key.
+ */
+template <typename ValueT>
+struct PersistentNode
+{
+    std::uint64_t m_next;
+    ValueT m_value;
+};
+
+/*
+ * A HashMap variant whose buckets and nodes live in a memory-mapped file.
+ * Opening an existing file does not read it: lookups are served right away
+ * and the OS pages data in lazily. The file has a fixed capacity chosen at
+ * creation time.
+ * Concurrent readers and writers of one process are synchronized with a
+ * mutex per bucket. The file is marked clean on destruction; if a process
+ * dies with the file open, the next open walks all chains, drops broken
+ * links and rebuilds the free list and the size.
+ * Keys and mapped values are stored bytewise, so both must be trivially
+ * copyable.
+ */
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT = std::hash<KeyT>,
+          typename KeyEqualT = std::equal_to<KeyT> >
+class PersistentHashMap
+{
+    static_assert(std::is_trivially_copyable<KeyT>::value &&
+                  std::is_trivially_copyable<MappedT>::value,
+                  "PersistentHashMap stores only trivially copyable types");
+
+public:
+    typedef KeyT key_type;
+    typedef MappedT mapped_type;
+    typedef Pair<KeyT, MappedT> value_type;
+    typedef std::size_t size_type;
+    typedef HashT hasher;
+    typedef KeyEqualT key_equal;
+
+    static const std::uint64_t MAGIC = 0x50484d4150763031ull; // "PHMAPv01"
+
+    /* Constructors */
+public:
+    PersistentHashMap(const std::string& path,
+                      std::uint64_t capacity,
+                      const hasher& hash = hasher());
+    PersistentHashMap(const PersistentHashMap&) = delete;
+    PersistentHashMap& operator= (const PersistentHashMap&) = delete;
+    ~PersistentHashMap();
+
+    /* Mutators */
+public:
+    bool insert(const key_type& key, const mapped_type& value);
+    void insert_or_assign(const key_type& key, const mapped_type& value);
+    bool erase(const key_type& key);
+    void sync();
+
+    /* Selectors */
+public:
+    bool find(const key_type& key, mapped_type& value) const;
+    size_type size() const;
+    bool empty() const;
+    bool was_recovered() const;
+
+    /* Private members and helper functions */
+private:
+    typedef PersistentNode<value_type> node_type;
+
+    static std::uint64_t node_stride();
+    static std::uint64_t nodes_offset();
+
+    void create(std::uint64_t capacity);
+    void validate() const;
+    void recover();
+    node_type* node_at(std::uint64_t offset) const;
+    std::uint64_t* head(std::size_t bucket_index) const;
+    std::uint64_t* find_link(std::size_t bucket_index, const key_type& key) const;
+    std::uint64_t allocate_node();
+    void free_node(std::uint64_t offset);
+
+private:
+    int m_fd;
+    char* m_base;
+    std::uint64_t m_length;
+    PersistentHeader* m_header;
+    bool m_recovered;
+    hasher m_hasher;
+    key_equal m_key_equal;
+    std::unique_ptr<std::mutex[]> m_locks;
+    std::mutex m_alloc_mutex;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME PersistentHashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT>
+
+/*
+ * Opens the file at path, creating it with the given capacity in bytes
+ * if it does not exist. The capacity of an existing file is taken from
+ * its header.
+ */
+TEMPLATE_DECL
+CLASS_NAME::PersistentHashMap(const std::string& path,
+                              std::uint64_t capacity,
+                              const hasher& hash)
+    : m_fd(-1)
+    , m_base(nullptr)
+    , m_length(0)
+    , m_header(nullptr)
+    , m_recovered(false)
+    , m_hasher(hash)
+    , m_locks(new std::mutex[BUCKET_COUNT])
+{
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0) {
+        const int error = errno;
+        ::close(m_fd);
+        throw std::system_error(error, std::generic_category(), "fstat " + path);
+    }
+    try {
+        if (st.st_size == 0) {
+            create(capacity);
+        } else {
+            m_length = static_cast<std::uint64_t>(st.st_size);
+            void* base = ::mmap(nullptr, m_length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+            if (base == MAP_FAILED) {
+                throw std::system_error(errno, std::generic_category(), "mmap " + path);
+            }
+            m_base = static_cast<char*>(base);
+            m_header = reinterpret_cast<PersistentHeader*>(m_base);
+            validate();
+        }
+    } catch (...) {
+        if (m_base != nullptr) {
+            ::munmap(m_base, m_length);
+        }
+        ::close(m_fd);
+        throw;
+    }
+    // Lookups hop between unrelated nodes, so read-ahead would only waste I/O
+    ::madvise(m_base + nodes_offset(), m_length - nodes_offset(), MADV_RANDOM);
+
+    if (m_header->m_clean == 0) {
+        recover();
+        m_recovered = true;
+    }
+    m_header->m_clean = 0;
+    ::msync(m_base, sizeof(PersistentHeader), MS_SYNC);
+}
+
+/*
+ * Destructor
+ * Flushes everything to the file and marks it as cleanly closed
+ */
+TEMPLATE_DECL
+CLASS_NAME::~PersistentHashMap()
+{
+    ::msync(m_base, m_length, MS_SYNC);
+    m_header->m_clean = 1;
+    ::msync(m_base, sizeof(PersistentHeader), MS_SYNC);
+    ::munmap(m_base, m_length);
+    ::close(m_fd);
+}
+
+/*
+ * Insert
+ * Inserts the pair if there is no pair with the same key
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::insert(const key_type& key, const mapped_type& value)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    std::lock_guard<std::mutex> lck(m_locks[bucket_index]);
+    if (*find_link(bucket_index, key) != 0) {
+        return false;
+    }
+    const std::uint64_t offset = allocate_node();
+    node_type* node = node_at(offset);
+    node->m_value = value_type(key, value);
+    // The node is complete before it becomes reachable from the bucket
+    node->m_next = *head(bucket_index);
+    *head(bucket_index) = offset;
+    m_header->m_size.fetch_add(1);
+    return true;
+}
+
+/*
+ * Insert or assign
+ * Inserts the pair if there is no pair with the same key or replaces
+ * the mapped value of the existing one otherwise
+ */
+TEMPLATE_DECL
+void CLASS_NAME::insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    std::lock_guard<std::mutex> lck(m_locks[bucket_index]);
+    const std::uint64_t found = *find_link(bucket_index, key);
+    if (found != 0) {
+        node_at(found)->m_value.second = value;
+        return;
+    }
+    const std::uint64_t offset = allocate_node();
+    node_type* node = node_at(offset);
+    node->m_value = value_type(key, value);
+    node->m_next = *head(bucket_index);
+    *head(bucket_index) = offset;
+    m_header->m_size.fetch_add(1);
+}
+
+/*
+ * Erase
+ * Erases the pair with the key if such one exists
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::erase(const key_type& key)
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    std::lock_guard<std::mutex> lck(m_locks[bucket_index]);
+    std::uint64_t* link = find_link(bucket_index, key);
+    const std::uint64_t offset = *link;
+    if (offset == 0) {
+        return false;
+    }
+    *link = node_at(offset)->m_next;
+    free_node(offset);
+    m_header->m_size.fetch_sub(1);
+    return true;
+}
+
+/*
+ * Writes all dirty pages of the mapping to the file
+ */
+TEMPLATE_DECL
+void CLASS_NAME::sync()
+{
+    ::msync(m_base, m_length, MS_SYNC);
+}
+
+/*
+ * Find
+ * Copies the mapped value of the key into value and returns true if
+ * the key exists, returns false otherwise
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::find(const key_type& key, mapped_type& value) const
+{
+    const auto bucket_index = m_hasher(key) % BUCKET_COUNT;
+    std::lock_guard<std::mutex> lck(m_locks[bucket_index]);
+    const std::uint64_t offset = *find_link(bucket_index, key);
+    if (offset == 0) {
+        return false;
+    }
+    value = node_at(offset)->m_value.second;
+    return true;
+}
+
+/*
+ * Returns the number of pairs in the file
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::size() const
+{
+    return m_header->m_size.load();
+}
+
+/*
+ * Returns true if the container is empty and false otherwise
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return size() == 0;
+}
+
+/*
+ * Returns true if the file was not closed cleanly and had to be
+ * recovered on open
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::was_recovered() const
+{
+    return m_recovered;
+}
+
+/*
+ * Distance between two neighbouring nodes in the node area
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::node_stride()
+{
+    const std::uint64_t align = alignof(node_type);
+    return (sizeof(node_type) + align - 1) / align * align;
+}
+
+/*
+ * Offset of the node area, which follows the header and the bucket heads
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::nodes_offset()
+{
+    const std::uint64_t heads_end = sizeof(PersistentHeader) + BUCKET_COUNT * sizeof(std::uint64_t);
+    const std::uint64_t page = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+    return (heads_end + page - 1) / page * page;
+}
+
+/*
+ * Formats an empty file of the given capacity. The file is sparse, so
+ * the capacity costs nothing until nodes are actually written.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::create(std::uint64_t capacity)
+{
+    if (capacity < nodes_offset() + node_stride()) {
+        throw std::invalid_argument("PersistentHashMap capacity is too small");
+    }
+    if (::ftruncate(m_fd, static_cast<off_t>(capacity)) != 0) {
+        throw std::system_error(errno, std::generic_category(), "ftruncate");
+    }
+    m_length = capacity;
+    void* base = ::mmap(nullptr, m_length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (base == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+    m_base = static_cast<char*>(base);
+    // A fresh file is all zeroes, so all bucket heads are already empty
+    m_header = new (m_base) PersistentHeader();
+    m_header->m_magic = MAGIC;
+    m_header->m_bucket_count = BUCKET_COUNT;
+    m_header->m_node_size = node_stride();
+    m_header->m_capacity = capacity;
+    m_header->m_nodes_offset = nodes_offset();
+    m_header->m_clean = 1;
+    m_header->m_top.store(nodes_offset());
+    m_header->m_free.store(0);
+    m_header->m_size.store(0);
+    ::msync(m_base, m_length, MS_SYNC);
+}
+
+/*
+ * Checks that an existing file was written by a map of the same type
+ */
+TEMPLATE_DECL
+void CLASS_NAME::validate() const
+{
+    if (m_length < sizeof(PersistentHeader) ||
+        m_header->m_magic != MAGIC ||
+        m_header->m_bucket_count != BUCKET_COUNT ||
+        m_header->m_node_size != node_stride() ||
+        m_header->m_nodes_offset != nodes_offset() ||
+        m_header->m_capacity != m_length) {
+        throw std::runtime_error("PersistentHashMap file does not match the map type");
+    }
+}
+
+/*
+ * Recovery after an unclean shutdown
+ * Cuts every chain at the first link which does not point to a valid
+ * allocated node or points to an already visited one, then puts every
+ * unreachable node to the free list and recounts the size
+ */
+TEMPLATE_DECL
+void CLASS_NAME::recover()
+{
+    const std::uint64_t first = nodes_offset();
+    std::uint64_t top = m_header->m_top.load();
+    if (top < first || top > m_length) {
+        top = m_length;
+    }
+    top = first + (top - first) / node_stride() * node_stride();
+    m_header->m_top.store(top);
+
+    const std::size_t node_count = static_cast<std::size_t>((top - first) / node_stride());
+    std::vector<bool> reachable(node_count, false);
+    std::uint64_t size = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        std::uint64_t* link = head(i);
+        while (*link != 0) {
+            const std::uint64_t offset = *link;
+            const bool valid = offset >= first &&
+                               offset < top &&
+                               (offset - first) % node_stride() == 0 &&
+                               !reachable[(offset - first) / node_stride()];
+            if (!valid) {
+                *link = 0;
+                break;
+            }
+            reachable[(offset - first) / node_stride()] = true;
+            ++size;
+            link = &node_at(offset)->m_next;
+        }
+    }
+    std::uint64_t free_list = 0;
+    for (std::size_t i = node_count; i > 0; --i) {
+        if (!reachable[i - 1]) {
+            const std::uint64_t offset = first + (i - 1) * node_stride();
+            node_at(offset)->m_next = free_list;
+            free_list = offset;
+        }
+    }
+    m_header->m_free.store(free_list);
+    m_header->m_size.store(size);
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::node_type* CLASS_NAME::node_at(std::uint64_t offset) const
+{
+    return reinterpret_cast<node_type*>(m_base + offset);
+}
+
+TEMPLATE_DECL
+std::uint64_t* CLASS_NAME::head(std::size_t bucket_index) const
+{
+    return reinterpret_cast<std::uint64_t*>(m_base + sizeof(PersistentHeader)) + bucket_index;
+}
+
+/*
+ * Returns the link which points to the node with the key, or the
+ * terminating zero link of the chain if there is no such node.
+ * The caller must hold the lock of the bucket.
+ */
+TEMPLATE_DECL
+std::uint64_t* CLASS_NAME::find_link(std::size_t bucket_index, const key_type& key) const
+{
+    std::uint64_t* link = head(bucket_index);
+    while (*link != 0) {
+        node_type* node = node_at(*link);
+        if (m_key_equal(node->m_value.first, key)) {
+            break;
+        }
+        link = &node->m_next;
+    }
+    return link;
+}
+
+/*
+ * Takes a node from the free list or from the untouched tail of the
+ * node area. Throws std::bad_alloc when the file is full.
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::allocate_node()
+{
+    std::lock_guard<std::mutex> lck(m_alloc_mutex);
+    const std::uint64_t free_head = m_header->m_free.load();
+    if (free_head != 0) {
+        m_header->m_free.store(node_at(free_head)->m_next);
+        return free_head;
+    }
+    const std::uint64_t top = m_header->m_top.load();
+    if (top + node_stride() > m_length) {
+        throw std::bad_alloc();
+    }
+    m_header->m_top.store(top + node_stride());
+    return top;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::free_node(std::uint64_t offset)
+{
+    std::lock_guard<std::mutex> lck(m_alloc_mutex);
+    node_at(offset)->m_next = m_header->m_free.load();
+    m_header->m_free.store(offset);
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Bucket.h"
+
+namespace thread_safe {
+
+/*
+ * A prefix index of the string keys of a HashMap, for iterating and
+ * counting the keys which start with a prefix, e.g. "tenant42/", without
+ * scanning the buckets. The keys are kept in a radix tree whose nodes
+ * know how many keys lie below them, so a prefix count takes one walk
+ * down the tree.
+ * The index is attached as the MutationListener of the map and sees
+ * every insert and erase while the bucket of the key is locked. The tree
+ * is guarded by a readers writer lock; readers copy the keys out and
+ * call back only after releasing it, as a callback which reads the map
+ * could otherwise wait for a bucket whose writer waits for the tree.
+ * KeyT must have data() and size() and be constructible from a pointer
+ * and a size, as FixedString and std::string are.
+ * Like every listener the index must outlive the map, or be detached from
+ * it first.
+ */
+template <typename KeyT, typename MappedT>
+class PrefixIndex : public MutationListener<Pair<const KeyT, MappedT> >
+{
+public:
+    typedef KeyT key_type;
+    typedef Pair<const KeyT, MappedT> value_type;
+    typedef std::size_t size_type;
+
+public:
+    PrefixIndex();
+    PrefixIndex(const PrefixIndex&) = delete;
+    PrefixIndex& operator= (const PrefixIndex&) = delete;
+
+    template <typename MapT>
+    void attach(MapT& map);
+    template <typename MapT>
+    void detach(MapT& map);
+
+    void on_insert(const value_type& value) override;
+    void on_assign(const value_type& value) override;
+    void on_erase(const value_type& value) override;
+
+    std::vector<key_type> keys_with_prefix(const std::string& prefix) const;
+    template <typename FnT>
+    void for_each_prefix(const std::string& prefix, FnT fn) const;
+    size_type count_prefix(const std::string& prefix) const;
+    size_type size() const;
+    bool empty() const;
+
+private:
+    /*
+     * A node of the radix tree. The label is the part of the keys below
+     * it which follows the label of the parent. The children are sorted
+     * by the first byte of their labels, which all differ.
+     */
+    struct RadixNode
+    {
+        RadixNode()
+            : m_label()
+            , m_terminal(false)
+            , m_count(0)
+            , m_children()
+        {}
+
+        std::string m_label;
+        bool m_terminal;
+        size_type m_count;
+        std::vector<std::unique_ptr<RadixNode> > m_children;
+    };
+
+    typedef typename std::vector<std::unique_ptr<RadixNode> >::iterator child_iterator;
+
+    bool insert(RadixNode& node, const char* data, std::size_t size);
+    bool erase(RadixNode& node, const char* data, std::size_t size);
+    const RadixNode* find_prefix(const std::string& prefix, std::string& path) const;
+    void collect(const RadixNode& node, std::string& path, std::vector<key_type>& keys) const;
+    static child_iterator find_child(RadixNode& node, char first);
+
+private:
+    mutable std::shared_timed_mutex m_mutex;
+    RadixNode m_root;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT, typename MappedT>
+#define CLASS_NAME PrefixIndex<KeyT, MappedT>
+
+TEMPLATE_DECL
+CLASS_NAME::PrefixIndex()
+    : m_mutex()
+    , m_root()
+{}
+
+/*
+ * Adds the index to the mutation listeners of the map, next to any others
+ * such as a ChangeLog, and adds the keys the map already holds. The
+ * listener is added first, so a pair inserted or erased meanwhile is
+ * reported either way and no key is missed.
+ */
+TEMPLATE_DECL
+template <typename MapT>
+void CLASS_NAME::attach(MapT& map)
+{
+    map.add_mutation_listener(this);
+    map.visit_all([this](const value_type& value) {
+        on_insert(value);
+    });
+}
+
+/*
+ * Stops the map reporting its changes to the index, after which the index
+ * no longer follows the map. The other listeners of the map go on.
+ */
+TEMPLATE_DECL
+template <typename MapT>
+void CLASS_NAME::detach(MapT& map)
+{
+    map.remove_mutation_listener(this);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::on_insert(const value_type& value)
+{
+    std::lock_guard<std::shared_timed_mutex> lck(m_mutex);
+    insert(m_root, value.first.data(), value.first.size());
+}
+
+/*
+ * An assignment does not change the key
+ */
+TEMPLATE_DECL
+void CLASS_NAME::on_assign(const value_type&)
+{}
+
+TEMPLATE_DECL
+void CLASS_NAME::on_erase(const value_type& value)
+{
+    std::lock_guard<std::shared_timed_mutex> lck(m_mutex);
+    erase(m_root, value.first.data(), value.first.size());
+}
+
+/*
+ * Returns the keys which start with the prefix in bytewise lexicographic
+ * order
+ */
+TEMPLATE_DECL
+std::vector<typename CLASS_NAME::key_type> CLASS_NAME::keys_with_prefix(const std::string& prefix) const
+{
+    std::vector<key_type> keys;
+    std::shared_lock<std::shared_timed_mutex> lck(m_mutex);
+    std::string path;
+    const RadixNode* node = find_prefix(prefix, path);
+    if (node != nullptr) {
+        keys.reserve(node->m_count);
+        collect(*node, path, keys);
+    }
+    return keys;
+}
+
+/*
+ * Calls fn(const key_type&) with the keys which start with the prefix in
+ * bytewise lexicographic order. The keys are those of the moment of the
+ * call, fn runs without the index locked and may read the map.
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::for_each_prefix(const std::string& prefix, FnT fn) const
+{
+    for (const auto& key : keys_with_prefix(prefix)) {
+        fn(key);
+    }
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::count_prefix(const std::string& prefix) const
+{
+    std::shared_lock<std::shared_timed_mutex> lck(m_mutex);
+    std::string path;
+    const RadixNode* node = find_prefix(prefix, path);
+    return node == nullptr ? 0 : node->m_count;
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::size() const
+{
+    std::shared_lock<std::shared_timed_mutex> lck(m_mutex);
+    return m_root.m_count;
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return size() == 0;
+}
+
+/*
+ * Adds the rest of a key below the node, splitting the label of a child
+ * where the key leaves it. Returns false if the key was there already.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::insert(RadixNode& node, const char* data, std::size_t size)
+{
+    if (size == 0) {
+        if (node.m_terminal) {
+            return false;
+        }
+        node.m_terminal = true;
+        ++node.m_count;
+        return true;
+    }
+    child_iterator child = find_child(node, data[0]);
+    if (child == node.m_children.end() || (*child)->m_label[0] != data[0]) {
+        std::unique_ptr<RadixNode> leaf(new RadixNode());
+        leaf->m_label.assign(data, size);
+        leaf->m_terminal = true;
+        leaf->m_count = 1;
+        node.m_children.insert(child, std::move(leaf));
+        ++node.m_count;
+        return true;
+    }
+    const std::string& label = (*child)->m_label;
+    const std::size_t length = std::min(label.size(), size);
+    const std::size_t common = std::mismatch(label.data(), label.data() + length, data).first - label.data();
+    if (common < label.size()) {
+        std::unique_ptr<RadixNode> middle(new RadixNode());
+        middle->m_label = label.substr(0, common);
+        middle->m_count = (*child)->m_count;
+        (*child)->m_label.erase(0, common);
+        middle->m_children.push_back(std::move(*child));
+        *child = std::move(middle);
+    }
+    const bool inserted = insert(**child, data + common, size - common);
+    if (inserted) {
+        ++node.m_count;
+    }
+    return inserted;
+}
+
+/*
+ * Removes the rest of a key below the node, dropping children left
+ * without keys and merging a child left with a single child of its own
+ * into it. Returns false if the key was not there.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::erase(RadixNode& node, const char* data, std::size_t size)
+{
+    if (size == 0) {
+        if (!node.m_terminal) {
+            return false;
+        }
+        node.m_terminal = false;
+        --node.m_count;
+        return true;
+    }
+    child_iterator child = find_child(node, data[0]);
+    if (child == node.m_children.end()) {
+        return false;
+    }
+    const std::string& label = (*child)->m_label;
+    if (label.size() > size || label.compare(0, label.size(), data, label.size()) != 0) {
+        return false;
+    }
+    if (!erase(**child, data + label.size(), size - label.size())) {
+        return false;
+    }
+    --node.m_count;
+    if ((*child)->m_count == 0) {
+        node.m_children.erase(child);
+    } else if (!(*child)->m_terminal && (*child)->m_children.size() == 1) {
+        std::unique_ptr<RadixNode> grandchild = std::move((*child)->m_children.front());
+        grandchild->m_label.insert(0, (*child)->m_label);
+        *child = std::move(grandchild);
+    }
+    return true;
+}
+
+/*
+ * Returns the highest node whose keys all start with the prefix, with the
+ * bytes from the root to it in path, or nullptr if no key does
+ */
+TEMPLATE_DECL
+const typename CLASS_NAME::RadixNode* CLASS_NAME::find_prefix(const std::string& prefix, std::string& path) const
+{
+    RadixNode* node = const_cast<RadixNode*>(&m_root);
+    std::size_t position = 0;
+    while (position < prefix.size()) {
+        child_iterator child = find_child(*node, prefix[position]);
+        if (child == node->m_children.end()) {
+            return nullptr;
+        }
+        const std::string& label = (*child)->m_label;
+        const std::size_t length = std::min(label.size(), prefix.size() - position);
+        if (label.compare(0, length, prefix, position, length) != 0) {
+            return nullptr;
+        }
+        path += label;
+        position += length;
+        node = child->get();
+    }
+    return node;
+}
+
+/*
+ * Appends the keys below the node in order, a key before its extensions
+ */
+TEMPLATE_DECL
+void CLASS_NAME::collect(const RadixNode& node, std::string& path, std::vector<key_type>& keys) const
+{
+    if (node.m_terminal) {
+        keys.push_back(key_type(path.data(), path.size()));
+    }
+    for (const auto& child : node.m_children) {
+        path += child->m_label;
+        collect(*child, path, keys);
+        path.resize(path.size() - child->m_label.size());
+    }
+}
+
+/*
+ * Returns the child whose label starts with the byte, or else the place
+ * where such a child would go
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::child_iterator CLASS_NAME::find_child(RadixNode& node, char first)
+{
+    return std::lower_bound(node.m_children.begin(), node.m_children.end(), first,
+        [](const std::unique_ptr<RadixNode>& child, char byte) {
+            return static_cast<unsigned char>(child->m_label[0]) < static_cast<unsigned char>(byte);
+        });
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -15,14 +15,15 @@ struct IteratorHelper;
 
 /*
  * Reference is a class which wraps a pointer to a pointer to
- * some node in Bucket.
+ * some node in Bucket, along with the Bucket itself, which
+ * carries out the changes made through the reference.
  * Dereferencing iterators and operator[] of HashMap gives as 
  * Reference objects.
  * It converts to mapped_type of HashMap implicitly.
  * Provides get(), get_pair(), set(), set_pair() functions to
  * get and set mapped value or the whole pair of node respectively.
  */
-template <typename ValueT>
+template <typename ValueT, typename BucketT>
 class Reference
 {
     template <typename KeyT,
@@ -34,8 +35,9 @@ class Reference
     friend struct IteratorHelper;
 
 public:
-    explicit Reference(Node<ValueT>* node)
-        : m_node(node)
+    Reference(BucketT* bucket, Node<ValueT>* node)
+        : m_bucket(bucket)
+        , m_node(node)
     {}
 
     Reference(const Reference& that) = default;
@@ -59,12 +61,12 @@ public:
     void set(const typename ValueT::second_type& value)
     {
         const auto key = m_node->m_value.load().first;
-        m_node->m_value.store(thread_safe::make_pair(key, value));
+        m_bucket->assign(m_node, thread_safe::make_pair(key, value));
     }
 
     void set_pair(const ValueT& value)
     {
-        m_node->m_value.store(value);
+        m_bucket->assign(m_node, value);
     }
 
     typename ValueT::second_type get() const
@@ -78,6 +80,7 @@ public:
     }
 
 private:
+    BucketT* m_bucket;
     Node<ValueT>* m_node;
 };
 
@@ -0,0 +1,653 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "PersistentHashMap.h"
+
+namespace thread_safe {
+
+/*
+ * The header at offset 0 of a SharedHashMap segment.
+ * As in PersistentHashMap every link is an offset from the beginning of
+ * the segment, since every process maps it at its own address.
+ */
+struct SharedHeader
+{
+    enum State : std::uint32_t
+    {
+        INITIALIZING,
+        READY
+    };
+
+    std::atomic<std::uint32_t> m_state;
+    std::uint64_t m_magic;
+    std::uint64_t m_bucket_count;
+    std::uint64_t m_node_size;
+    std::uint64_t m_capacity;
+    pthread_mutex_t m_alloc_mutex;
+    std::uint64_t m_top;
+    std::uint64_t m_free;
+};
+
+/*
+ * A bucket of SharedHashMap: a process-shared robust mutex and the head
+ * of a singly linked chain
+ */
+struct SharedBucket
+{
+    pthread_mutex_t m_mutex;
+    std::uint64_t m_head;
+    std::uint64_t m_size;
+};
+
+/*
+ * A HashMap variant allocated inside a POSIX shared memory segment, so
+ * that processes on one host share a single copy of the data.
+ * Every bucket has a process-shared robust mutex. Every change of a
+ * chain is committed by a single store of a link: an assignment writes a
+ * new node and swaps it in, so a chain is never seen half-changed. When
+ * a process dies holding a bucket lock, the next process to lock it
+ * walks the chain, cuts it at the first broken link and recounts it.
+ * The nodes a dead process allocated but did not link are lost.
+ * The segment has a fixed capacity chosen by the process creating it,
+ * which formats it while holding an exclusive flock() on it. The lock
+ * goes away with a process which dies, so a process which finds the
+ * segment unformatted and unlocked formats it itself.
+ * Keys and mapped values are stored bytewise, so both must be trivially
+ * copyable.
+ */
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT = std::hash<KeyT>,
+          typename KeyEqualT = std::equal_to<KeyT> >
+class SharedHashMap
+{
+    static_assert(std::is_trivially_copyable<KeyT>::value &&
+                  std::is_trivially_copyable<MappedT>::value,
+                  "SharedHashMap stores only trivially copyable types");
+
+public:
+    typedef KeyT key_type;
+    typedef MappedT mapped_type;
+    typedef Pair<KeyT, MappedT> value_type;
+    typedef std::size_t size_type;
+    typedef HashT hasher;
+    typedef KeyEqualT key_equal;
+
+    static const std::uint64_t MAGIC = 0x53484d4150763031ull; // "SHMAPv01"
+    static const std::int64_t ATTACH_TIMEOUT_MS = 10000;
+
+    /* Constructors */
+public:
+    SharedHashMap(const std::string& name,
+                  std::uint64_t capacity,
+                  const hasher& hash = hasher());
+    SharedHashMap(const SharedHashMap&) = delete;
+    SharedHashMap& operator= (const SharedHashMap&) = delete;
+    ~SharedHashMap();
+
+    static void remove(const std::string& name);
+
+    /* Mutators */
+public:
+    bool insert(const key_type& key, const mapped_type& value);
+    void insert_or_assign(const key_type& key, const mapped_type& value);
+    bool erase(const key_type& key);
+
+    /* Selectors */
+public:
+    bool find(const key_type& key, mapped_type& value) const;
+    size_type size() const;
+    bool empty() const;
+    std::size_t recovered_locks() const;
+
+    /* Private members and helper functions */
+private:
+    typedef PersistentNode<value_type> node_type;
+
+    /*
+     * Locks a robust mutex of the segment and repairs what it guards if
+     * the previous owner died
+     */
+    class Lock
+    {
+    public:
+        Lock(const SharedHashMap& map, pthread_mutex_t* mutex, SharedBucket* bucket);
+        Lock(const Lock&) = delete;
+        Lock& operator= (const Lock&) = delete;
+        ~Lock();
+
+    private:
+        pthread_mutex_t* m_mutex;
+    };
+
+    static std::uint64_t node_stride();
+    static std::uint64_t buckets_offset();
+    static std::uint64_t nodes_offset();
+    static void init_mutex(pthread_mutex_t* mutex);
+
+    void create(std::uint64_t capacity);
+    void attach(std::uint64_t capacity);
+    bool try_map();
+    bool try_lock_segment(bool wait);
+    void unlock_segment();
+    void repair(SharedBucket* bucket) const;
+    node_type* node_at(std::uint64_t offset) const;
+    SharedBucket* bucket(std::size_t bucket_index) const;
+    std::uint64_t* find_link(SharedBucket* bucket, const key_type& key) const;
+    std::uint64_t allocate_node(const value_type& value);
+    void free_node(std::uint64_t offset);
+
+private:
+    std::string m_name;
+    int m_fd;
+    char* m_base;
+    std::uint64_t m_length;
+    SharedHeader* m_header;
+    hasher m_hasher;
+    key_equal m_key_equal;
+    mutable std::atomic<std::size_t> m_recovered_locks;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME SharedHashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT>
+
+TEMPLATE_DECL
+const std::int64_t CLASS_NAME::ATTACH_TIMEOUT_MS;
+
+/*
+ * Attaches to the segment with the given name (e.g. "/my_map"), creating
+ * it with the given capacity in bytes if it does not exist. Processes
+ * attaching while another one creates the segment wait until it is ready,
+ * and create it themselves if its creator has died before. A creator
+ * which is alive but not done within ATTACH_TIMEOUT_MS makes them throw.
+ */
+TEMPLATE_DECL
+CLASS_NAME::SharedHashMap(const std::string& name,
+                          std::uint64_t capacity,
+                          const hasher& hash)
+    : m_name(name)
+    , m_fd(-1)
+    , m_base(nullptr)
+    , m_length(0)
+    , m_header(nullptr)
+    , m_hasher(hash)
+    , m_recovered_locks(0)
+{
+    m_fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    const bool creator = m_fd >= 0;
+    if (!creator && errno == EEXIST) {
+        m_fd = ::shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (m_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+    }
+    try {
+        if (creator) {
+            // A process which has taken the segment over while this one
+            // was between shm_open() and the lock may have formatted it
+            try_lock_segment(true);
+            try {
+                if (!try_map()) {
+                    create(capacity);
+                }
+            } catch (...) {
+                unlock_segment();
+                throw;
+            }
+            unlock_segment();
+        } else {
+            attach(capacity);
+        }
+    } catch (...) {
+        if (m_base != nullptr) {
+            ::munmap(m_base, m_length);
+        }
+        ::close(m_fd);
+        if (creator) {
+            ::shm_unlink(name.c_str());
+        }
+        throw;
+    }
+}
+
+/*
+ * Destructor
+ * Detaches from the segment, which lives on until remove() is called
+ */
+TEMPLATE_DECL
+CLASS_NAME::~SharedHashMap()
+{
+    ::munmap(m_base, m_length);
+    ::close(m_fd);
+}
+
+/*
+ * Removes the segment name. Attached processes keep working with it.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::remove(const std::string& name)
+{
+    ::shm_unlink(name.c_str());
+}
+
+/*
+ * Insert
+ * Inserts the pair if there is no pair with the same key
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::insert(const key_type& key, const mapped_type& value)
+{
+    SharedBucket* b = bucket(m_hasher(key) % BUCKET_COUNT);
+    Lock lck(*this, &b->m_mutex, b);
+    if (*find_link(b, key) != 0) {
+        return false;
+    }
+    const std::uint64_t offset = allocate_node(value_type(key, value));
+    node_at(offset)->m_next = b->m_head;
+    b->m_head = offset;
+    ++b->m_size;
+    return true;
+}
+
+/*
+ * Insert or assign
+ * Inserts the pair if there is no pair with the same key or replaces
+ * the existing one with a new node otherwise
+ */
+TEMPLATE_DECL
+void CLASS_NAME::insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    SharedBucket* b = bucket(m_hasher(key) % BUCKET_COUNT);
+    Lock lck(*this, &b->m_mutex, b);
+    std::uint64_t* link = find_link(b, key);
+    const std::uint64_t old = *link;
+    const std::uint64_t offset = allocate_node(value_type(key, value));
+    if (old != 0) {
+        node_at(offset)->m_next = node_at(old)->m_next;
+        *link = offset;
+        free_node(old);
+    } else {
+        node_at(offset)->m_next = b->m_head;
+        b->m_head = offset;
+        ++b->m_size;
+    }
+}
+
+/*
+ * Erase
+ * Erases the pair with the key if such one exists
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::erase(const key_type& key)
+{
+    SharedBucket* b = bucket(m_hasher(key) % BUCKET_COUNT);
+    Lock lck(*this, &b->m_mutex, b);
+    std::uint64_t* link = find_link(b, key);
+    const std::uint64_t offset = *link;
+    if (offset == 0) {
+        return false;
+    }
+    *link = node_at(offset)->m_next;
+    --b->m_size;
+    free_node(offset);
+    return true;
+}
+
+/*
+ * Find
+ * Copies the mapped value of the key into value and returns true if
+ * the key exists, returns false otherwise
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::find(const key_type& key, mapped_type& value) const
+{
+    SharedBucket* b = bucket(m_hasher(key) % BUCKET_COUNT);
+    Lock lck(*this, &b->m_mutex, b);
+    const std::uint64_t offset = *find_link(b, key);
+    if (offset == 0) {
+        return false;
+    }
+    value = node_at(offset)->m_value.second;
+    return true;
+}
+
+/*
+ * Returns the number of pairs in the segment
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::size() const
+{
+    size_type s = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        SharedBucket* b = bucket(i);
+        Lock lck(*this, &b->m_mutex, b);
+        s += b->m_size;
+    }
+    return s;
+}
+
+/*
+ * Returns true if the container is empty and false otherwise
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return size() == 0;
+}
+
+/*
+ * Returns how many locks this process took over from dead processes
+ */
+TEMPLATE_DECL
+std::size_t CLASS_NAME::recovered_locks() const
+{
+    return m_recovered_locks.load();
+}
+
+TEMPLATE_DECL
+CLASS_NAME::Lock::Lock(const SharedHashMap& map, pthread_mutex_t* mutex, SharedBucket* bucket)
+    : m_mutex(mutex)
+{
+    const int result = ::pthread_mutex_lock(m_mutex);
+    if (result == EOWNERDEAD) {
+        if (bucket != nullptr) {
+            map.repair(bucket);
+        }
+        ::pthread_mutex_consistent(m_mutex);
+        map.m_recovered_locks.fetch_add(1);
+    } else if (result != 0) {
+        throw std::system_error(result, std::generic_category(), "pthread_mutex_lock");
+    }
+}
+
+TEMPLATE_DECL
+CLASS_NAME::Lock::~Lock()
+{
+    ::pthread_mutex_unlock(m_mutex);
+}
+
+/*
+ * Distance between two neighbouring nodes in the node area
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::node_stride()
+{
+    const std::uint64_t align = alignof(node_type);
+    return (sizeof(node_type) + align - 1) / align * align;
+}
+
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::buckets_offset()
+{
+    const std::uint64_t align = alignof(SharedBucket);
+    return (sizeof(SharedHeader) + align - 1) / align * align;
+}
+
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::nodes_offset()
+{
+    const std::uint64_t buckets_end = buckets_offset() + BUCKET_COUNT * sizeof(SharedBucket);
+    const std::uint64_t page = static_cast<std::uint64_t>(::sysconf(_SC_PAGESIZE));
+    return (buckets_end + page - 1) / page * page;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::init_mutex(pthread_mutex_t* mutex)
+{
+    pthread_mutexattr_t attr;
+    ::pthread_mutexattr_init(&attr);
+    ::pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    ::pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    ::pthread_mutex_init(mutex, &attr);
+    ::pthread_mutexattr_destroy(&attr);
+}
+
+/*
+ * Sizes and formats a new segment, then lets other processes use it
+ */
+TEMPLATE_DECL
+void CLASS_NAME::create(std::uint64_t capacity)
+{
+    if (capacity < nodes_offset() + node_stride()) {
+        throw std::invalid_argument("SharedHashMap capacity is too small");
+    }
+    if (::ftruncate(m_fd, static_cast<off_t>(capacity)) != 0) {
+        throw std::system_error(errno, std::generic_category(), "ftruncate " + m_name);
+    }
+    m_length = capacity;
+    void* base = ::mmap(nullptr, m_length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (base == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + m_name);
+    }
+    m_base = static_cast<char*>(base);
+    m_header = new (m_base) SharedHeader();
+    m_header->m_magic = MAGIC;
+    m_header->m_bucket_count = BUCKET_COUNT;
+    m_header->m_node_size = node_stride();
+    m_header->m_capacity = capacity;
+    init_mutex(&m_header->m_alloc_mutex);
+    m_header->m_top = nodes_offset();
+    m_header->m_free = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        SharedBucket* b = new (m_base + buckets_offset() + i * sizeof(SharedBucket)) SharedBucket();
+        init_mutex(&b->m_mutex);
+        b->m_head = 0;
+        b->m_size = 0;
+    }
+    m_header->m_state.store(SharedHeader::READY, std::memory_order_release);
+}
+
+/*
+ * Maps an existing segment, waiting for its creator to finish. The lock
+ * of the segment is free while it is not ready only if the creator has
+ * died, then this process formats the segment with the given capacity.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::attach(std::uint64_t capacity)
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(ATTACH_TIMEOUT_MS);
+    while (!try_map()) {
+        if (try_lock_segment(false)) {
+            try {
+                if (!try_map()) {
+                    if (capacity < nodes_offset() + node_stride()) {
+                        throw std::runtime_error("Shared memory segment was left unformatted: " + m_name);
+                    }
+                    create(capacity);
+                }
+            } catch (...) {
+                unlock_segment();
+                throw;
+            }
+            unlock_segment();
+            return;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+            throw std::runtime_error("Timed out waiting for the creator of the shared memory segment: " + m_name);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+/*
+ * Maps the segment if it is ready and checks that it matches the map
+ * type. Returns false, with nothing mapped, if it is not ready yet.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::try_map()
+{
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0) {
+        throw std::system_error(errno, std::generic_category(), "fstat " + m_name);
+    }
+    if (st.st_size == 0) {
+        return false;
+    }
+    m_length = static_cast<std::uint64_t>(st.st_size);
+    void* base = ::mmap(nullptr, m_length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (base == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + m_name);
+    }
+    m_base = static_cast<char*>(base);
+    m_header = reinterpret_cast<SharedHeader*>(m_base);
+    if (m_header->m_state.load(std::memory_order_acquire) != SharedHeader::READY) {
+        ::munmap(m_base, m_length);
+        m_base = nullptr;
+        m_header = nullptr;
+        return false;
+    }
+    if (m_header->m_magic != MAGIC ||
+        m_header->m_bucket_count != BUCKET_COUNT ||
+        m_header->m_node_size != node_stride() ||
+        m_header->m_capacity != m_length) {
+        throw std::runtime_error("Shared memory segment does not match the map type: " + m_name);
+    }
+    return true;
+}
+
+/*
+ * Takes the exclusive lock of the segment which its creator holds while
+ * it formats the segment. Without wait returns false if it is taken.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::try_lock_segment(bool wait)
+{
+    while (::flock(m_fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) != 0) {
+        if (errno == EWOULDBLOCK && !wait) {
+            return false;
+        }
+        if (errno != EINTR) {
+            throw std::system_error(errno, std::generic_category(), "flock " + m_name);
+        }
+    }
+    return true;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::unlock_segment()
+{
+    ::flock(m_fd, LOCK_UN);
+}
+
+/*
+ * Repairs the chain of a bucket whose lock owner died: cuts the chain at
+ * the first link which does not point to an allocated node and recounts
+ * it. Every change is a single store, so this only guards against links
+ * into the node area which the owner had not finished writing.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::repair(SharedBucket* bucket) const
+{
+    const std::uint64_t first = nodes_offset();
+    const std::uint64_t top = m_header->m_top;
+    const std::uint64_t limit = top > first ? (top - first) / node_stride() : 0;
+    std::uint64_t* link = &bucket->m_head;
+    std::uint64_t count = 0;
+    while (*link != 0) {
+        const std::uint64_t offset = *link;
+        if (offset < first || offset >= top || (offset - first) % node_stride() != 0 || count == limit) {
+            *link = 0;
+            break;
+        }
+        ++count;
+        link = &node_at(offset)->m_next;
+    }
+    bucket->m_size = count;
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::node_type* CLASS_NAME::node_at(std::uint64_t offset) const
+{
+    return reinterpret_cast<node_type*>(m_base + offset);
+}
+
+TEMPLATE_DECL
+SharedBucket* CLASS_NAME::bucket(std::size_t bucket_index) const
+{
+    return reinterpret_cast<SharedBucket*>(m_base + buckets_offset()) + bucket_index;
+}
+
+/*
+ * Returns the link which points to the node with the key, or the
+ * terminating zero link of the chain if there is no such node.
+ * The caller must hold the lock of the bucket.
+ */
+TEMPLATE_DECL
+std::uint64_t* CLASS_NAME::find_link(SharedBucket* bucket, const key_type& key) const
+{
+    std::uint64_t* link = &bucket->m_head;
+    while (*link != 0) {
+        node_type* node = node_at(*link);
+        if (m_key_equal(node->m_value.first, key)) {
+            break;
+        }
+        link = &node->m_next;
+    }
+    return link;
+}
+
+/*
+ * Takes a node from the free list or from the untouched tail of the
+ * node area and writes the pair to it. Throws std::bad_alloc when the
+ * segment is full.
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::allocate_node(const value_type& value)
+{
+    std::uint64_t offset = 0;
+    {
+        Lock lck(*this, &m_header->m_alloc_mutex, nullptr);
+        offset = m_header->m_free;
+        if (offset != 0) {
+            m_header->m_free = node_at(offset)->m_next;
+        } else {
+            offset = m_header->m_top;
+            if (offset + node_stride() > m_length) {
+                throw std::bad_alloc();
+            }
+            m_header->m_top = offset + node_stride();
+        }
+    }
+    node_at(offset)->m_value = value;
+    node_at(offset)->m_next = 0;
+    return offset;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::free_node(std::uint64_t offset)
+{
+    Lock lck(*this, &m_header->m_alloc_mutex, nullptr);
+    node_at(offset)->m_next = m_header->m_free;
+    m_header->m_free = offset;
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+
+namespace thread_safe {
+
+/*
+ * A node of SharedValueHashMap. The value block is swapped with the
+ * atomic shared_ptr functions, so it may be replaced while readers walk
+ * the chain.
+ */
+template <typename KeyT, typename MappedT>
+struct SharedValueNode
+{
+    SharedValueNode(const KeyT& key, std::shared_ptr<const MappedT> value)
+        : m_next(nullptr)
+        , m_key(key)
+        , m_value(std::move(value))
+    {}
+
+    SharedValueNode* m_next;
+    const KeyT m_key;
+    std::shared_ptr<const MappedT> m_value;
+};
+
+/*
+ * A HashMap variant for large mapped values, such as blobs of several KB,
+ * which cannot live in a std::atomic and are too costly to copy on every
+ * lookup. A node holds a reference counted pointer to an immutable value
+ * block. Readers get a handle to the block without copying it, and the
+ * block stays alive as long as a handle refers to it, even after the
+ * pair is replaced or erased.
+ * Lookups and replacements of existing values hold the bucket lock in
+ * shared mode, as they do not change the chain, so writers replacing
+ * values never block readers. Only adding and removing pairs lock the
+ * bucket exclusively.
+ */
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT = std::hash<KeyT>,
+          typename KeyEqualT = std::equal_to<KeyT> >
+class SharedValueHashMap
+{
+public:
+    typedef KeyT key_type;
+    typedef MappedT mapped_type;
+    typedef std::shared_ptr<const MappedT> value_handle;
+    typedef std::size_t size_type;
+    typedef HashT hasher;
+    typedef KeyEqualT key_equal;
+
+    /* Constructors */
+public:
+    explicit SharedValueHashMap(const hasher& hash = hasher());
+    SharedValueHashMap(const SharedValueHashMap&) = delete;
+    SharedValueHashMap& operator= (const SharedValueHashMap&) = delete;
+    ~SharedValueHashMap();
+
+    /* Mutators */
+public:
+    bool insert(const key_type& key, value_handle value);
+    void insert_or_assign(const key_type& key, value_handle value);
+    bool assign(const key_type& key, value_handle value);
+    template <typename UpdateT>
+    bool update(const key_type& key, UpdateT update);
+    bool erase(const key_type& key);
+    void clear();
+
+    /* Selectors */
+public:
+    value_handle find(const key_type& key) const;
+    template <typename FnT>
+    void for_each(FnT fn) const;
+    size_type size() const;
+    bool empty() const;
+
+    /* Private members and helper functions */
+private:
+    typedef SharedValueNode<key_type, mapped_type> node_type;
+
+    struct SharedValueBucket
+    {
+        SharedValueBucket()
+            : m_head(nullptr)
+            , m_size(0)
+        {}
+
+        mutable std::shared_timed_mutex m_mutex;
+        node_type* m_head;
+        size_type m_size;
+    };
+
+    SharedValueBucket& bucket(const key_type& key) const;
+    node_type** find_link(const SharedValueBucket& bucket, const key_type& key) const;
+
+private:
+    std::unique_ptr<SharedValueBucket[]> m_buckets;
+    hasher m_hasher;
+    key_equal m_key_equal;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME SharedValueHashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT>
+
+TEMPLATE_DECL
+CLASS_NAME::SharedValueHashMap(const hasher& hash)
+    : m_buckets(new SharedValueBucket[BUCKET_COUNT])
+    , m_hasher(hash)
+    , m_key_equal()
+{}
+
+TEMPLATE_DECL
+CLASS_NAME::~SharedValueHashMap()
+{
+    clear();
+}
+
+/*
+ * Insertion
+ * Returns false if there already is a pair with the key
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::insert(const key_type& key, value_handle value)
+{
+    SharedValueBucket& b = bucket(key);
+    std::lock_guard<std::shared_timed_mutex> lck(b.m_mutex);
+    node_type** link = find_link(b, key);
+    if (*link != nullptr) {
+        return false;
+    }
+    *link = new node_type(key, std::move(value));
+    ++b.m_size;
+    return true;
+}
+
+/*
+ * Replaces the value block of the key, or inserts the pair if there is
+ * none. The bucket is only locked exclusively if the key is new.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::insert_or_assign(const key_type& key, value_handle value)
+{
+    if (assign(key, value)) {
+        return;
+    }
+    SharedValueBucket& b = bucket(key);
+    std::lock_guard<std::shared_timed_mutex> lck(b.m_mutex);
+    node_type** link = find_link(b, key);
+    if (*link != nullptr) {
+        std::atomic_store(&(*link)->m_value, std::move(value));
+        return;
+    }
+    *link = new node_type(key, std::move(value));
+    ++b.m_size;
+}
+
+/*
+ * Replaces the value block of the key without blocking readers of the
+ * bucket. The old block is released when its last handle goes away.
+ * Returns false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::assign(const key_type& key, value_handle value)
+{
+    const SharedValueBucket& b = bucket(key);
+    std::shared_lock<std::shared_timed_mutex> lck(b.m_mutex);
+    node_type* node = *find_link(b, key);
+    if (node == nullptr) {
+        return false;
+    }
+    std::atomic_store(&node->m_value, std::move(value));
+    return true;
+}
+
+/*
+ * Copy on write update
+ * Replaces the value block of the key with update(const mapped_type&),
+ * which returns the new block as a value_handle. If another writer
+ * replaces the block meanwhile, update is called again with the newer
+ * block, so no change is lost. Readers are never blocked.
+ * Returns false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+template <typename UpdateT>
+bool CLASS_NAME::update(const key_type& key, UpdateT update)
+{
+    const SharedValueBucket& b = bucket(key);
+    std::shared_lock<std::shared_timed_mutex> lck(b.m_mutex);
+    node_type* node = *find_link(b, key);
+    if (node == nullptr) {
+        return false;
+    }
+    value_handle expected = std::atomic_load(&node->m_value);
+    for (;;) {
+        value_handle desired = update(*expected);
+        if (std::atomic_compare_exchange_strong(&node->m_value, &expected, desired)) {
+            return true;
+        }
+    }
+}
+
+/*
+ * Deletion
+ * Handles to the value block stay valid. Returns false if there is no
+ * pair with the key.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::erase(const key_type& key)
+{
+    SharedValueBucket& b = bucket(key);
+    std::lock_guard<std::shared_timed_mutex> lck(b.m_mutex);
+    node_type** link = find_link(b, key);
+    node_type* node = *link;
+    if (node == nullptr) {
+        return false;
+    }
+    *link = node->m_next;
+    delete node;
+    --b.m_size;
+    return true;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::clear()
+{
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        SharedValueBucket& b = m_buckets[i];
+        std::lock_guard<std::shared_timed_mutex> lck(b.m_mutex);
+        while (b.m_head != nullptr) {
+            node_type* node = b.m_head;
+            b.m_head = node->m_next;
+            delete node;
+        }
+        b.m_size = 0;
+    }
+}
+
+/*
+ * Returns a handle to the value block of the key, or an empty handle if
+ * there is no pair with the key. The block is not copied.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::value_handle CLASS_NAME::find(const key_type& key) const
+{
+    const SharedValueBucket& b = bucket(key);
+    std::shared_lock<std::shared_timed_mutex> lck(b.m_mutex);
+    const node_type* node = *find_link(b, key);
+    if (node == nullptr) {
+        return value_handle();
+    }
+    return std::atomic_load(&node->m_value);
+}
+
+/*
+ * Calls fn(const key_type&, const value_handle&) with every pair, each
+ * bucket being locked in shared mode while its pairs are visited
+ */
+TEMPLATE_DECL
+template <typename FnT>
+void CLASS_NAME::for_each(FnT fn) const
+{
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        const SharedValueBucket& b = m_buckets[i];
+        std::shared_lock<std::shared_timed_mutex> lck(b.m_mutex);
+        for (const node_type* node = b.m_head; node != nullptr; node = node->m_next) {
+            fn(node->m_key, std::atomic_load(&node->m_value));
+        }
+    }
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::size() const
+{
+    size_type s = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        std::shared_lock<std::shared_timed_mutex> lck(m_buckets[i].m_mutex);
+        s += m_buckets[i].m_size;
+    }
+    return s;
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return size() == 0;
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::SharedValueBucket& CLASS_NAME::bucket(const key_type& key) const
+{
+    return m_buckets[m_hasher(key) % BUCKET_COUNT];
+}
+
+/*
+ * Returns the link which points to the node with the key, or the null
+ * link at the end of the chain if there is none. The bucket must be
+ * locked, in shared mode at least.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::node_type** CLASS_NAME::find_link(const SharedValueBucket& bucket, const key_type& key) const
+{
+    node_type** link = const_cast<node_type**>(&bucket.m_head);
+    while (*link != nullptr && !m_key_equal((*link)->m_key, key)) {
+        link = &(*link)->m_next;
+    }
+    return link;
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
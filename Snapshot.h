@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <unistd.h>
+
+#include "FileIO.h"
+#include "HashMap.h"
+
+namespace thread_safe {
+
+namespace detail {
+
+/*
+ * Splits the items into at most thread_count contiguous ranges of about
+ * the same total weight and calls fn(first, last) for every range, each
+ * on its own thread
+ */
+template <typename FnT>
+void for_each_range(const std::vector<std::uint64_t>& weights, std::size_t thread_count, FnT fn)
+{
+    thread_count = std::max<std::size_t>(1, std::min<std::size_t>(thread_count, weights.size()));
+    std::uint64_t total = 0;
+    for (const auto weight : weights) {
+        total += weight;
+    }
+    std::vector<std::size_t> bounds(1, 0);
+    const std::uint64_t per_thread = total / thread_count + 1;
+    std::uint64_t accumulated = 0;
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        accumulated += weights[i];
+        if (accumulated >= per_thread * bounds.size() && bounds.size() < thread_count) {
+            bounds.push_back(i + 1);
+        }
+    }
+    bounds.push_back(weights.size());
+
+    std::vector<std::thread> threads;
+    for (std::size_t t = 1; t + 1 < bounds.size(); ++t) {
+        threads.emplace_back(fn, bounds[t], bounds[t + 1]);
+    }
+    fn(bounds[0], bounds[1]);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+} // namespace detail
+
+/*
+ * The header of a snapshot file. It is followed by a section table with
+ * an entry per bucket and then by the sections themselves, each being
+ * the packed pairs of one bucket.
+ */
+struct SnapshotHeader
+{
+    std::uint64_t m_magic;
+    std::uint64_t m_bucket_count;
+    std::uint64_t m_record_size;
+    std::uint64_t m_size;
+};
+
+struct SnapshotSection
+{
+    std::uint64_t m_offset;
+    std::uint64_t m_count;
+};
+
+/*
+ * Writes a HashMap to a snapshot file and loads it back.
+ * Loading does not go through insert(): the file is mapped, the buckets
+ * are split between threads in portions of about the same number of
+ * pairs, and every thread builds its chains directly without locking.
+ * If the snapshot was written by a map with another number of buckets,
+ * the pairs are inserted into their new buckets, still in parallel.
+ * Keys and mapped values are stored bytewise, so both must be trivially
+ * copyable.
+ */
+template <typename MapT>
+class Snapshot;
+
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT,
+          typename KeyEqualT>
+class Snapshot<HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> >
+{
+    static_assert(std::is_trivially_copyable<KeyT>::value &&
+                  std::is_trivially_copyable<MappedT>::value,
+                  "Snapshot stores only trivially copyable types");
+
+public:
+    typedef HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> map_type;
+    typedef Pair<KeyT, MappedT> record_type;
+
+    static const std::uint64_t MAGIC = 0x48534e4150763031ull; // "HSNAPv01"
+
+public:
+    static void save(const map_type& map, const std::string& path);
+    static void load(map_type& map,
+                     const std::string& path,
+                     std::size_t thread_count = std::thread::hardware_concurrency());
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME Snapshot<HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> >
+
+/*
+ * Save
+ * Every bucket is locked while its section is written, so each section
+ * is consistent on its own
+ */
+TEMPLATE_DECL
+void CLASS_NAME::save(const map_type& map, const std::string& path)
+{
+    const detail::OutputFile file(path);
+    std::lock_guard<std::recursive_mutex> lck(map.m_mutex);
+    std::vector<SnapshotSection> sections(BUCKET_COUNT);
+    std::vector<record_type> buffer;
+    off_t offset = sizeof(SnapshotHeader) + BUCKET_COUNT * sizeof(SnapshotSection);
+    std::uint64_t size = 0;
+    for (std::size_t i = 0; i < BUCKET_COUNT; ++i) {
+        detail::bucket_records(map.m_buckets[i], buffer);
+        sections[i].m_offset = offset;
+        sections[i].m_count = buffer.size();
+        detail::write_section<record_type>(file.fd(), buffer.data(), buffer.size(), offset);
+        size += buffer.size();
+    }
+    SnapshotHeader header;
+    header.m_magic = MAGIC;
+    header.m_bucket_count = BUCKET_COUNT;
+    header.m_record_size = sizeof(record_type);
+    header.m_size = size;
+    detail::write_table(file.fd(), header, sections);
+}
+
+/*
+ * Load
+ * Replaces the contents of the map with the snapshot. The map must not
+ * be used by other threads until the load returns.
+ */
+TEMPLATE_DECL
+void CLASS_NAME::load(map_type& map, const std::string& path, std::size_t thread_count)
+{
+    const detail::MappedFile file(path);
+    const char* data = file.data();
+    const std::size_t length = file.size();
+
+    const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(data);
+    if (length < sizeof(SnapshotHeader) ||
+        header->m_magic != MAGIC ||
+        header->m_record_size != sizeof(record_type) ||
+        !detail::fits(length, sizeof(SnapshotHeader), header->m_bucket_count, sizeof(SnapshotSection))) {
+        throw std::runtime_error("Not a snapshot of this map type: " + path);
+    }
+    const std::size_t section_count = static_cast<std::size_t>(header->m_bucket_count);
+    const SnapshotSection* sections = reinterpret_cast<const SnapshotSection*>(data + sizeof(SnapshotHeader));
+    std::vector<std::uint64_t> counts(section_count);
+    for (std::size_t i = 0; i < section_count; ++i) {
+        if (!detail::fits(length, sections[i].m_offset, sections[i].m_count, sizeof(record_type))) {
+            throw std::runtime_error("Truncated snapshot: " + path);
+        }
+        counts[i] = sections[i].m_count;
+    }
+
+    map.clear();
+    const bool same_layout = section_count == BUCKET_COUNT;
+    detail::for_each_range(counts, thread_count, [&](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; ++i) {
+            detail::for_each_record<record_type>(data + sections[i].m_offset, sections[i].m_count,
+                [&map, i, same_layout](const record_type& value) {
+                    if (same_layout) {
+                        map.m_buckets[i].append_unlocked(typename map_type::value_type(value.first, value.second));
+                    } else {
+                        map.insert(value.first, value.second);
+                    }
+                });
+        }
+    });
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "HashMap.h"
+
+namespace thread_safe {
+
+/*
+ * Reads and writes a fixed set of keys of a HashMap as one atomic step,
+ * e.g. to move an amount from one key to another.
+ * The keys are given up front. Writes are kept in the transaction and
+ * applied by commit() while the buckets of all keys are locked, in the
+ * order of their bucket indices, so two transactions never deadlock and
+ * no reader of a single bucket sees a commit half applied.
+ * A PESSIMISTIC transaction locks the buckets when it is created, so its
+ * reads see a state nobody else can change, and commit() always
+ * succeeds. An OPTIMISTIC transaction locks nothing until commit():
+ * every read notes the version of its bucket, and commit() fails,
+ * dropping the writes, if one of those buckets has changed since. The
+ * caller then starts a new transaction.
+ * While a pessimistic transaction is open its thread must not use the
+ * map other than through the transaction.
+ */
+template <typename MapT>
+class Transaction;
+
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT,
+          typename KeyEqualT>
+class Transaction<HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> >
+{
+public:
+    typedef HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> map_type;
+    typedef KeyT key_type;
+    typedef MappedT mapped_type;
+
+    enum Mode
+    {
+        PESSIMISTIC,
+        OPTIMISTIC
+    };
+
+public:
+    Transaction(map_type& map, const std::vector<key_type>& keys, Mode mode = PESSIMISTIC);
+    Transaction(const Transaction&) = delete;
+    Transaction& operator= (const Transaction&) = delete;
+    ~Transaction();
+
+    bool find(const key_type& key, mapped_type& value);
+    void insert_or_assign(const key_type& key, const mapped_type& value);
+    void erase(const key_type& key);
+    bool commit();
+
+private:
+    typedef typename map_type::bucket_type bucket_type;
+
+    /*
+     * A bucket of one of the keys and, for an optimistic transaction
+     * which has read from it, the version it had then
+     */
+    struct BucketState
+    {
+        std::size_t m_index;
+        bool m_read;
+        std::uint64_t m_version;
+    };
+
+    struct Write
+    {
+        key_type m_key;
+        bool m_erase;
+        mapped_type m_value;
+    };
+
+    BucketState& state_of(const key_type& key);
+    void lock_buckets();
+    void unlock_buckets();
+    void check_open() const;
+
+private:
+    map_type& m_map;
+    Mode m_mode;
+    std::vector<key_type> m_keys;
+    std::vector<BucketState> m_buckets;
+    std::vector<Write> m_writes;
+    bool m_locked;
+    bool m_conflict;
+    bool m_done;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME Transaction<HashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT> >
+
+/*
+ * Constructor
+ * Collects the buckets of the keys in the order of their indices and
+ * locks them if the transaction is pessimistic
+ */
+TEMPLATE_DECL
+CLASS_NAME::Transaction(map_type& map, const std::vector<key_type>& keys, Mode mode)
+    : m_map(map)
+    , m_mode(mode)
+    , m_keys(keys)
+    , m_buckets()
+    , m_writes()
+    , m_locked(false)
+    , m_conflict(false)
+    , m_done(false)
+{
+    m_buckets.reserve(keys.size());
+    m_writes.reserve(keys.size());
+    for (const auto& key : keys) {
+        const BucketState state = { m_map.m_hasher(key) % BUCKET_COUNT, false, 0 };
+        m_buckets.push_back(state);
+    }
+    std::sort(m_buckets.begin(), m_buckets.end(), [](const BucketState& a, const BucketState& b) {
+        return a.m_index < b.m_index;
+    });
+    m_buckets.erase(std::unique(m_buckets.begin(), m_buckets.end(), [](const BucketState& a, const BucketState& b) {
+        return a.m_index == b.m_index;
+    }), m_buckets.end());
+    if (m_mode == PESSIMISTIC) {
+        lock_buckets();
+    }
+}
+
+/*
+ * Destructor
+ * Drops the writes of a transaction which was not committed
+ */
+TEMPLATE_DECL
+CLASS_NAME::~Transaction()
+{
+    unlock_buckets();
+}
+
+/*
+ * Copies the mapped value of the key to value, as the transaction sees
+ * it: the value written by the transaction itself if there is one.
+ * Returns false if there is no pair with the key.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::find(const key_type& key, mapped_type& value)
+{
+    check_open();
+    BucketState& state = state_of(key);
+    for (auto write = m_writes.rbegin(); write != m_writes.rend(); ++write) {
+        if (KeyEqualT()(write->m_key, key)) {
+            if (!write->m_erase) {
+                value = write->m_value;
+            }
+            return !write->m_erase;
+        }
+    }
+    const bucket_type& bucket = m_map.m_buckets[state.m_index];
+    std::unique_lock<const bucket_type> lck(bucket, std::defer_lock);
+    if (!m_locked) {
+        lck.lock();
+        const std::uint64_t version = bucket.version();
+        if (state.m_read && state.m_version != version) {
+            // The reads of the bucket are not consistent with each other
+            m_conflict = true;
+        }
+        if (!state.m_read) {
+            state.m_read = true;
+            state.m_version = version;
+        }
+    }
+    const Node<typename map_type::value_type>* node = bucket.find_unlocked(key);
+    if (node == bucket.end()) {
+        return false;
+    }
+    value = node->m_value.load().second;
+    return true;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    check_open();
+    state_of(key);
+    const Write write = { key, false, value };
+    m_writes.push_back(write);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::erase(const key_type& key)
+{
+    check_open();
+    state_of(key);
+    const Write write = { key, true, mapped_type() };
+    m_writes.push_back(write);
+}
+
+/*
+ * Commit
+ * Locks the buckets unless they are locked already, checks that none
+ * read by an optimistic transaction has changed, applies the writes in
+ * the order they were made and unlocks the buckets.
+ * Returns false, with nothing applied, if the validation fails.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::commit()
+{
+    check_open();
+    m_done = true;
+    if (m_conflict) {
+        unlock_buckets();
+        return false;
+    }
+    lock_buckets();
+    for (const auto& state : m_buckets) {
+        if (state.m_read && m_map.m_buckets[state.m_index].version() != state.m_version) {
+            unlock_buckets();
+            return false;
+        }
+    }
+    for (const auto& write : m_writes) {
+        bucket_type& bucket = m_map.m_buckets[m_map.m_hasher(write.m_key) % BUCKET_COUNT];
+        if (write.m_erase) {
+            bucket.erase_unlocked(write.m_key);
+        } else {
+            bucket.insert_or_assign_unlocked(typename map_type::value_type(write.m_key, write.m_value));
+        }
+    }
+    unlock_buckets();
+    return true;
+}
+
+/*
+ * Returns the bucket state of the key.
+ * Throws std::invalid_argument if the key is not one of the transaction.
+ */
+TEMPLATE_DECL
+typename CLASS_NAME::BucketState& CLASS_NAME::state_of(const key_type& key)
+{
+    const bool known = std::any_of(m_keys.begin(), m_keys.end(), [&key](const key_type& k) {
+        return KeyEqualT()(k, key);
+    });
+    if (!known) {
+        throw std::invalid_argument("Transaction: the key was not given to the transaction");
+    }
+    const std::size_t index = m_map.m_hasher(key) % BUCKET_COUNT;
+    return *std::lower_bound(m_buckets.begin(), m_buckets.end(), index, [](const BucketState& state, std::size_t i) {
+        return state.m_index < i;
+    });
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::lock_buckets()
+{
+    if (m_locked) {
+        return;
+    }
+    for (const auto& state : m_buckets) {
+        m_map.m_buckets[state.m_index].lock();
+    }
+    m_locked = true;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::unlock_buckets()
+{
+    if (!m_locked) {
+        return;
+    }
+    for (auto state = m_buckets.rbegin(); state != m_buckets.rend(); ++state) {
+        m_map.m_buckets[state->m_index].unlock();
+    }
+    m_locked = false;
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::check_open() const
+{
+    if (m_done) {
+        throw std::logic_error("Transaction: already committed");
+    }
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#include "HashMap.h"
+
+namespace thread_safe {
+
+/*
+ * A mapped value with the version of the write which stored it. Both
+ * live in the same pair, so they are always read together.
+ */
+template <typename MappedT>
+struct Versioned
+{
+    MappedT m_value;
+    std::uint64_t m_version;
+};
+
+/*
+ * A HashMap whose pairs carry version stamps, for optimistic concurrency
+ * control in the application: read a value and its version, work on it
+ * without holding any lock, then store the result with put_if_version(),
+ * which fails if somebody else has written the key meanwhile.
+ * Every write takes the next value of a clock of the map, so the version
+ * of a key only grows, even across an erase and a new insert, and a
+ * stale version can never match again. Version 0 stands for an absent
+ * key.
+ * Maps which do not need versions use HashMap and pay nothing for them.
+ */
+template <typename KeyT,
+          typename MappedT,
+          std::size_t BUCKET_COUNT,
+          typename HashT = std::hash<KeyT>,
+          typename KeyEqualT = std::equal_to<KeyT> >
+class VersionedHashMap
+{
+public:
+    typedef KeyT key_type;
+    typedef MappedT mapped_type;
+    typedef std::size_t size_type;
+    typedef HashT hasher;
+    typedef HashMap<KeyT, Versioned<MappedT>, BUCKET_COUNT, HashT, KeyEqualT> map_type;
+
+    /* Constructors */
+public:
+    explicit VersionedHashMap(const hasher& hash = hasher());
+    VersionedHashMap(const VersionedHashMap&) = delete;
+    VersionedHashMap& operator= (const VersionedHashMap&) = delete;
+
+    /* Mutators */
+public:
+    bool insert(const key_type& key, const mapped_type& value);
+    std::uint64_t insert_or_assign(const key_type& key, const mapped_type& value);
+    bool put_if_version(const key_type& key, const mapped_type& value, std::uint64_t expected_version);
+    void erase(const key_type& key);
+    void clear();
+
+    /* Selectors */
+public:
+    bool find(const key_type& key, mapped_type& value, std::uint64_t& version) const;
+    std::uint64_t version(const key_type& key) const;
+    size_type size() const;
+    bool empty() const;
+
+    /* Private members and helper functions */
+private:
+    std::uint64_t next_version();
+
+private:
+    map_type m_map;
+    std::atomic<std::uint64_t> m_clock;
+};
+
+
+/* Implementation of member functions */
+#define TEMPLATE_DECL template <typename KeyT,\
+                                typename MappedT,\
+                                std::size_t BUCKET_COUNT,\
+                                typename HashT,\
+                                typename KeyEqualT>
+#define CLASS_NAME VersionedHashMap<KeyT, MappedT, BUCKET_COUNT, HashT, KeyEqualT>
+
+TEMPLATE_DECL
+CLASS_NAME::VersionedHashMap(const hasher& hash)
+    : m_map(hash)
+    , m_clock(0)
+{}
+
+/*
+ * Insertion
+ * Returns false if there already is a pair with the key
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::insert(const key_type& key, const mapped_type& value)
+{
+    return put_if_version(key, value, 0);
+}
+
+/*
+ * Insert or assign
+ * Stores the value with a new version whatever the current version is,
+ * and returns the new version
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::insert_or_assign(const key_type& key, const mapped_type& value)
+{
+    std::uint64_t version = 0;
+    for (;;) {
+        const bool inserted = m_map.get_or_insert_with(key, [this, &value, &version]() {
+            version = next_version();
+            return Versioned<mapped_type>{value, version};
+        }).second;
+        if (inserted) {
+            return version;
+        }
+        const bool assigned = m_map.update_if(key, [this, &value, &version](Versioned<mapped_type>& current) {
+            version = next_version();
+            current.m_value = value;
+            current.m_version = version;
+            return true;
+        });
+        if (assigned) {
+            return version;
+        }
+        // The key was erased in between
+    }
+}
+
+/*
+ * Conditional put
+ * Stores the value with a new version if the version of the key is
+ * still expected_version, or inserts it if expected_version is 0 and
+ * there is no pair with the key. Returns false, changing nothing, if
+ * the key has another version.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::put_if_version(const key_type& key, const mapped_type& value, std::uint64_t expected_version)
+{
+    if (expected_version == 0) {
+        return m_map.get_or_insert_with(key, [this, &value]() {
+            return Versioned<mapped_type>{value, next_version()};
+        }).second;
+    }
+    return m_map.update_if(key, [this, &value, expected_version](Versioned<mapped_type>& current) {
+        if (current.m_version != expected_version) {
+            return false;
+        }
+        current.m_value = value;
+        current.m_version = next_version();
+        return true;
+    });
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::erase(const key_type& key)
+{
+    m_map.erase(key);
+}
+
+TEMPLATE_DECL
+void CLASS_NAME::clear()
+{
+    m_map.clear();
+}
+
+/*
+ * Copies the mapped value of the key to value and its version to
+ * version. Returns false, with version set to 0, if there is no pair
+ * with the key.
+ */
+TEMPLATE_DECL
+bool CLASS_NAME::find(const key_type& key, mapped_type& value, std::uint64_t& version) const
+{
+    version = 0;
+    return m_map.visit(key, [&value, &version](const typename map_type::value_type& pair) {
+        value = pair.second.m_value;
+        version = pair.second.m_version;
+    });
+}
+
+/*
+ * Returns the version of the key, 0 if there is no pair with the key
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::version(const key_type& key) const
+{
+    std::uint64_t version = 0;
+    m_map.visit(key, [&version](const typename map_type::value_type& pair) {
+        version = pair.second.m_version;
+    });
+    return version;
+}
+
+TEMPLATE_DECL
+typename CLASS_NAME::size_type CLASS_NAME::size() const
+{
+    return m_map.size();
+}
+
+TEMPLATE_DECL
+bool CLASS_NAME::empty() const
+{
+    return m_map.empty();
+}
+
+/*
+ * Called with the bucket of the written key locked, so the versions of
+ * one key are taken in the order of its writes
+ */
+TEMPLATE_DECL
+std::uint64_t CLASS_NAME::next_version()
+{
+    return m_clock.fetch_add(1, std::memory_order_relaxed) + 1;
+}
+
+#undef TEMPLATE_DECL
+#undef CLASS_NAME
+
+} // namespace thread_safe
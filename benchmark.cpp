@@ -0,0 +1,7 @@
+#include "HashMap.h"
+#include "benchmark.h"
+
+int main()
+{
+    benchmark();
+}
@@ -0,0 +1,839 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "ArenaHashMap.h"
+#include "CompactHashMap.h"
+#include "FixedString.h"
+#include "HashMap.h"
+#include "OrderedIndex.h"
+#include "PerCpuHashMap.h"
+#include "PrefixIndex.h"
+#include "SharedValueHashMap.h"
+#include "Transaction.h"
+
+#define REPORT(text, operations, seconds) \
+std::cout << std::left << std::setw(40) << (text) \
+          << std::right << std::setw(10) << std::fixed << std::setprecision(2) \
+          << (operations) / (seconds) / 1e6 << " Mops/s" << std::endl;
+
+// Results of the measured loops go here, so they are not optimized away
+std::atomic<std::uint64_t> g_sink(0);
+
+/*
+ * Runs fn(thread_index) on thread_count threads at once and returns the
+ * wall time in seconds
+ */
+template <typename FnT>
+double run_threads(std::size_t thread_count, FnT fn)
+{
+    std::vector<std::thread> threads;
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t t = 0; t < thread_count; ++t) {
+        threads.emplace_back(fn, t);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Pins the calling thread to the CPUs of a NUMA node
+ */
+void pin_to_numa_node(int node)
+{
+    const std::vector<int> cpus = thread_safe::detail::numa_node_cpus(node);
+    if (cpus.empty()) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * Lookups from threads pinned to the sockets in turn. In partition mode
+ * every thread looks up the keys of the buckets of its own socket, which
+ * is the access pattern the mode is made for.
+ */
+void benchmark_numa()
+{
+    const std::size_t bucket_count = 1 << 20;
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, bucket_count> Map;
+    const std::uint32_t key_count = 1 << 22;
+    const std::size_t lookups = 1 << 22;
+    const std::size_t thread_count = std::thread::hardware_concurrency();
+    const int node_count = thread_safe::detail::numa_node_count();
+
+    const thread_safe::MemoryOptions::Numa modes[] = { thread_safe::MemoryOptions::NUMA_NONE,
+                                                       thread_safe::MemoryOptions::NUMA_INTERLEAVE,
+                                                       thread_safe::MemoryOptions::NUMA_PARTITION };
+    const char* names[] = { "NUMA none", "NUMA interleave", "NUMA partition" };
+    for (int m = 0; m < 3; ++m) {
+        Map* map = new Map(thread_safe::MemoryOptions(modes[m]));
+        run_threads(thread_count, [&](std::size_t t) {
+            const int node = static_cast<int>(t % node_count);
+            pin_to_numa_node(node);
+            for (std::uint32_t key = static_cast<std::uint32_t>(t); key < key_count; key += thread_count) {
+                map->insert(key, key);
+            }
+        });
+        const double seconds = run_threads(thread_count, [&](std::size_t t) {
+            const int node = static_cast<int>(t % node_count);
+            pin_to_numa_node(node);
+            std::mt19937 random(static_cast<std::uint32_t>(t));
+            const std::uint32_t first = static_cast<std::uint32_t>(bucket_count * node / node_count);
+            const std::uint32_t last = static_cast<std::uint32_t>(bucket_count * (node + 1) / node_count);
+            std::uniform_int_distribution<std::uint32_t> bucket(first, last - 1);
+            std::uniform_int_distribution<std::uint32_t> any(0, key_count - 1);
+            std::uint64_t sum = 0;
+            for (std::size_t i = 0; i < lookups; ++i) {
+                // With the identity hash a key lands in the bucket key % bucket_count
+                const std::uint32_t key = modes[m] == thread_safe::MemoryOptions::NUMA_PARTITION ?
+                    bucket(random) + bucket_count * (random() % (key_count / bucket_count)) :
+                    any(random);
+                sum += map->find(key)->get();
+            }
+            g_sink += sum;
+        });
+        REPORT(std::string("find, ") + names[m], static_cast<double>(lookups) * thread_count, seconds);
+        delete map;
+    }
+}
+
+/*
+ * All threads update the same few keys, with and without flat combining
+ */
+void benchmark_hot_keys()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1024> Map;
+    const std::size_t operations = 1 << 20;
+    const std::size_t thread_count = std::max(4u, std::thread::hardware_concurrency());
+    for (int combining = 0; combining < 2; ++combining) {
+        Map map;
+        map.set_flat_combining(combining != 0);
+        const double seconds = run_threads(thread_count, [&](std::size_t t) {
+            for (std::size_t i = 0; i < operations; ++i) {
+                map.insert_or_assign(static_cast<std::uint32_t>(i % 4), static_cast<std::uint32_t>(t));
+            }
+        });
+        REPORT(combining ? "hot keys, flat combining" : "hot keys, locking",
+               static_cast<double>(operations) * thread_count, seconds);
+    }
+}
+
+/*
+ * Random updates through the locking API and delegated to partition owners
+ */
+void benchmark_partitioned()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1 << 16> Map;
+    const std::size_t operations = 1 << 18;
+    const std::size_t thread_count = std::max(2u, std::thread::hardware_concurrency() / 2);
+    for (int mode = 0; mode < 3; ++mode) {
+        Map map;
+        if (mode != 0) {
+            map.start_partitions(thread_count);
+        }
+        const double seconds = run_threads(thread_count, [&](std::size_t t) {
+            std::uint32_t key = static_cast<std::uint32_t>(t) * 2654435761u;
+            for (std::size_t i = 0; i < operations; ++i) {
+                key = key * 1664525u + 1013904223u;
+                if (mode == 0) {
+                    map.insert_or_assign(key % (1 << 20), key);
+                } else if (mode == 1) {
+                    map.delegate_insert_or_assign(key % (1 << 20), key);
+                } else {
+                    map.post_insert_or_assign(key % (1 << 20), key);
+                }
+            }
+            if (mode == 2) {
+                map.drain_partitions();
+            }
+        });
+        const char* text = mode == 0 ? "random updates, locking" :
+                           mode == 1 ? "random updates, delegated" : "random updates, posted";
+        REPORT(text, static_cast<double>(operations) * thread_count, seconds);
+    }
+}
+
+/*
+ * Random finds in a map much larger than the caches, one by one and in
+ * batches
+ */
+void benchmark_find_batch()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1 << 20> Map;
+    const std::uint32_t key_count = 1 << 21;
+    const std::size_t batch = 256;
+    const std::size_t batches = 4096;
+    Map* map = new Map();
+    for (std::uint32_t i = 0; i < key_count; ++i) {
+        map->insert(i * 2654435761u, i);
+    }
+    std::mt19937 random(7);
+    std::vector<std::uint32_t> keys(batch * batches);
+    for (auto& key : keys) {
+        key = static_cast<std::uint32_t>(random() % key_count) * 2654435761u;
+    }
+    for (int batched = 0; batched < 2; ++batched) {
+        std::vector<std::uint32_t> values(batch);
+        std::unique_ptr<bool[]> found(new bool[batch]);
+        const double seconds = run_threads(1, [&](std::size_t) {
+            std::uint64_t sum = 0;
+            for (std::size_t b = 0; b < batches; ++b) {
+                const std::uint32_t* first = &keys[b * batch];
+                if (batched) {
+                    sum += map->find_batch(first, batch, values.data(), found.get());
+                } else {
+                    for (std::size_t i = 0; i < batch; ++i) {
+                        sum += map->find(first[i]) != map->end();
+                    }
+                }
+            }
+            g_sink += sum;
+        });
+        REPORT(batched ? "out of cache find, batched" : "out of cache find, one by one",
+               static_cast<double>(batch) * batches, seconds);
+    }
+    delete map;
+}
+
+/*
+ * All threads read the same few keys, with and without the read cache
+ */
+void benchmark_cached_find()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1024> Map;
+    const std::size_t operations = 1 << 22;
+    const std::size_t thread_count = std::max(4u, std::thread::hardware_concurrency());
+    Map map;
+    for (std::uint32_t i = 0; i < 16; ++i) {
+        map.insert(i, i);
+    }
+    for (int cached = 0; cached < 2; ++cached) {
+        const double seconds = run_threads(thread_count, [&](std::size_t) {
+            std::uint64_t sum = 0;
+            std::uint32_t value = 0;
+            for (std::size_t i = 0; i < operations; ++i) {
+                if (cached) {
+                    sum += map.cached_find(static_cast<std::uint32_t>(i % 16), value);
+                } else {
+                    sum += map.find(static_cast<std::uint32_t>(i % 16)) != map.end();
+                }
+            }
+            g_sink += sum;
+        });
+        REPORT(cached ? "hot key reads, cached" : "hot key reads, locking",
+               static_cast<double>(operations) * thread_count, seconds);
+    }
+}
+
+/*
+ * Counting random keys in a shared map and in a per CPU map
+ */
+void benchmark_per_cpu()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 4096> Map;
+    typedef thread_safe::PerCpuHashMap<std::uint32_t, std::uint32_t, 4096> PerCpuMap;
+    const std::size_t operations = 1 << 20;
+    const std::size_t thread_count = std::max(4u, std::thread::hardware_concurrency());
+    for (int per_cpu = 0; per_cpu < 2; ++per_cpu) {
+        Map map;
+        PerCpuMap per_cpu_map;
+        const double seconds = run_threads(thread_count, [&](std::size_t t) {
+            std::uint32_t key = static_cast<std::uint32_t>(t);
+            for (std::size_t i = 0; i < operations; ++i) {
+                key = key * 1664525u + 1013904223u;
+                if (per_cpu) {
+                    per_cpu_map.update(key % 10000, 0, [](std::uint32_t& value) { ++value; });
+                } else {
+                    map.insert(key % 10000, 0);
+                    map.async_update(key % 10000, [](std::uint32_t& value) { ++value; }, [](bool) {});
+                }
+            }
+        });
+        if (per_cpu) {
+            g_sink += per_cpu_map.collect(std::plus<std::uint32_t>()).size();
+        }
+        REPORT(per_cpu ? "counting, per CPU shards" : "counting, shared map",
+               static_cast<double>(operations) * thread_count, seconds);
+    }
+}
+
+/*
+ * All threads find the same few keys, with and without reader bias
+ */
+void benchmark_reader_bias()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1024> Map;
+    const std::size_t operations = 1 << 22;
+    const std::size_t thread_count = std::max(4u, std::thread::hardware_concurrency());
+    for (int biased = 0; biased < 2; ++biased) {
+        Map map;
+        for (std::uint32_t i = 0; i < 16; ++i) {
+            map.insert(i, i);
+        }
+        map.set_reader_bias(biased != 0);
+        const double seconds = run_threads(thread_count, [&](std::size_t) {
+            std::uint64_t sum = 0;
+            for (std::size_t i = 0; i < operations; ++i) {
+                sum += map.find(static_cast<std::uint32_t>(i % 16)) != map.end();
+            }
+            g_sink += sum;
+        });
+        REPORT(biased ? "hot key finds, reader bias" : "hot key finds, locking",
+               static_cast<double>(operations) * thread_count, seconds);
+    }
+}
+
+/*
+ * Returns the resident set size of the process in bytes
+ */
+std::size_t resident_bytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    std::size_t pages = 0;
+    std::size_t resident = 0;
+    statm >> pages >> resident;
+    return resident * thread_safe::detail::page_size();
+}
+
+/*
+ * Memory per pair of uint32 maps: nodes allocated with new, nodes from
+ * the NUMA pool and the singly linked nodes of CompactHashMap
+ */
+void benchmark_memory()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1 << 16> Map;
+    typedef thread_safe::CompactHashMap<std::uint32_t, std::uint32_t, 1 << 16> CompactMap;
+    typedef thread_safe::ArenaHashMap<std::uint32_t, std::uint32_t, 1 << 16> ArenaMap;
+    const std::uint32_t count = 1 << 22;
+    const char* names[] = { "bytes per pair, arena",
+                            "bytes per pair, compact",
+                            "bytes per pair, pooled nodes",
+                            "bytes per pair, new nodes" };
+    for (int layout = 0; layout < 4; ++layout) {
+        std::unique_ptr<ArenaMap> arena;
+        std::unique_ptr<CompactMap> compact;
+        std::unique_ptr<Map> map;
+        if (layout == 0) {
+            arena.reset(new ArenaMap());
+        } else if (layout == 1) {
+            compact.reset(new CompactMap());
+        } else {
+            map.reset(new Map(layout == 2 ? thread_safe::MemoryOptions::NUMA_INTERLEAVE
+                                          : thread_safe::MemoryOptions::NUMA_NONE));
+        }
+        // Free memory kept by malloc would be reused without being counted
+        ::malloc_trim(0);
+        const std::size_t before = resident_bytes();
+        for (std::uint32_t i = 0; i < count; ++i) {
+            if (arena) {
+                arena->insert(i, i);
+            } else if (compact) {
+                compact->insert(i, i);
+            } else {
+                map->insert(i, i);
+            }
+        }
+        const std::size_t after = resident_bytes();
+        std::cout << std::left << std::setw(40) << names[layout]
+                  << std::right << std::setw(10) << std::fixed << std::setprecision(2)
+                  << static_cast<double>(after - before) / count << std::endl;
+    }
+}
+
+/*
+ * Inserts and finds of a HashMap and of an ArenaHashMap
+ */
+void benchmark_arena()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1 << 20> Map;
+    typedef thread_safe::ArenaHashMap<std::uint32_t, std::uint32_t, 1 << 20> ArenaMap;
+    const std::size_t operations = 1 << 21;
+    const std::size_t thread_count = std::max(2u, std::thread::hardware_concurrency());
+    for (int use_arena = 0; use_arena < 2; ++use_arena) {
+        std::unique_ptr<Map> map(use_arena ? nullptr : new Map());
+        std::unique_ptr<ArenaMap> arena(use_arena ? new ArenaMap() : nullptr);
+        const double seconds = run_threads(thread_count, [&](std::size_t t) {
+            std::uint64_t sum = 0;
+            std::uint32_t value = 0;
+            for (std::size_t i = t; i < operations; i += thread_count) {
+                const std::uint32_t key = static_cast<std::uint32_t>(i) * 2654435761u;
+                if (use_arena) {
+                    arena->insert(key, key);
+                    sum += arena->find(key ^ 1, value);
+                } else {
+                    map->insert(key, key);
+                    sum += map->find(key ^ 1) != map->end();
+                }
+            }
+            g_sink += sum;
+        });
+        REPORT(use_arena ? "insert and find, arena" : "insert and find, nodes",
+               2.0 * operations, seconds);
+    }
+}
+
+/*
+ * Counts the dTLB load misses of the calling thread while it is alive,
+ * if the kernel and the CPU let the process read the counter
+ */
+class DtlbMissCounter
+{
+public:
+    DtlbMissCounter()
+        : m_fd(-1)
+    {
+        perf_event_attr attr = perf_event_attr();
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB
+                    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (m_fd >= 0) {
+            ::ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ::ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    DtlbMissCounter(const DtlbMissCounter&) = delete;
+    DtlbMissCounter& operator= (const DtlbMissCounter&) = delete;
+
+    ~DtlbMissCounter()
+    {
+        if (m_fd >= 0) {
+            ::close(m_fd);
+        }
+    }
+
+    bool available() const
+    {
+        return m_fd >= 0;
+    }
+
+    std::uint64_t misses() const
+    {
+        std::uint64_t count = 0;
+        if (m_fd < 0 || ::read(m_fd, &count, sizeof(count)) != static_cast<ssize_t>(sizeof(count))) {
+            return 0;
+        }
+        return count;
+    }
+
+private:
+    int m_fd;
+};
+
+/*
+ * Random finds in a map of several hundred MB, with normal pages and
+ * with huge pages, and the dTLB misses per find where they can be read
+ */
+void benchmark_huge_pages()
+{
+    const std::size_t bucket_count = 1 << 21;
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, bucket_count> Map;
+    const std::uint32_t key_count = 1 << 22;
+    const std::size_t lookups = 1 << 22;
+    for (int huge = 0; huge < 2; ++huge) {
+        Map map(thread_safe::MemoryOptions(thread_safe::MemoryOptions::NUMA_NONE, huge != 0));
+        for (std::uint32_t i = 0; i < key_count; ++i) {
+            map.insert(i, i);
+        }
+        std::vector<std::uint32_t> keys(lookups);
+        std::mt19937 random(42);
+        for (auto& key : keys) {
+            key = random() % key_count;
+        }
+        DtlbMissCounter counter;
+        std::uint64_t sum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (const std::uint32_t key : keys) {
+            sum += map.find(key)->get();
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const std::uint64_t misses = counter.misses();
+        g_sink += sum;
+        REPORT(huge ? "find, huge pages" : "find, normal pages", lookups, seconds);
+        std::cout << std::left << std::setw(40) << (huge ? "dTLB misses per find, huge pages"
+                                                         : "dTLB misses per find, normal pages");
+        if (counter.available()) {
+            std::cout << std::right << std::setw(10) << std::fixed << std::setprecision(2)
+                      << static_cast<double>(misses) / lookups << std::endl;
+        } else {
+            std::cout << std::right << std::setw(10) << "n/a" << std::endl;
+        }
+    }
+}
+
+/*
+ * Finds of 4 KB values while one thread replaces them: copying the value
+ * out of a CompactHashMap against taking a handle from a
+ * SharedValueHashMap
+ */
+void benchmark_shared_values()
+{
+    typedef std::array<char, 4096> Block;
+    typedef thread_safe::CompactHashMap<std::uint32_t, Block, 1 << 10> CopyMap;
+    typedef thread_safe::SharedValueHashMap<std::uint32_t, Block, 1 << 10> SharedMap;
+    const std::uint32_t key_count = 1 << 10;
+    const std::size_t operations = 1 << 18;
+    const std::size_t thread_count = std::max(2u, std::thread::hardware_concurrency());
+    // The heap left fragmented by the previous benchmarks slows down the
+    // allocation of the blocks
+    ::malloc_trim(0);
+    for (int shared = 0; shared < 2; ++shared) {
+        CopyMap copy_map;
+        SharedMap shared_map;
+        for (std::uint32_t i = 0; i < key_count; ++i) {
+            Block block;
+            block.fill(static_cast<char>(i));
+            copy_map.insert(i, block);
+            shared_map.insert(i, std::make_shared<const Block>(block));
+        }
+        const double seconds = run_threads(thread_count, [&](std::size_t t) {
+            std::uint64_t sum = 0;
+            Block block;
+            for (std::size_t i = t; i < operations; i += thread_count) {
+                const std::uint32_t key = static_cast<std::uint32_t>(i * 2654435761u) % key_count;
+                if (t == 0) {
+                    // The writer
+                    block.fill(static_cast<char>(i));
+                    if (shared) {
+                        shared_map.assign(key, std::make_shared<const Block>(block));
+                    } else {
+                        copy_map.insert_or_assign(key, block);
+                    }
+                } else if (shared) {
+                    sum += (*shared_map.find(key))[i % block.size()];
+                } else {
+                    copy_map.find(key, block);
+                    sum += block[i % block.size()];
+                }
+            }
+            g_sink += sum;
+        });
+        REPORT(shared ? "4 KB values, shared blocks" : "4 KB values, copies", operations, seconds);
+    }
+}
+
+/*
+ * Reads of one int out of 256 byte pairs: copying the pair out through
+ * a Reference against visiting it in place
+ */
+void benchmark_visit()
+{
+    struct Record
+    {
+        std::uint32_t m_id;
+        char m_payload[252];
+    };
+    typedef thread_safe::HashMap<std::uint32_t, Record, 1 << 12> Map;
+    const std::uint32_t key_count = 1 << 12;
+    const std::size_t lookups = 1 << 22;
+    Map map;
+    for (std::uint32_t i = 0; i < key_count; ++i) {
+        Record record = Record();
+        record.m_id = i;
+        map.insert(i, record);
+    }
+    for (int visit = 0; visit < 2; ++visit) {
+        std::uint64_t sum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < lookups; ++i) {
+            const std::uint32_t key = static_cast<std::uint32_t>(i * 2654435761u) % key_count;
+            if (visit) {
+                map.visit(key, [&sum](const thread_safe::Pair<const std::uint32_t, Record>& value) {
+                    sum += value.second.m_id;
+                });
+            } else {
+                sum += map.find(key)->get().m_id;
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        g_sink += sum;
+        REPORT(visit ? "256 byte pairs, visit" : "256 byte pairs, copy", lookups, seconds);
+    }
+}
+
+/*
+ * Transfers between two random accounts under one global mutex and as
+ * pessimistic and optimistic transactions
+ */
+void benchmark_transactions()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::int64_t, 1 << 16> Accounts;
+    typedef thread_safe::Transaction<Accounts> Transaction;
+    const std::uint32_t account_count = 1 << 16;
+    const std::size_t transfers = 1 << 20;
+    const std::size_t thread_count = std::max(2u, std::thread::hardware_concurrency());
+    const char* names[] = { "transfers, global mutex", "transfers, pessimistic", "transfers, optimistic" };
+    for (int mode = 0; mode < 3; ++mode) {
+        Accounts accounts;
+        for (std::uint32_t i = 0; i < account_count; ++i) {
+            accounts.insert(i, 100);
+        }
+        std::mutex global;
+        const double seconds = run_threads(thread_count, [&](std::size_t t) {
+            for (std::size_t i = t; i < transfers; i += thread_count) {
+                const std::uint32_t from = static_cast<std::uint32_t>(i * 2654435761u) % account_count;
+                const std::uint32_t to = (from + 1 + static_cast<std::uint32_t>(i % 97)) % account_count;
+                if (mode == 0) {
+                    std::lock_guard<std::mutex> lck(global);
+                    auto from_it = accounts.find(from);
+                    auto to_it = accounts.find(to);
+                    from_it->set(from_it->get() - 1);
+                    to_it->set(to_it->get() + 1);
+                    continue;
+                }
+                for (;;) {
+                    Transaction transaction(accounts, {from, to},
+                                            mode == 1 ? Transaction::PESSIMISTIC : Transaction::OPTIMISTIC);
+                    std::int64_t from_balance = 0;
+                    std::int64_t to_balance = 0;
+                    transaction.find(from, from_balance);
+                    transaction.find(to, to_balance);
+                    transaction.insert_or_assign(from, from_balance - 1);
+                    transaction.insert_or_assign(to, to_balance + 1);
+                    if (transaction.commit()) {
+                        break;
+                    }
+                }
+            }
+        });
+        REPORT(names[mode], transfers, seconds);
+    }
+}
+
+/*
+ * Reads of 16 related keys: as one pessimistic transaction, which locks
+ * all their buckets, and with multi_get
+ */
+void benchmark_multi_get()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1 << 16> Map;
+    typedef thread_safe::Transaction<Map> Transaction;
+    const std::uint32_t key_count = 1 << 16;
+    const std::size_t reads = 1 << 18;
+    const std::size_t width = 16;
+    Map map;
+    for (std::uint32_t i = 0; i < key_count; ++i) {
+        map.insert(i, i);
+    }
+    for (int multi_get = 0; multi_get < 2; ++multi_get) {
+        std::vector<std::uint32_t> keys(width);
+        std::uint32_t values[width];
+        bool found[width];
+        std::uint64_t sum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < reads; ++i) {
+            for (std::size_t k = 0; k < width; ++k) {
+                keys[k] = static_cast<std::uint32_t>((i * width + k) * 2654435761u) % key_count;
+            }
+            if (multi_get) {
+                map.multi_get(keys.data(), width, values, found);
+            } else {
+                Transaction transaction(map, keys);
+                for (std::size_t k = 0; k < width; ++k) {
+                    found[k] = transaction.find(keys[k], values[k]);
+                }
+                transaction.commit();
+            }
+            sum += values[i % width];
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        g_sink += sum;
+        REPORT(multi_get ? "16 key reads, multi_get" : "16 key reads, transaction", reads, seconds);
+    }
+}
+
+/*
+ * Ping-pong between two threads, each waiting for the other's change to a
+ * key: with wait_for_change and by polling change_version
+ */
+void benchmark_watch()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 16> Map;
+    const std::size_t rounds = 1 << 14;
+    for (int futex = 0; futex < 2; ++futex) {
+        Map map;
+        const auto wait = [&map, futex](std::uint32_t key, std::uint64_t version) {
+            if (futex) {
+                while (!map.wait_for_change(key, version, std::chrono::seconds(1))) {
+                }
+            } else {
+                while (map.change_version(key) == version) {
+                    std::this_thread::yield();
+                }
+            }
+        };
+        const std::uint64_t ping_version = map.change_version(0);
+        std::uint64_t version = map.change_version(1);
+        const auto start = std::chrono::steady_clock::now();
+        std::thread pong([&map, &wait, ping_version]() {
+            std::uint64_t version = ping_version;
+            for (std::uint32_t i = 0; i < rounds; ++i) {
+                wait(0, version);
+                version = map.change_version(0);
+                map.insert_or_assign(1, i);
+            }
+        });
+        for (std::uint32_t i = 0; i < rounds; ++i) {
+            map.insert_or_assign(0, i);
+            wait(1, version);
+            version = map.change_version(1);
+        }
+        pong.join();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        REPORT(futex ? "ping-pong rounds, wait_for_change" : "ping-pong rounds, polling", rounds, seconds);
+    }
+}
+
+/*
+ * Sums of 1024 consecutive keys out of 256K: through an ordered index range
+ * and with a full scan
+ */
+void benchmark_ordered_index()
+{
+    typedef thread_safe::HashMap<std::uint32_t, std::uint32_t, 1 << 16> Map;
+    const std::uint32_t key_count = 1 << 18;
+    const std::uint32_t width = 1 << 10;
+    const std::size_t scans = 64;
+    Map map;
+    thread_safe::OrderedIndex<std::uint32_t, std::uint32_t> index;
+    index.attach(map);
+    for (std::uint32_t i = 0; i < key_count; ++i) {
+        map.insert(i * 2654435761u % key_count, i);
+    }
+    for (int indexed = 0; indexed < 2; ++indexed) {
+        std::uint64_t sum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < scans; ++i) {
+            const std::uint32_t from = static_cast<std::uint32_t>(i * 2654435761u) % (key_count - width);
+            if (indexed) {
+                index.range(from, from + width, [&map, &sum](std::uint32_t key) {
+                    map.visit(key, [&sum](const Map::value_type& value) {
+                        sum += value.second;
+                    });
+                });
+            } else {
+                map.visit_all([&sum, from](const Map::value_type& value) {
+                    if (value.first >= from && value.first < from + width) {
+                        sum += value.second;
+                    }
+                });
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        g_sink += sum;
+        REPORT(indexed ? "range scanned keys, ordered index" : "range scanned keys, full scan", scans * width, seconds);
+    }
+    index.detach(map);
+}
+
+/*
+ * Lookups of all keys of one tenant by string prefix: counted and visited
+ * through a prefix index, and counted with a full scan
+ */
+void benchmark_prefix_index()
+{
+    typedef thread_safe::FixedString<24> Key;
+    typedef thread_safe::HashMap<Key, std::uint32_t, 1 << 16> Map;
+    const std::uint32_t tenant_count = 256;
+    const std::uint32_t keys_per_tenant = 1 << 10;
+    const std::size_t queries = 64;
+    Map map;
+    thread_safe::PrefixIndex<Key, std::uint32_t> index;
+    index.attach(map);
+    for (std::uint32_t t = 0; t < tenant_count; ++t) {
+        for (std::uint32_t i = 0; i < keys_per_tenant; ++i) {
+            map.insert(Key("tenant" + std::to_string(t) + "/" + std::to_string(i)), i);
+        }
+    }
+    for (int indexed = 0; indexed < 2; ++indexed) {
+        std::uint64_t sum = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (std::size_t q = 0; q < queries; ++q) {
+            const std::string prefix = "tenant" + std::to_string(q * 37 % tenant_count) + "/";
+            if (indexed) {
+                sum += index.count_prefix(prefix);
+            } else {
+                map.visit_all([&sum, &prefix](const Map::value_type& value) {
+                    if (value.first.size() >= prefix.size() &&
+                        std::memcmp(value.first.data(), prefix.data(), prefix.size()) == 0) {
+                        ++sum;
+                    }
+                });
+            }
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        g_sink += sum;
+        REPORT(indexed ? "prefix matched keys, count_prefix" : "prefix matched keys, full scan", queries * keys_per_tenant, seconds);
+    }
+    std::uint64_t sum = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (std::size_t q = 0; q < queries; ++q) {
+        index.for_each_prefix("tenant" + std::to_string(q * 37 % tenant_count) + "/", [&sum](const Key& key) {
+            sum += key.size();
+        });
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    g_sink += sum;
+    REPORT("prefix matched keys, for_each_prefix", queries * keys_per_tenant, seconds);
+    index.detach(map);
+}
+
+void benchmark()
+{
+    std::cout << "NUMA nodes: " << thread_safe::detail::numa_node_count()
+              << ", threads: " << std::thread::hardware_concurrency() << std::endl;
+    benchmark_numa();
+    benchmark_hot_keys();
+    benchmark_partitioned();
+    benchmark_find_batch();
+    benchmark_cached_find();
+    benchmark_per_cpu();
+    benchmark_reader_bias();
+    benchmark_memory();
+    benchmark_arena();
+    benchmark_huge_pages();
+    benchmark_shared_values();
+    benchmark_visit();
+    benchmark_transactions();
+    benchmark_multi_get();
+    benchmark_watch();
+    benchmark_ordered_index();
+    benchmark_prefix_index();
+}
+
+#undef REPORT
@@ -5,7 +5,25 @@
 #include <set>
 #include <thread>
 
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ArenaHashMap.h"
+#include "ChangeLog.h"
+#include "CompactHashMap.h"
+#include "FixedString.h"
+#include "Checkpoint.h"
 #include "HashMap.h"
+#include "OrderedIndex.h"
+#include "PerCpuHashMap.h"
+#include "PersistentHashMap.h"
+#include "PrefixIndex.h"
+#include "SharedHashMap.h"
+#include "SharedValueHashMap.h"
+#include "Transaction.h"
+#include "VersionedHashMap.h"
+#include "Snapshot.h"
 
 #define TEST(x, text) \
 if ((x)) {\
@@ -145,12 +163,1364 @@ void test_iterators()
     TEST(empty_cont.begin() == empty_cont.end(), "Begin of Empty");
 }
 
+void test_persistent()
+{
+    typedef thread_safe::PersistentHashMap<int, int, 64> PersistentContainer;
+    const std::string path = "/tmp/hash_map_unit_test_" + std::to_string(::getpid()) + ".phm";
+    ::unlink(path.c_str());
+    {
+        PersistentContainer cont(path, 1 << 20);
+        for (int i = 0; i < 1000; ++i) {
+            cont.insert(i, i * 2);
+        }
+        cont.insert_or_assign(7, 70);
+        cont.erase(8);
+    }
+    {
+        PersistentContainer cont(path, 0);
+        int value = 0;
+        TEST(!cont.was_recovered() &&
+             cont.size() == 999 &&
+             cont.find(7, value) && value == 70 &&
+             !cont.find(8, value) &&
+             cont.find(999, value) && value == 1998,
+             "Persistent reopen");
+    }
+
+    // A process which dies without closing the map leaves it unclean
+    const pid_t child = ::fork();
+    if (child == 0) {
+        PersistentContainer cont(path, 0);
+        cont.insert(5000, 1);
+        cont.erase(0);
+        ::_exit(0);
+    }
+    ::waitpid(child, nullptr, 0);
+    {
+        PersistentContainer cont(path, 0);
+        int value = 0;
+        TEST(cont.was_recovered() &&
+             cont.size() == 999 &&
+             cont.find(5000, value) && value == 1 &&
+             !cont.find(0, value),
+             "Persistent recovery");
+    }
+    ::unlink(path.c_str());
+}
+
+void test_snapshot()
+{
+    const std::string path = "/tmp/hash_map_unit_test_" + std::to_string(::getpid()) + ".snap";
+    LargeContainer cont;
+    for (int i = 0; i < 10000; ++i) {
+        cont.insert(i, 'A' + i % 26);
+    }
+    thread_safe::Snapshot<LargeContainer>::save(cont, path);
+
+    LargeContainer loaded;
+    loaded.insert(-1, 'Z');
+    thread_safe::Snapshot<LargeContainer>::load(loaded, path, 4);
+    bool same = loaded.size() == cont.size() && loaded.find(-1) == loaded.end();
+    for (int i = 0; i < 10000 && same; ++i) {
+        same = *loaded.find(i) == 'A' + i % 26;
+    }
+    TEST(same, "Snapshot parallel load");
+
+    Container rehashed;
+    thread_safe::Snapshot<Container>::load(rehashed, path, 4);
+    TEST(rehashed.size() == cont.size() && *rehashed.find(9999) == 'A' + 9999 % 26,
+         "Snapshot load into other bucket count");
+    ::unlink(path.c_str());
+}
+
+void test_change_log()
+{
+    const std::string path = "/tmp/hash_map_unit_test_" + std::to_string(::getpid()) + ".log";
+    ::unlink(path.c_str());
+    LargeContainer primary;
+    {
+        thread_safe::ChangeLog<int, char> log(path);
+        primary.set_mutation_listener(&log);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&primary, t]() {
+                for (int i = 0; i < 1000; ++i) {
+                    primary.insert_or_assign(i, 'A' + t);
+                    if (i % 3 == 0) {
+                        primary.erase(i);
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        primary[2000] = 'X';
+        primary[2000] = 'Y';
+        log.flush();
+        primary.set_mutation_listener(nullptr);
+    }
+
+    LargeContainer standby;
+    thread_safe::ChangeLog<int, char>::replay(path, standby);
+    bool same = standby.size() == primary.size();
+    for (auto elem : primary) {
+        const auto pair = elem.get_pair();
+        auto iter = standby.find(pair.first);
+        same = same && iter != standby.end() && *iter == pair.second;
+    }
+    TEST(same, "Change log replay");
+
+    // A second session appends to the same file and changes the same keys
+    {
+        thread_safe::ChangeLog<int, char> log(path);
+        primary.set_mutation_listener(&log);
+        for (int i = 0; i < 1000; ++i) {
+            if (i % 2 == 0) {
+                primary.erase(i);
+            } else {
+                primary.insert_or_assign(i, 'Z');
+            }
+        }
+        primary[2000] = 'W';
+        log.flush();
+        primary.set_mutation_listener(nullptr);
+    }
+    LargeContainer reopened;
+    thread_safe::ChangeLog<int, char>::replay(path, reopened);
+    same = reopened.size() == primary.size();
+    for (auto elem : primary) {
+        const auto pair = elem.get_pair();
+        auto iter = reopened.find(pair.first);
+        same = same && iter != reopened.end() && *iter == pair.second;
+    }
+    TEST(same, "Change log replay after reopening");
+    ::unlink(path.c_str());
+
+    // A full ring has the writer drain it long before the commit interval
+    {
+        thread_safe::ChangeLog<int, char> log(path, 2, std::chrono::seconds(10));
+        LargeContainer cont;
+        cont.set_mutation_listener(&log);
+        const auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < 100; ++i) {
+            cont.insert(i, 'A');
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        cont.set_mutation_listener(nullptr);
+        log.flush();
+        TEST(elapsed < std::chrono::seconds(5), "Change log full ring");
+    }
+    ::unlink(path.c_str());
+
+    // The rings of exited threads are reused by new ones
+    {
+        thread_safe::ChangeLog<int, char> log(path);
+        LargeContainer cont;
+        cont.set_mutation_listener(&log);
+        bool appended = true;
+        for (int i = 0; i < 1500; ++i) {
+            std::thread writer([&cont, &appended, i]() {
+                try {
+                    cont.insert(i, 'A');
+                } catch (...) {
+                    appended = false;
+                }
+            });
+            writer.join();
+        }
+        cont.set_mutation_listener(nullptr);
+        log.flush();
+        LargeContainer replayed;
+        const std::size_t replayed_count = thread_safe::ChangeLog<int, char>::replay(path, replayed);
+        TEST(appended && replayed_count == 1500 && replayed.size() == 1500, "Change log rings of exited threads");
+    }
+    ::unlink(path.c_str());
+}
+
+void test_checkpoint()
+{
+    typedef thread_safe::Checkpoint<LargeContainer> Checkpoint;
+    const std::string prefix = "/tmp/hash_map_unit_test_" + std::to_string(::getpid());
+    const std::vector<std::string> chain = { prefix + ".ckpt0", prefix + ".ckpt1", prefix + ".ckpt2" };
+    LargeContainer cont;
+    for (int i = 0; i < 5000; ++i) {
+        cont.insert(i, 'A');
+    }
+    Checkpoint::write_full(cont, chain[0]);
+    cont[1] = 'B';
+    cont.erase(2);
+    const std::size_t first_delta = Checkpoint::write_delta(cont, chain[1]);
+    cont.insert(6000, 'C');
+    Checkpoint::write_delta(cont, chain[2]);
+    const std::size_t empty_delta = Checkpoint::write_delta(cont, prefix + ".ckpt3");
+    TEST(first_delta == 2 && empty_delta == 0, "Checkpoint dirty buckets");
+
+    LargeContainer loaded;
+    Checkpoint::load(loaded, chain, 4);
+    TEST(loaded.size() == 5000 &&
+         *loaded.find(1) == 'B' &&
+         loaded.find(2) == loaded.end() &&
+         *loaded.find(6000) == 'C',
+         "Checkpoint chain load");
+
+    Checkpoint::compact(chain, prefix + ".ckpt");
+    LargeContainer compacted;
+    Checkpoint::load(compacted, { prefix + ".ckpt" }, 4);
+    TEST(compacted.size() == 5000 && *compacted.find(1) == 'B', "Checkpoint compaction");
+    for (const auto& path : chain) {
+        ::unlink(path.c_str());
+    }
+    ::unlink((prefix + ".ckpt3").c_str());
+    ::unlink((prefix + ".ckpt").c_str());
+}
+
+/*
+ * Keeps the set of keys it hears of
+ */
+class KeySetListener : public thread_safe::MutationListener<LargeContainer::value_type>
+{
+public:
+    void on_insert(const LargeContainer::value_type& value) override
+    {
+        std::lock_guard<std::mutex> lck(m_mutex);
+        m_keys.insert(value.first);
+    }
+    void on_assign(const LargeContainer::value_type&) override {}
+    void on_erase(const LargeContainer::value_type& value) override
+    {
+        std::lock_guard<std::mutex> lck(m_mutex);
+        m_keys.erase(value.first);
+    }
+
+    bool matches(const LargeContainer& cont)
+    {
+        std::lock_guard<std::mutex> lck(m_mutex);
+        std::set<int> keys;
+        cont.visit_all([&keys](const LargeContainer::value_type& value) {
+            keys.insert(value.first);
+        });
+        return keys == m_keys;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::set<int> m_keys;
+};
+
+void test_bulk_changes_reported()
+{
+    const std::string path = "/tmp/hash_map_unit_test_" + std::to_string(::getpid()) + ".bulk";
+    LargeContainer source;
+    for (int i = 0; i < 3000; ++i) {
+        source.insert(i, 'A');
+    }
+    thread_safe::Snapshot<LargeContainer>::save(source, path);
+
+    KeySetListener listener;
+    KeySetListener source_listener;
+    LargeContainer cont;
+    cont.add_mutation_listener(&listener);
+    cont.insert(-1, 'Z');
+    cont = source;
+    const bool copied = listener.matches(cont);
+    cont.insert(-2, 'Z');
+    thread_safe::Snapshot<LargeContainer>::load(cont, path, 4);
+    const bool loaded = listener.matches(cont);
+    source.add_mutation_listener(&source_listener);
+    source.erase(0);
+    cont = std::move(source);
+    // The moved from source has no pairs left
+    const bool moved = listener.matches(cont) && source_listener.matches(LargeContainer()) && cont.size() == 2999;
+    cont.remove_mutation_listener(&listener);
+    TEST(copied && loaded && moved, "Bulk changes reported to listeners");
+    ::unlink(path.c_str());
+}
+
+void test_shared()
+{
+    typedef thread_safe::SharedHashMap<int, int, 64> SharedContainer;
+    const std::string name = "/hash_map_unit_test_" + std::to_string(::getpid());
+    SharedContainer::remove(name);
+    SharedContainer cont(name, 1 << 20);
+
+    pid_t child = ::fork();
+    if (child == 0) {
+        SharedContainer attached(name, 0);
+        for (int i = 0; i < 1000; ++i) {
+            attached.insert(i, i);
+        }
+        ::_exit(0);
+    }
+    ::waitpid(child, nullptr, 0);
+    int value = 0;
+    TEST(cont.size() == 1000 && cont.find(999, value) && value == 999, "Shared memory across processes");
+
+    // A process killed while it changes the map must not leave locks behind
+    child = ::fork();
+    if (child == 0) {
+        SharedContainer attached(name, 0);
+        for (int i = 0; ; i = (i + 1) % 2000) {
+            attached.insert_or_assign(i, -i);
+            attached.erase(i + 1);
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ::kill(child, SIGKILL);
+    ::waitpid(child, nullptr, 0);
+    for (int i = 0; i < 2000; ++i) {
+        cont.insert_or_assign(i, i);
+    }
+    bool all = cont.size() == 2000;
+    for (int i = 0; i < 2000 && all; ++i) {
+        all = cont.find(i, value) && value == i;
+    }
+    TEST(all, "Shared memory after a killed process");
+    SharedContainer::remove(name);
+
+    // A creator which died before it sized the segment leaves it empty
+    // and unlocked, the next process formats it
+    const int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    ::close(fd);
+    bool taken_over = false;
+    {
+        SharedContainer recreated(name, 1 << 20);
+        taken_over = recreated.insert(1, 1) && recreated.find(1, value) && value == 1;
+    }
+    TEST(fd >= 0 && taken_over, "Shared memory of a dead creator");
+    SharedContainer::remove(name);
+}
+
+void test_numa()
+{
+    const thread_safe::MemoryOptions::Numa modes[] = { thread_safe::MemoryOptions::NUMA_INTERLEAVE,
+                                                       thread_safe::MemoryOptions::NUMA_PARTITION };
+    for (const auto mode : modes) {
+        LargeContainer cont{thread_safe::MemoryOptions(mode)};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&cont, t]() {
+                for (int i = t; i < 4000; i += 4) {
+                    cont.insert(i, 'A');
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (int i = 0; i < 4000; i += 2) {
+            cont.erase(i);
+        }
+        LargeContainer copy(cont);
+        LargeContainer moved(std::move(copy));
+        const char* text = mode == thread_safe::MemoryOptions::NUMA_INTERLEAVE ? "NUMA interleave" : "NUMA partition";
+        TEST(cont.size() == 2000 && moved.size() == 2000 && *moved.find(1) == 'A', text);
+    }
+}
+
+void test_huge_pages()
+{
+    const thread_safe::MemoryOptions::Numa modes[] = { thread_safe::MemoryOptions::NUMA_NONE,
+                                                       thread_safe::MemoryOptions::NUMA_PARTITION };
+    bool all = true;
+    for (const auto mode : modes) {
+        LargeContainer cont{thread_safe::MemoryOptions(mode, true)};
+        for (int i = 0; i < 4000; ++i) {
+            cont.insert(i, 'A');
+        }
+        for (int i = 0; i < 4000; i += 2) {
+            cont.erase(i);
+        }
+        LargeContainer moved(std::move(cont));
+        all = all && moved.size() == 2000 && *moved.find(1) == 'A' && moved.find(2) == moved.end();
+    }
+    thread_safe::ArenaHashMap<int, char, 10> arena{thread_safe::MemoryOptions(thread_safe::MemoryOptions::NUMA_NONE, true)};
+    for (int i = 0; i < 4000; ++i) {
+        arena.insert(i, 'B');
+    }
+    char value = 0;
+    TEST(all && arena.size() == 4000 && arena.find(3999, value) && value == 'B', "Huge pages");
+}
+
+void test_flat_combining()
+{
+    Container cont;
+    cont.set_flat_combining(true);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&cont, t]() {
+            for (int i = t * 500; i < (t + 1) * 500; ++i) {
+                cont.insert(i, 'A');
+                cont.insert_or_assign(i, 'B');
+                if (i % 2 == 0) {
+                    cont.erase(i);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    bool all = cont.size() == 2000;
+    for (int i = 1; i < 4000 && all; i += 2) {
+        all = *cont.find(i) == 'B' && cont.find(i - 1) == cont.end();
+    }
+    TEST(all, "Flat combining");
+}
+
+void test_partitioned()
+{
+    LargeContainer cont;
+    cont.start_partitions(4);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont, t]() {
+            for (int i = t * 500; i < (t + 1) * 500; ++i) {
+                cont.post_insert(i, 'A');
+                cont.post_insert_or_assign(i, 'B');
+                if (i % 2 == 0) {
+                    cont.post_erase(i);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    cont.drain_partitions();
+    bool all = true;
+    for (int i = 0; i < 2000 && all; ++i) {
+        char value = 0;
+        const bool found = cont.delegate_find(i, value);
+        all = i % 2 == 0 ? !found : found && value == 'B';
+    }
+    TEST(all, "Partitioned posting");
+
+    const bool inserted = cont.delegate_insert(5000, 'C') && !cont.delegate_insert(5000, 'D');
+    cont.delegate_insert_or_assign(5000, 'E');
+    char value = 0;
+    const bool erased = cont.delegate_find(5000, value) && value == 'E' &&
+                        cont.delegate_erase(5000) && !cont.delegate_erase(5000);
+    TEST(inserted && erased, "Partitioned delegation");
+    cont.stop_partitions();
+    TEST(cont.size() == 1000 && *cont.find(1) == 'B', "Partitioned stop");
+
+    bool rejected = false;
+    try {
+        cont.post_insert(6000, 'F');
+    } catch (const std::logic_error&) {
+        rejected = true;
+    }
+    TEST(rejected && cont.find(6000) == cont.end(), "Partitioned calls without partitions");
+}
+
+/*
+ * Holds the lock of the bucket being inserted to until it is released
+ */
+class BlockingListener : public thread_safe::MutationListener<Container::value_type>
+{
+public:
+    BlockingListener()
+        : m_blocked(false)
+        , m_release(false)
+    {}
+
+    void on_insert(const Container::value_type&) override
+    {
+        m_blocked.store(true);
+        while (!m_release.load()) {
+            std::this_thread::yield();
+        }
+    }
+    void on_assign(const Container::value_type&) override {}
+    void on_erase(const Container::value_type&) override {}
+
+    std::atomic<bool> m_blocked;
+    std::atomic<bool> m_release;
+};
+
+void test_async()
+{
+    Container cont;
+    BlockingListener listener;
+    cont.set_mutation_listener(&listener);
+    std::thread inserter([&cont]() {
+        cont.insert(1, 'A');
+    });
+    while (!listener.m_blocked.load()) {
+        std::this_thread::yield();
+    }
+    std::atomic<int> calls(0);
+    char found = 0;
+    cont.async_find(1, [&calls, &found](const thread_safe::Pair<bool, char>& result) {
+        found = result.first ? result.second : 0;
+        ++calls;
+    });
+    const bool suspended = calls.load() == 0;
+    listener.m_release.store(true);
+    inserter.join();
+    cont.set_mutation_listener(nullptr);
+    TEST(suspended && calls.load() == 1 && found == 'A', "Async find on a locked bucket");
+
+    // Queued calls run in the order they were queued, also behind a call
+    // queued by one of them
+    BlockingListener blocker;
+    cont.set_mutation_listener(&blocker);
+    std::thread holder([&cont]() {
+        cont.insert(2, 'B');
+    });
+    while (!blocker.m_blocked.load()) {
+        std::this_thread::yield();
+    }
+    std::vector<int> order;
+    for (int i = 0; i < 10; ++i) {
+        cont.async_find(2, [&cont, &order, i](const thread_safe::Pair<bool, char>&) {
+            order.push_back(i);
+            if (i == 0) {
+                cont.async_find(2, [&order](const thread_safe::Pair<bool, char>&) {
+                    order.push_back(10);
+                });
+            }
+        });
+    }
+    blocker.m_release.store(true);
+    holder.join();
+    cont.set_mutation_listener(nullptr);
+    bool in_order = order.size() == 11;
+    for (int i = 0; i < 11 && in_order; ++i) {
+        in_order = order[i] == i;
+    }
+    TEST(in_order, "Async calls in queue order");
+
+    std::vector<std::thread> threads;
+    std::atomic<int> inserted(0);
+    std::atomic<int> updated(0);
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont, &inserted, &updated]() {
+            for (int i = 0; i < 1000; ++i) {
+                cont.async_insert(i % 20 + 100, 0, [&inserted](bool result) {
+                    inserted += result;
+                });
+                cont.async_update(i % 20 + 100, [](char& value) { ++value; }, [&updated](bool result) {
+                    updated += result;
+                });
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    bool all = inserted.load() == 20 && updated.load() == 4000;
+    for (int i = 100; i < 120 && all; ++i) {
+        all = *cont.find(i) == static_cast<char>(200);
+    }
+    TEST(all, "Async insert and update");
+
+    // The transaction unlocks the bucket of 2 first, the callback must
+    // wait until it has also left the bucket of 1
+    typedef thread_safe::HashMap<int, int, 4> SmallContainer;
+    typedef thread_safe::Transaction<SmallContainer> Transaction;
+    SmallContainer small;
+    std::atomic<bool> probed(false);
+    std::atomic<bool> outside(false);
+    std::thread prober;
+    {
+        Transaction transaction(small, {1, 2}, Transaction::PESSIMISTIC);
+        std::thread([&small, &probed, &outside, &prober]() {
+            small.async_insert(2, 20, [&small, &probed, &outside, &prober](bool) {
+                prober = std::thread([&small, &probed]() {
+                    small.insert(1, 10);
+                    probed.store(true);
+                });
+                const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+                while (!probed.load() && std::chrono::steady_clock::now() < deadline) {
+                    std::this_thread::yield();
+                }
+                outside.store(probed.load());
+            });
+        }).join();
+    }
+    prober.join();
+    TEST(outside.load(), "Async callback after all bucket locks are left");
+
+    typedef thread_safe::Bucket<int, thread_safe::Pair<int, int>, std::equal_to<int> > PlainBucket;
+    TEST(sizeof(PlainBucket) <= 64, "Bucket without waiters fits a cache line");
+}
+
+#if defined(__cpp_impl_coroutine)
+/*
+ * A coroutine type which starts at once and frees itself at the end
+ */
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return DetachedTask(); }
+        std::suspend_never initial_suspend() { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+DetachedTask insert_find_update(Container& cont, int key, std::atomic<int>& done, std::atomic<bool>& correct)
+{
+    const bool inserted = co_await cont.async_insert(key, 'A');
+    const bool updated = co_await cont.async_update(key, [](char& value) { ++value; });
+    const thread_safe::Pair<bool, char> found = co_await cont.async_find(key);
+    if (!inserted || !updated || !found.first || found.second != 'B') {
+        correct = false;
+    }
+    ++done;
+}
+
+void test_async_coroutines()
+{
+    Container cont;
+    BlockingListener listener;
+    cont.set_mutation_listener(&listener);
+    std::thread holder([&cont]() {
+        cont.insert(0, 'Z');
+    });
+    while (!listener.m_blocked.load()) {
+        std::this_thread::yield();
+    }
+    // Key 10 shares the bucket of key 0, so the coroutine is suspended
+    std::atomic<int> done(0);
+    std::atomic<bool> correct(true);
+    insert_find_update(cont, 10, done, correct);
+    const bool suspended = done.load() == 0;
+    listener.m_release.store(true);
+    holder.join();
+    cont.set_mutation_listener(nullptr);
+    for (int key = 20; key < 120; ++key) {
+        insert_find_update(cont, key, done, correct);
+    }
+    TEST(suspended && done.load() == 101 && correct.load(), "Async coroutines");
+}
+#endif
+
+void test_find_batch()
+{
+    LargeContainer cont;
+    for (int i = 0; i < 3000; i += 3) {
+        cont.insert(i, static_cast<char>(i % 100));
+    }
+    std::vector<int> keys;
+    for (int i = 0; i < 3000; ++i) {
+        keys.push_back(i * 7 % 3000);
+    }
+    std::vector<char> values(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    const std::size_t count = cont.find_batch(keys.data(), keys.size(), values.data(), found.get());
+    bool all = count == 1000;
+    for (std::size_t i = 0; i < keys.size() && all; ++i) {
+        all = found[i] == (keys[i] % 3 == 0) && (!found[i] || values[i] == keys[i] % 100);
+    }
+    TEST(all, "Batch find");
+
+    // Batches read reader biased buckets next to each other and a writer
+    cont.set_reader_bias(true);
+    std::atomic<bool> consistent(true);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 2; ++t) {
+        threads.emplace_back([&cont, &keys, &consistent]() {
+            std::vector<char> local_values(keys.size());
+            std::unique_ptr<bool[]> local_found(new bool[keys.size()]);
+            for (int round = 0; round < 20; ++round) {
+                if (cont.find_batch(keys.data(), keys.size(), local_values.data(), local_found.get()) != 1000) {
+                    consistent = false;
+                }
+            }
+        });
+    }
+    threads.emplace_back([&cont]() {
+        for (int round = 0; round < 20; ++round) {
+            for (int i = 0; i < 3000; i += 30) {
+                cont.insert_or_assign(i, static_cast<char>(i % 100));
+            }
+        }
+    });
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    cont.set_reader_bias(false);
+    TEST(consistent.load(), "Batch find with reader bias");
+}
+
+void test_cached_find()
+{
+    Container cont;
+    cont.insert(1, 'A');
+    char value = 0;
+    bool all = cont.cached_find(1, value) && value == 'A';
+    all = all && cont.cached_find(1, value) && value == 'A' && !cont.cached_find(2, value);
+    cont.insert_or_assign(1, 'B');
+    cont.insert(2, 'C');
+    all = all && cont.cached_find(1, value) && value == 'B' && cont.cached_find(2, value) && value == 'C';
+    cont[1].set('D');
+    all = all && cont.cached_find(1, value) && value == 'D';
+    std::thread([&cont]() {
+        cont.erase(1);
+    }).join();
+    all = all && !cont.cached_find(1, value);
+    {
+        // A new map must not see the entries of the old one
+        Container other;
+        all = all && !other.cached_find(2, value);
+    }
+    TEST(all, "Cached find");
+}
+
+void test_per_cpu()
+{
+    thread_safe::PerCpuHashMap<int, int, 64> cont;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont]() {
+            for (int i = 0; i < 10000; ++i) {
+                cont.update(i % 100, 0, [](int& value) { ++value; });
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    cont.insert_or_assign(1000, 7);
+    const auto merged = cont.collect(std::plus<int>());
+    bool all = merged.size() == 101 && *merged.find(1000) == 7;
+    for (int i = 0; i < 100 && all; ++i) {
+        all = *merged.find(i) == 400;
+    }
+    cont.clear();
+    TEST(all && cont.collect(std::plus<int>()).empty(), "Per CPU aggregation");
+}
+
+void test_reader_bias()
+{
+    Container cont;
+    cont.set_reader_bias(true);
+    for (int i = 0; i < 10; ++i) {
+        cont.insert(i, 'A');
+    }
+    std::atomic<bool> stop(false);
+    std::atomic<bool> consistent(true);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 4; ++t) {
+        readers.emplace_back([&cont, &stop, &consistent]() {
+            while (!stop.load()) {
+                for (int i = 0; i < 10; ++i) {
+                    auto it = cont.find(i);
+                    if (it == cont.end() || (*it != 'A' && *it != 'B')) {
+                        consistent.store(false);
+                    }
+                }
+            }
+        });
+    }
+    for (int round = 0; round < 200; ++round) {
+        cont.insert_or_assign(round % 10, round % 2 == 0 ? 'B' : 'A');
+    }
+    cont.insert_or_assign(3, 'B');
+    const bool seen = *cont.find(3) == 'B';
+    stop.store(true);
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    cont.set_reader_bias(false);
+    TEST(consistent.load() && seen && cont.size() == 10, "Reader biased buckets");
+}
+
+void test_compact()
+{
+    thread_safe::CompactHashMap<int, char, 10> cont;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont, t]() {
+            for (int i = t * 500; i < (t + 1) * 500; ++i) {
+                cont.insert(i, 'A');
+                cont.insert_or_assign(i, 'B');
+                if (i % 2 == 0) {
+                    cont.erase(i);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    bool all = cont.size() == 1000 && !cont.insert(1, 'C') && !cont.erase(0);
+    for (int i = 0; i < 2000 && all; ++i) {
+        char value = 0;
+        all = cont.find(i, value) == (i % 2 == 1) && (i % 2 == 0 || value == 'B');
+    }
+    std::size_t visited = 0;
+    cont.for_each([&visited](const thread_safe::Pair<const int, char>& value) {
+        visited += value.second == 'B';
+    });
+    cont.clear();
+    TEST(all && visited == 1000 && cont.empty(), "Compact map");
+
+    // Erased nodes are reused by the inserts into their bucket
+    bool reused = true;
+    for (int round = 0; round < 3 && reused; ++round) {
+        for (int i = 0; i < 100; ++i) {
+            reused = reused && cont.insert(i, static_cast<char>('a' + round));
+        }
+        for (int i = 0; i < 100; ++i) {
+            char value = 0;
+            reused = reused && cont.find(i, value) && value == 'a' + round && cont.erase(i);
+        }
+    }
+    TEST(reused && cont.empty(), "Compact map node reuse");
+}
+
+void test_arena()
+{
+    thread_safe::ArenaHashMap<int, char, 10> cont;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont, t]() {
+            for (int i = t * 500; i < (t + 1) * 500; ++i) {
+                cont.insert(i, 'A');
+                cont.insert_or_assign(i, 'B');
+                if (i % 2 == 0) {
+                    cont.erase(i);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    bool all = cont.size() == 1000 && !cont.insert(1, 'C') && !cont.erase(0);
+    for (int i = 0; i < 2000 && all; ++i) {
+        char value = 0;
+        all = cont.find(i, value) == (i % 2 == 1) && (i % 2 == 0 || value == 'B');
+    }
+    // Freed nodes are reused
+    for (int i = 0; i < 2000; i += 2) {
+        cont.insert(i, 'D');
+    }
+    std::size_t visited = 0;
+    cont.for_each([&visited](const thread_safe::Pair<const int, char>& value) {
+        visited += value.second == 'B' || value.second == 'D';
+    });
+    cont.clear();
+    TEST(all && visited == 2000 && cont.empty(), "Arena map");
+
+    // No free index is handed to two threads at once
+    thread_safe::NodeArena<std::uint64_t> arena;
+    std::atomic<bool> exclusive(true);
+    threads.clear();
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&arena, &exclusive, t]() {
+            std::uint32_t held[8];
+            for (int round = 0; round < 5000; ++round) {
+                for (auto& index : held) {
+                    index = arena.allocate();
+                    *arena.at(index) = static_cast<std::uint64_t>(t);
+                }
+                for (auto index : held) {
+                    exclusive = exclusive && *arena.at(index) == static_cast<std::uint64_t>(t);
+                    arena.deallocate(index);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    TEST(exclusive.load(), "Arena free list");
+}
+
+void test_shared_values()
+{
+    typedef std::vector<int> Block;
+    thread_safe::SharedValueHashMap<int, Block, 10> cont;
+    for (int i = 0; i < 100; ++i) {
+        cont.insert(i, std::make_shared<const Block>(256, 0));
+    }
+    std::atomic<bool> torn(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont, &torn, t]() {
+            for (int round = 0; round < 500; ++round) {
+                const int key = (round + t) % 100;
+                if (t % 2 == 0) {
+                    cont.update(key, [](const Block& block) {
+                        return std::make_shared<const Block>(block.size(), block.front() + 1);
+                    });
+                } else {
+                    const auto handle = cont.find(key);
+                    for (const int element : *handle) {
+                        torn = torn || element != handle->front();
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    int sum = 0;
+    cont.for_each([&sum](const int&, const std::shared_ptr<const Block>& block) {
+        sum += block->front();
+    });
+    const auto kept = cont.find(7);
+    cont.insert_or_assign(7, std::make_shared<const Block>(1, -1));
+    cont.erase(7);
+    TEST(!torn && sum == 1000 && kept->size() == 256 && !cont.find(7) && cont.size() == 99,
+         "Shared value blocks");
+}
+
+void test_visit()
+{
+    struct Record
+    {
+        int m_id;
+        char m_payload[252];
+    };
+    thread_safe::HashMap<int, Record, 10> cont;
+    for (int i = 0; i < 100; ++i) {
+        Record record = Record();
+        record.m_id = i;
+        cont.insert(i, record);
+    }
+    int id = -1;
+    const bool found = cont.visit(42, [&id](const thread_safe::Pair<const int, Record>& value) {
+        id = value.second.m_id;
+    });
+    const bool missing = cont.visit(100, [&id](const thread_safe::Pair<const int, Record>&) {
+        id = -1;
+    });
+    int sum = 0;
+    int count = 0;
+    cont.visit_all([&sum, &count](const thread_safe::Pair<const int, Record>& value) {
+        sum += value.first == value.second.m_id ? value.first : 0;
+        ++count;
+    });
+    TEST(found && !missing && id == 42 && sum == 4950 && count == 100, "Visit in place");
+}
+
+void test_get_or_insert_with()
+{
+    Container cont;
+    std::atomic<int> made(0);
+    std::atomic<bool> all(true);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont, &made, &all]() {
+            for (int i = 0; i < 1000; ++i) {
+                auto result = cont.get_or_insert_with(i, [&made, i]() {
+                    ++made;
+                    return static_cast<char>('A' + i % 26);
+                });
+                all = all && result.first->get() == 'A' + i % 26;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const bool hit = !cont.get_or_insert_with(5, []() { return 'Z'; }).second;
+    const char value = cont[2000];
+    TEST(all && made == 1000 && hit && value == 0 && cont.size() == 1001, "Get or insert with a factory");
+}
+
+void test_transactions()
+{
+    typedef thread_safe::HashMap<int, int, 4> Accounts;
+    typedef thread_safe::Transaction<Accounts> Transaction;
+    Accounts accounts;
+    for (int i = 0; i < 10; ++i) {
+        accounts.insert(i, 100);
+    }
+    std::atomic<int> failed(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&accounts, &failed, t]() {
+            const Transaction::Mode mode = t % 2 == 0 ? Transaction::PESSIMISTIC : Transaction::OPTIMISTIC;
+            for (int i = 0; i < 1000; ++i) {
+                const int from = (i * 7 + t) % 10;
+                const int to = (i * 3 + t + 1) % 10;
+                for (;;) {
+                    Transaction transaction(accounts, {from, to}, mode);
+                    int from_balance = 0;
+                    int to_balance = 0;
+                    transaction.find(from, from_balance);
+                    transaction.find(to, to_balance);
+                    transaction.insert_or_assign(from, from_balance - 1);
+                    transaction.find(to, to_balance);
+                    transaction.insert_or_assign(to, to_balance + 1);
+                    if (transaction.commit()) {
+                        break;
+                    }
+                    ++failed;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    int sum = 0;
+    for (int i = 0; i < 10; ++i) {
+        sum += accounts.find(i)->get();
+    }
+    bool rejected = false;
+    {
+        Transaction transaction(accounts, {1, 2});
+        transaction.erase(2);
+        try {
+            transaction.insert_or_assign(3, 0);
+        } catch (const std::invalid_argument&) {
+            rejected = transaction.commit();
+        }
+    }
+    TEST(sum == 1000 && rejected && accounts.size() == 9, "Transactions");
+}
+
+void test_multi_get()
+{
+    typedef thread_safe::HashMap<int, int, 4> Accounts;
+    typedef thread_safe::Transaction<Accounts> Transaction;
+    Accounts accounts;
+    int keys[10];
+    for (int i = 0; i < 10; ++i) {
+        accounts.insert(i, 100);
+        keys[i] = i;
+    }
+    std::atomic<bool> done(false);
+    std::thread writer([&accounts, &done]() {
+        for (int i = 0; i < 2000; ++i) {
+            Transaction transaction(accounts, {i % 10, (i + 3) % 10});
+            int from = 0;
+            int to = 0;
+            transaction.find(i % 10, from);
+            transaction.find((i + 3) % 10, to);
+            transaction.insert_or_assign(i % 10, from - 1);
+            transaction.insert_or_assign((i + 3) % 10, to + 1);
+            transaction.commit();
+        }
+        done = true;
+    });
+    bool consistent = true;
+    std::size_t reads = 0;
+    while (!done || reads == 0) {
+        int values[10];
+        bool found[10];
+        const std::size_t found_count = accounts.multi_get(keys, 10, values, found);
+        int sum = 0;
+        for (int i = 0; i < 10; ++i) {
+            sum += values[i];
+        }
+        consistent = consistent && found_count == 10 && sum == 1000;
+        ++reads;
+    }
+    writer.join();
+    int value = 0;
+    bool found = true;
+    const int missing = 42;
+    TEST(consistent && accounts.multi_get(&missing, 1, &value, &found) == 0 && !found, "Consistent multi get");
+}
+
+void test_versions()
+{
+    thread_safe::VersionedHashMap<int, int, 10> cont;
+    cont.insert(1, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont]() {
+            for (int i = 0; i < 500; ++i) {
+                int value = 0;
+                std::uint64_t version = 0;
+                do {
+                    cont.find(1, value, version);
+                } while (!cont.put_if_version(1, value + 1, version));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    int value = 0;
+    std::uint64_t version = 0;
+    const bool found = cont.find(1, value, version);
+    const bool stale = cont.put_if_version(1, -1, version - 1);
+    cont.erase(1);
+    const bool absent = cont.version(1) == 0 && !cont.put_if_version(1, -1, version);
+    const std::uint64_t reinserted = cont.insert_or_assign(1, 7);
+    TEST(found && value == 2000 && version >= 2001 && !stale && absent && reinserted > version &&
+         !cont.insert(1, 8) && cont.version(1) == reinserted, "Version stamps");
+}
+
+/*
+ * A mapped value whose sequence number does not take part in comparisons
+ */
+struct Reading
+{
+    int m_value;
+    int m_sequence;
+
+    bool operator== (const Reading& that) const
+    {
+        return m_value == that.m_value;
+    }
+};
+
+void test_watch()
+{
+    thread_safe::HashMap<int, int, 10> cont;
+    const std::uint64_t version = cont.change_version(1);
+    const bool timed_out = !cont.wait_for_change(1, version, std::chrono::milliseconds(10));
+    std::thread writer([&cont]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        cont.insert_or_assign(1, 1);
+    });
+    const bool changed = cont.wait_for_change(1, version, std::chrono::seconds(10));
+    writer.join();
+
+    std::atomic<int> calls(0);
+    std::atomic<int> last(0);
+    {
+        auto watch = cont.watch(1, [&calls, &last](const thread_safe::Pair<bool, int>& value) {
+            last = value.first ? value.second : -1;
+            ++calls;
+        });
+        cont.insert_or_assign(1, 1);
+        cont.insert_or_assign(11, 5);
+        cont.insert_or_assign(1, 2);
+        for (int i = 0; i < 1000 && last != 2; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        cont.erase(1);
+        for (int i = 0; i < 1000 && last != -1; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    const int calls_before = calls;
+    cont.insert_or_assign(1, 3);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    TEST(timed_out && changed && calls_before == 2 && last == -1 && calls == calls_before, "Watch changes");
+
+    // Mapped values are compared with their operator==
+    thread_safe::HashMap<int, Reading, 10> readings;
+    readings.insert_or_assign(1, Reading{ 1, 0 });
+    std::atomic<int> reading_calls(0);
+    std::atomic<int> last_reading(0);
+    {
+        auto watch = readings.watch(1, [&reading_calls, &last_reading](const thread_safe::Pair<bool, Reading>& value) {
+            last_reading = value.second.m_value;
+            ++reading_calls;
+        });
+        readings.insert_or_assign(1, Reading{ 1, 7 });
+        readings.insert_or_assign(1, Reading{ 2, 8 });
+        for (int i = 0; i < 1000 && last_reading != 2; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    TEST(reading_calls == 1 && last_reading == 2, "Watch compares with operator==");
+}
+
+void test_ordered_index()
+{
+    typedef thread_safe::HashMap<int, int, 64> Map;
+    Map cont;
+    for (int i = 0; i < 1000; i += 2) {
+        cont.insert(i, i);
+    }
+    thread_safe::OrderedIndex<int, int> index;
+    index.attach(cont);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont, t]() {
+            for (int i = t; i < 2000; i += 4) {
+                cont.insert_or_assign(i, i);
+                if (i % 3 == 0) {
+                    cont.erase(i);
+                }
+            }
+        });
+    }
+    bool ordered = true;
+    std::thread reader([&index, &done, &ordered]() {
+        while (!done) {
+            int last = -1;
+            index.range(100, 1900, [&last, &ordered](int key) {
+                ordered = ordered && key > last && key >= 100 && key < 1900;
+                last = key;
+            });
+        }
+    });
+    std::thread purger([&index, &done]() {
+        while (!done) {
+            index.purge();
+            std::this_thread::yield();
+        }
+    });
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    done = true;
+    reader.join();
+    purger.join();
+
+    std::vector<int> keys;
+    index.for_each([&keys](int key) {
+        keys.push_back(key);
+    });
+    std::set<int> expected;
+    cont.visit_all([&expected](const Map::value_type& value) {
+        expected.insert(value.first);
+    });
+    int in_range = 0;
+    index.range(10, 20, [&in_range](int) {
+        ++in_range;
+    });
+    int bound = -1;
+    const bool has_bound = index.lower_bound(999, bound) && bound == 1000;
+    const bool past_end = !index.lower_bound(2000, bound);
+    const bool same = std::vector<int>(expected.begin(), expected.end()) == keys && index.size() == expected.size();
+    cont.erase(1000);
+    index.purge();
+    const bool purged = index.size() == expected.size() - 1 && index.lower_bound(1000, bound) && bound == 1001;
+    index.detach(cont);
+    TEST(ordered && same && in_range == 7 && has_bound && past_end && purged, "Ordered index");
+
+    // An index next to a change log, attached in either order
+    const std::string path = "/tmp/hash_map_unit_test_" + std::to_string(::getpid()) + ".index.log";
+    ::unlink(path.c_str());
+    Map logged;
+    thread_safe::OrderedIndex<int, int> first;
+    thread_safe::OrderedIndex<int, int> second;
+    {
+        thread_safe::ChangeLog<int, int> log(path);
+        first.attach(logged);
+        logged.add_mutation_listener(&log);
+        second.attach(logged);
+        for (int i = 0; i < 100; ++i) {
+            logged.insert(i, i);
+        }
+        logged.erase(50);
+        log.flush();
+        logged.remove_mutation_listener(&log);
+    }
+    Map replayed;
+    thread_safe::ChangeLog<int, int>::replay(path, replayed);
+    bool together = replayed.size() == 99 && first.size() == 99 && second.size() == 99;
+    first.for_each([&replayed, &together](int key) {
+        together = together && replayed.find(key) != replayed.end();
+    });
+    first.detach(logged);
+    second.detach(logged);
+    TEST(together, "Ordered index next to a change log");
+    ::unlink(path.c_str());
+}
+
+void test_prefix_index()
+{
+    typedef thread_safe::FixedString<24> Key;
+    typedef thread_safe::HashMap<Key, int, 64> Map;
+    Map cont;
+    cont.insert(Key("tenant1/a"), 0);
+    thread_safe::PrefixIndex<Key, int> index;
+    index.attach(cont);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&cont, t]() {
+            for (int i = 0; i < 200; ++i) {
+                const Key key("tenant" + std::to_string(t) + "/" + std::to_string(i));
+                cont.insert_or_assign(key, i);
+                if (i % 2 == 0) {
+                    cont.erase(key);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::vector<std::string> keys;
+    index.for_each_prefix("tenant1/", [&keys](const Key& key) {
+        keys.push_back(key.str());
+    });
+    std::vector<std::string> expected;
+    cont.visit_all([&expected](const Map::value_type& value) {
+        if (value.first.str().compare(0, 8, "tenant1/") == 0) {
+            expected.push_back(value.first.str());
+        }
+    });
+    std::sort(expected.begin(), expected.end());
+    const bool counted = index.count_prefix("tenant1/") == 101 && index.count_prefix("tenant1/1") == 56 &&
+                         index.count_prefix("tenant") == 401 && index.count_prefix("tenant9") == 0 &&
+                         index.count_prefix("") == index.size() && index.size() == cont.size();
+    for (int i = 0; i < 200; ++i) {
+        cont.erase(Key("tenant2/" + std::to_string(i)));
+    }
+    const bool erased = index.count_prefix("tenant2/") == 0 && index.keys_with_prefix("tenant2").empty() &&
+                        index.size() == 301;
+    index.detach(cont);
+    TEST(keys == expected && keys.size() == 101 && counted && erased, "Prefix index");
+
+    // A change log attached before the index keeps logging
+    const std::string path = "/tmp/hash_map_unit_test_" + std::to_string(::getpid()) + ".prefix.log";
+    ::unlink(path.c_str());
+    Map logged;
+    thread_safe::PrefixIndex<Key, int> logged_index;
+    {
+        thread_safe::ChangeLog<Key, int> log(path);
+        logged.add_mutation_listener(&log);
+        logged_index.attach(logged);
+        for (int i = 0; i < 20; ++i) {
+            logged.insert(Key("log/" + std::to_string(i)), i);
+        }
+        log.flush();
+        logged.remove_mutation_listener(&log);
+    }
+    Map replayed;
+    thread_safe::ChangeLog<Key, int>::replay(path, replayed);
+    logged_index.detach(logged);
+    TEST(replayed.size() == 20 && logged_index.count_prefix("log/1") == 11, "Prefix index next to a change log");
+    ::unlink(path.c_str());
+}
+
 void test()
 {
     test_constructors();
     test_mutators();
     test_selectors();
     test_iterators();
+    test_persistent();
+    test_snapshot();
+    test_change_log();
+    test_checkpoint();
+    test_bulk_changes_reported();
+    test_shared();
+    test_numa();
+    test_huge_pages();
+    test_flat_combining();
+    test_partitioned();
+    test_async();
+#if defined(__cpp_impl_coroutine)
+    test_async_coroutines();
+#endif
+    test_find_batch();
+    test_cached_find();
+    test_per_cpu();
+    test_reader_bias();
+    test_compact();
+    test_arena();
+    test_shared_values();
+    test_visit();
+    test_get_or_insert_with();
+    test_transactions();
+    test_multi_get();
+    test_versions();
+    test_watch();
+    test_ordered_index();
+    test_prefix_index();
 }
 
 #undef LargeContainer